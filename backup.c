@@ -21,20 +21,29 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "backup.h"
 #include "buffer.h"
+#include "catalog.h"
+#include "chunk.h"
+#include "codec.h"
+#include "dircache.h"
 #include "exclude.h"
+#include "history.h"
 #include "metadata.h"
 #include "nibackup.h"
+#include "pool.h"
+#include "rename.h"
+#include "uring.h"
 
 #define PERRLN(str) do { \
     fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
@@ -44,34 +53,74 @@
 /* arguments to the backupPath function */
 struct BackupPathArgs_ {
     NiBackup *ni;
-    char *name;
-    int source;
-    int destDir;
-
-    int ti;
+    char *path;
+    DirCacheEntry *dir;
 };
 typedef struct BackupPathArgs_ BackupPathArgs;
 
-/* backupRecursive with cached full filename */
-static void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fullName);
+/* scratch space for backupPath, kept by each continuous backup thread */
+struct BackupScratch_ {
+    struct Buffer_char pseudo, pseudo2;
+};
+
+/* don't let continuous backup get more than this many files per thread ahead
+ * of the threads */
+#define BACKUP_QUEUE_PER_THREAD 4
+
+/* a full sync spread over a pool of threads */
+struct FullSync_ {
+    NiBackup *ni;
+    Pool *pool;
+    struct Buffer_char *fullNames; /* one per worker */
+};
+typedef struct FullSync_ FullSync;
+
+/* a directory to be synced by a full sync worker */
+struct FullSyncDir_ {
+    FullSync *fs;
+    int source, dest;
+    char *fullName;
+};
+typedef struct FullSyncDir_ FullSyncDir;
+
+/* don't hold more directories open than this waiting for a thread */
+#define FULL_SYNC_MAX_QUEUED 256
+
+/* backupRecursive with cached full filename, and maybe a pool to hand off
+ * subdirectories to */
+static void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fullName, FullSync *fs);
+
+/* hand off a subdirectory to the full sync pool. Takes the fds. */
+static void backupRecursiveSpawn(FullSync *fs, int source, int dest, struct Buffer_char *fullName);
 
-/* back up a specified path */
-static int backupPath(NiBackup *ni, char *name, int source, int destDir);
+/* back up a specified path, given relative to the source root, with optional
+ * reusable scratch space */
+static int backupPath(NiBackup *ni, const char *path, int source, int destDir, BackupScratch *scratch);
 
 /* backupPath, thread version */
-static void *backupPathTh(void *bpavp);
+static void backupPathTh(Pool *pool, int worker, void *bpavp);
 
-/* call backupPath in an available thread, or block 'til one is available */
-static void backupPathInThread(NiBackup *ni, char *name, int source, int destDir);
+/* If this path was renamed from, or is a hard link to, one we already have,
+ * link that path's latest content in as this increment's content. Returns 1 if
+ * it linked a .dat, 2 if a chunk list. If it could also share the patch for
+ * lastIncr, sets *codec. */
+static int backupSeed(NiBackup *ni, const char *path, BackupMetadata *meta,
+    BackupMetadata *lastMeta, const struct stat *ident, int destDir, char *pseudo,
+    char *pseudoD, unsigned long long lastIncr, char *codec);
 
-/* utility function to call bsdiff, returning 0 if it succeeds */
-static int bsdiff(const char *from, const char *to, const char *patch);
+/* call backupPath in an available thread, or block 'til one is available.
+ * Takes the path and the reference to the directory. */
+static void backupPathInThread(NiBackup *ni, char *path, DirCacheEntry *dir);
 
-/* utility function to call xdelta3 -e, returning 0 if it succeeds */
-static int xdelta3e(const char *from, const char *to, const char *patch);
 
 static size_t direntLen;
 
+/* each continuous backup batch checks each directory only once */
+static unsigned long batch = 0;
+
+/* one catalog append at a time, each timed as it's made */
+static pthread_mutex_t catalogLock = PTHREAD_MUTEX_INITIALIZER;
+
 /* initialization for the backup procedures */
 void backupInit(int source)
 {
@@ -82,18 +131,139 @@ void backupInit(int source)
     direntLen = sizeof(struct dirent) + name_max + 1;
 }
 
+/* Set up a full sync's pool and its workers' name buffers. Returns -1 if
+ * there's no pool, so the caller should do it all itself. */
+static int fullSyncStart(NiBackup *ni, FullSync *fs)
+{
+    int i;
+
+    fs->ni = ni;
+    fs->pool = NULL;
+    fs->fullNames = NULL;
+    if (ni->threads <= 1) return -1;
+
+    /* each worker has its own name buffer */
+    fs->fullNames = malloc(ni->threads * sizeof(struct Buffer_char));
+    if (fs->fullNames == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    fs->pool = poolCreate(ni->threads);
+    if (fs->pool == NULL) {
+        free(fs->fullNames);
+        fs->fullNames = NULL;
+        return -1;
+    }
+    for (i = 0; i < ni->threads; i++)
+        INIT_BUFFER(fs->fullNames[i]);
+    return 0;
+}
+
+/* wait for a full sync's pool to finish, and free it */
+static void fullSyncEnd(FullSync *fs)
+{
+    int i;
+
+    poolDestroy(fs->pool);
+    for (i = 0; i < fs->ni->threads; i++)
+        FREE_BUFFER(fs->fullNames[i]);
+    free(fs->fullNames);
+}
+
 /* recursively back up this path */
 void backupRecursive(NiBackup *ni)
 {
     struct Buffer_char fullName;
+    FullSync fs;
+    int source, dest;
+    unsigned long renameGen;
+
+    renameGen = renameSyncStart();
+
+    /* anything we've missed about directories, we're about to find out */
+    dirCacheClear();
+
+    if (fullSyncStart(ni, &fs) != 0) {
+        /* just do it ourself */
+        INIT_BUFFER(fullName);
+        backupRecursiveF(ni, ni->sourceFd, ni->destFd, &fullName, NULL);
+        FREE_BUFFER(fullName);
+        renameSyncEnd(renameGen);
+        return;
+    }
 
-    INIT_BUFFER(fullName);
-    backupRecursiveF(ni, ni->sourceFd, ni->destFd, &fullName);
-    FREE_BUFFER(fullName);
+    source = dup(ni->sourceFd);
+    dest = dup(ni->destFd);
+    if (source >= 0 && dest >= 0) {
+        INIT_BUFFER(fullName);
+        WRITE_ONE_BUFFER(fullName, 0); fullName.bufused--;
+        backupRecursiveSpawn(&fs, source, dest, &fullName);
+        FREE_BUFFER(fullName);
+    } else {
+        perror("dup");
+        if (source >= 0) close(source);
+        if (dest >= 0) close(dest);
+    }
+
+    fullSyncEnd(&fs);
+    renameSyncEnd(renameGen);
+}
+
+/* sync a directory in a full sync worker */
+static void backupRecursiveTh(Pool *pool, int worker, void *fsdvp)
+{
+    FullSyncDir *fsd = (FullSyncDir *) fsdvp;
+    struct Buffer_char fullName, *wFullName;
+
+    (void) pool; /* subdirectories are handed to fsd->fs->pool */
+
+    if (worker >= 0) {
+        wFullName = &fsd->fs->fullNames[worker];
+    } else {
+        /* couldn't submit, so we're running in the submitter */
+        INIT_BUFFER(fullName);
+        wFullName = &fullName;
+    }
+
+    wFullName->bufused = 0;
+    WRITE_BUFFER(*wFullName, fsd->fullName, strlen(fsd->fullName) + 1); wFullName->bufused--;
+    backupRecursiveF(fsd->fs->ni, fsd->source, fsd->dest, wFullName, fsd->fs);
+
+    if (worker < 0) FREE_BUFFER(fullName);
+    close(fsd->source);
+    close(fsd->dest);
+    free(fsd->fullName);
+    free(fsd);
+}
+
+/* hand off a subdirectory to the full sync pool */
+static void backupRecursiveSpawn(FullSync *fs, int source, int dest, struct Buffer_char *fullName)
+{
+    FullSyncDir *fsd = malloc(sizeof(FullSyncDir));
+    if (fsd == NULL) {
+        perror("malloc");
+        close(source);
+        close(dest);
+        return;
+    }
+    fsd->fs = fs;
+    fsd->source = source;
+    fsd->dest = dest;
+    fsd->fullName = strdup(fullName->buf);
+    if (fsd->fullName == NULL) {
+        perror("strdup");
+        close(source);
+        close(dest);
+        free(fsd);
+        return;
+    }
+
+    if (poolSubmit(fs->pool, backupRecursiveTh, fsd) != 0)
+        backupRecursiveTh(fs->pool, -1, fsd);
 }
 
 /* recursively back up this path, w/ exclusions */
-void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fullName)
+void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fullName, FullSync *fs)
 {
     DIR *dh;
     struct dirent *de = NULL, *der;
@@ -101,15 +271,20 @@ void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fu
     int sFd, dFd;
     int hSource = -1, hDest = -1;
     size_t fnl = fullName->bufused;
+    char *names[URING_STAT_BATCH], *nameBuf = NULL;
+    size_t count, i;
+    Uring *ring = uringGet();
 
-    hSource = dup(source);
+    /* reopen rather than dup, so that each sync reads from the start (a dup
+     * would share the directory offset with the last sync's) */
+    hSource = openat(source, ".", O_RDONLY | O_DIRECTORY);
     if (hSource < 0) {
-        perror("dup");
+        perror("openat");
         goto done;
     }
-    hDest = dup(dest);
+    hDest = openat(dest, ".", O_RDONLY | O_DIRECTORY);
     if (hDest < 0) {
-        perror("dup");
+        perror("openat");
         goto done;
     }
 
@@ -122,40 +297,64 @@ void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fu
 
     de = malloc(direntLen);
     if (de == NULL) goto done;
+    nameBuf = malloc(URING_STAT_BATCH * (NAME_MAX + 1));
+    if (nameBuf == NULL) goto done;
+    for (i = 0; i < URING_STAT_BATCH; i++)
+        names[i] = nameBuf + i * (NAME_MAX + 1);
 
-    /* go over source-dir files */
+    /* go over source-dir files, a batch at a time */
     if ((dh = fdopendir(hSource))) {
-        /* for each file... */
-        while (1) {
-            if (readdir_r(dh, de, &der) != 0) break;
-            if (der == NULL) break;
+        do {
+            for (count = 0; count < URING_STAT_BATCH;) {
+                if (readdir_r(dh, de, &der) != 0) break;
+                if (der == NULL) break;
 
-            /* skip . and .. */
-            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+                /* skip . and .. */
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
 
-            /* check exclusions */
-            fullName->bufused = fnl;
-            WRITE_BUFFER(*fullName, de->d_name, strlen(de->d_name) + 1); fullName->bufused--;
-            if (excluded(ni, fullName->buf)) continue;
-
-            /* otherwise, back it up */
-            dFd = backupPath(ni, de->d_name, source, dest);
+                strcpy(names[count++], de->d_name);
+            }
 
-            /* and children */
-            if (dFd >= 0) {
-                WRITE_ONE_BUFFER(*fullName, '/');
-                sFd = openat(source, de->d_name, O_RDONLY);
-                if (sFd >= 0) {
-                    if (fstat(sFd, &tbuf) == 0 &&
-                        sbuf.st_dev == tbuf.st_dev) {
+            /* look the whole batch up at once, so that the lookups one by one
+             * below find their inodes already cached */
+            if (ring && count) {
+                uringStatBatch(ring, source, NULL, names, count);
+                uringStatBatch(ring, dest, ni->packed ? "nih" : "nii", names, count);
+            }
 
-                        backupRecursiveF(ni, sFd, dFd, fullName);
+            /* for each file... */
+            for (i = 0; i < count; i++) {
+                /* check exclusions */
+                fullName->bufused = fnl;
+                WRITE_BUFFER(*fullName, names[i], strlen(names[i]) + 1); fullName->bufused--;
+                if (excluded(ni, fullName->buf)) continue;
+
+                /* otherwise, back it up */
+                dFd = backupPath(ni, fullName->buf, source, dest, NULL);
+
+                /* and children */
+                if (dFd >= 0) {
+                    WRITE_ONE_BUFFER(*fullName, '/');
+                    sFd = openat(source, names[i], O_RDONLY);
+                    if (sFd >= 0) {
+                        if (fstat(sFd, &tbuf) == 0 &&
+                            sbuf.st_dev == tbuf.st_dev) {
+
+                            if (fs && poolQueued(fs->pool) < FULL_SYNC_MAX_QUEUED) {
+                                /* let another thread take it */
+                                WRITE_ONE_BUFFER(*fullName, 0); fullName->bufused--;
+                                backupRecursiveSpawn(fs, sFd, dFd, fullName);
+                                continue;
+                            }
+
+                            backupRecursiveF(ni, sFd, dFd, fullName, fs);
+                        }
+                        close(sFd);
                     }
-                    close(sFd);
+                    close(dFd);
                 }
-                close(dFd);
             }
-        }
+        } while (count == URING_STAT_BATCH);
 
         closedir(dh);
     } else {
@@ -169,13 +368,16 @@ void backupRecursiveF(NiBackup *ni, int source, int dest, struct Buffer_char *fu
             if (readdir_r(dh, de, &der) != 0) break;
             if (der == NULL) break;
 
-            /* only look at increment files (nii) */
-            if (strncmp(de->d_name, "nii", 3)) continue;
+            /* only look at histories (nii or nih) */
+            if (!historyEntry(de->d_name)) continue;
 
             /* check if it's been deleted */
             if (faccessat(source, de->d_name + 3, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
                 /* back it up */
-                int bpfd = backupPath(ni, de->d_name + 3, source, dest);
+                int bpfd;
+                fullName->bufused = fnl;
+                WRITE_BUFFER(*fullName, de->d_name + 3, strlen(de->d_name + 3) + 1); fullName->bufused--;
+                bpfd = backupPath(ni, fullName->buf, source, dest, NULL);
                 if (bpfd >= 0) close(bpfd);
             }
         }
@@ -190,141 +392,312 @@ done:
     if (hSource >= 0) close(hSource);
     if (hDest >= 0) close(hDest);
     free(de);
+    free(nameBuf);
+    fullName->bufused = fnl;
 }
 
-/* back up this path and all containing directories */
-void backupContaining(NiBackup *ni, char *path)
+/* Sort paths so that everything in a directory is together, right after it.
+ * With plain strcmp, "a/b c" would come between "a/b" and "a/b/x", so '/'
+ * sorts before every other byte. */
+static int cmpPaths(const void *l, const void *r)
 {
-    int source = -1, dest = -1,
-        newSource = -1, newDest = -1;
-    char *part, *nextPart, *saveptr;
-    struct Buffer_char fullName;
+    const unsigned char *a = *(const unsigned char *const *) l,
+                        *b = *(const unsigned char *const *) r;
+    int ac, bc;
 
-    fullName.buf = NULL;
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    ac = (*a == '/') ? 1 : *a ? *a + 1 : 0;
+    bc = (*b == '/') ? 1 : *b ? *b + 1 : 0;
+    return ac - bc;
+}
 
-    /* first off, remove the source */
-    if (strncmp(path, ni->source, ni->sourceLen)) goto done;
-    path += ni->sourceLen;
-    if (path[0] != '/') goto done;
-    path++;
+/* Open a directory (relative to the source, "" for the root) for a batch, from
+ * the cache if we can, making sure once per batch that it's still the
+ * directory at that path. If check, make sure the directory itself is backed
+ * up, once per batch. Returns a reference, or NULL if it can't be backed up. */
+static DirCacheEntry *batchDir(NiBackup *ni, char *path, int check, unsigned long batch)
+{
+    DirCacheEntry *dir, *parent;
+    struct stat sbuf, dbuf;
+    char *slash, *name;
+    int source, dest;
+
+    dir = dirCacheGet(path);
+    if (dir && dir->verified == batch && (!check || dir->checked == batch)) return dir;
+
+    if (!path[0]) {
+        /* the root is always there */
+        if (dir) return dir;
+        source = dup(ni->sourceFd);
+        dest = dup(ni->destFd);
+        if (source < 0 || dest < 0) {
+            if (source >= 0) close(source);
+            if (dest >= 0) close(dest);
+            return NULL;
+        }
+        return dirCacheAdd(path, source, dest);
+    }
 
-    /* now start from here and back up */
-    source = dup(ni->sourceFd);
-    if (source < 0) goto done;
-    dest = dup(ni->destFd);
-    if (dest < 0) goto done;
+    if (!dir && excluded(ni, path)) return NULL;
 
-    INIT_BUFFER(fullName);
-    part = strtok_r(path, "/", &saveptr);
+    /* find its parent, which we needn't check: anything that changed it is
+     * queued, and so checks it as its own parent */
+    slash = strrchr(path, '/');
+    if (slash) {
+        *slash = 0;
+        parent = batchDir(ni, path, 0, batch);
+        *slash = '/';
+        name = slash + 1;
+    } else {
+        parent = batchDir(ni, "", 0, batch);
+        name = path;
+    }
+    if (parent == NULL) {
+        if (dir) dirCacheRelease(dir);
+        return NULL;
+    }
 
-    while (dest >= 0 && (nextPart = strtok_r(NULL, "/", &saveptr))) {
-        /* check this name */
-        WRITE_BUFFER(fullName, part, strlen(part) + 1); fullName.bufused--;
-        if (excluded(ni, fullName.buf))
-            goto done;
+    /* it may have been replaced without our hearing of it */
+    if (dir && dir->verified != batch) {
+        if (fstatat(parent->source, name, &sbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+            fstat(dir->source, &dbuf) != 0 ||
+            sbuf.st_dev != dbuf.st_dev || sbuf.st_ino != dbuf.st_ino) {
+            dirCacheRelease(dir);
+            dirCacheInvalidate(path);
+            dir = NULL;
+        } else {
+            dir->verified = batch;
+        }
+    }
+    if (dir && !check) {
+        dirCacheRelease(parent);
+        return dir;
+    }
 
-        /* back it up */
-        newDest = backupPath(ni, part, source, dest);
+    /* back it up, which also opens it in the backup */
+    dest = backupPath(ni, path, parent->source, parent->dest, NULL);
+    if (dest >= 0 && dir) {
+        /* we already have it open */
         close(dest);
-        dest = newDest;
 
-        /* and follow this path in the source */
-        if (dest >= 0) {
-            newSource = openat(source, part, O_RDONLY);
-            if (newSource < 0) {
-                /* FIXME */
-                goto done;
-            }
-            close(source);
-            source = newSource;
+    } else if (dest >= 0) {
+        source = openat(parent->source, name, O_RDONLY);
+        if (source >= 0) {
+            dir = dirCacheAdd(path, source, dest);
+        } else {
+            close(dest);
         }
 
-        WRITE_ONE_BUFFER(fullName, '/');
-        part = nextPart;
+    } else if (dir) {
+        /* it's gone */
+        dirCacheRelease(dir);
+        dirCacheInvalidate(path);
+        dir = NULL;
+
     }
+    if (dir) dir->checked = dir->verified = batch;
 
-    /* and back up the final component in a thread */
-    if (part && dest >= 0) {
-        char *nameDup;
-        WRITE_BUFFER(fullName, part, strlen(part) + 1);
-        if (excluded(ni, fullName.buf))
-            goto done;
+    dirCacheRelease(parent);
+    return dir;
+}
 
-        nameDup = strdup(part);
-        if (nameDup == NULL) goto done;
-        backupPathInThread(ni, nameDup, source, dest);
+/* back up these paths and the directories they're in */
+void backupBatch(NiBackup *ni, char **paths, size_t count)
+{
+    DirCacheEntry *dir = NULL;
+    struct Buffer_char dirName;
+    char *path, *slash, *pathDup;
+    size_t i, len;
+
+    qsort(paths, count, sizeof(char *), cmpPaths);
+    batch++;
+    INIT_BUFFER(dirName);
+
+    for (i = 0; i < count; i++) {
+        /* first off, remove the source */
+        path = paths[i];
+        if (strncmp(path, ni->source, ni->sourceLen)) continue;
+        path += ni->sourceLen;
+        if (path[0] != '/') continue;
+        path++;
+        if (!path[0] || excluded(ni, path)) continue;
+
+        /* if it's a directory we're about to back up anyway, don't bother */
+        len = strlen(paths[i]);
+        if (i + 1 < count && !strncmp(paths[i+1], paths[i], len) &&
+            paths[i+1][len] == '/')
+            continue;
+
+        /* find the directory it's in */
+        dirName.bufused = 0;
+        WRITE_BUFFER(dirName, path, strlen(path) + 1);
+        slash = strrchr(dirName.buf, '/');
+        if (slash)
+            *slash = 0;
+        else
+            dirName.buf[0] = 0;
+        if (!dir || strcmp(dir->path, dirName.buf)) {
+            if (dir) dirCacheRelease(dir);
+            dir = batchDir(ni, dirName.buf, 1, batch);
+        }
+        if (dir == NULL) continue;
 
-        /* backupPathInThread will close */
-        source = dest = -1;
+        /* and back it up in a thread */
+        pathDup = strdup(path);
+        if (pathDup == NULL) continue;
+        dirCacheHold(dir);
+        backupPathInThread(ni, pathDup, dir);
     }
 
-done:
-    if (source >= 0) close(source);
-    if (dest >= 0) close(dest);
-    if (fullName.buf) FREE_BUFFER(fullName);
+    if (dir) dirCacheRelease(dir);
+    FREE_BUFFER(dirName);
 }
 
-static const char pseudos[] = "cm"; /* content, metadata */
+/* Open a directory (relative to the source) in the source and the backup,
+ * backing up each directory on the way to it, as a full sync would. Returns
+ * 0 on success, or -1 if it's gone or can't be backed up. */
+static int subtreeOpen(NiBackup *ni, char *path, int *source, int *dest)
+{
+    char *slash, *name = path;
+    int nsource, ndest;
+
+    *source = dup(ni->sourceFd);
+    *dest = dup(ni->destFd);
+    if (*source < 0 || *dest < 0) goto fail;
+
+    while (1) {
+        slash = strchr(name, '/');
+        if (slash) *slash = 0;
+
+        /* backing it up also opens it in the backup, and records it if it's
+         * gone */
+        ndest = backupPath(ni, path, *source, *dest, NULL);
+        nsource = (ndest >= 0) ? openat(*source, name, O_RDONLY) : -1;
+        close(*source);
+        close(*dest);
+        *source = nsource;
+        *dest = ndest;
+        if (slash) *slash = '/';
+        if (*source < 0 || *dest < 0) goto fail;
+
+        if (!slash) return 0;
+        name = slash + 1;
+    }
+
+fail:
+    if (*source >= 0) close(*source);
+    if (*dest >= 0) close(*dest);
+    *source = *dest = -1;
+    return -1;
+}
+
+/* back up these directories and everything under them */
+void backupSubtrees(NiBackup *ni, char **paths, size_t count)
+{
+    struct Buffer_char fullName;
+    FullSync fs;
+    char *path;
+    int pooled, source, dest;
+    size_t i;
+
+    pooled = (fullSyncStart(ni, &fs) == 0);
+    INIT_BUFFER(fullName);
+
+    for (i = 0; i < count; i++) {
+        /* first off, remove the source */
+        path = paths[i];
+        if (strncmp(path, ni->source, ni->sourceLen)) continue;
+        path += ni->sourceLen;
+        if (path[0] == '/')
+            path++;
+        else if (path[0])
+            continue;
+
+        if (!path[0]) {
+            source = dup(ni->sourceFd);
+            dest = dup(ni->destFd);
+            if (source < 0 || dest < 0) {
+                if (source >= 0) close(source);
+                if (dest >= 0) close(dest);
+                continue;
+            }
+        } else if (excluded(ni, path) || subtreeOpen(ni, path, &source, &dest) != 0) {
+            continue;
+        }
+
+        /* then its children, as a full sync would */
+        fullName.bufused = 0;
+        WRITE_BUFFER(fullName, path, strlen(path));
+        if (path[0]) WRITE_ONE_BUFFER(fullName, '/');
+        WRITE_ONE_BUFFER(fullName, 0); fullName.bufused--;
+        if (pooled) {
+            backupRecursiveSpawn(&fs, source, dest, &fullName);
+        } else {
+            backupRecursiveF(ni, source, dest, &fullName, NULL);
+            close(source);
+            close(dest);
+        }
+    }
+
+    if (pooled) fullSyncEnd(&fs);
+    FREE_BUFFER(fullName);
+}
 
 /* back up this path, returning an open fd to the backup directory if
  * applicable */
-static int backupPath(NiBackup *ni, char *name, int source, int destDir)
+static int backupPath(NiBackup *ni, const char *path, int source, int destDir, BackupScratch *scratch)
 {
-    char *pseudo = NULL, *pseudoD, *pseudo2 = NULL, *pseudo2D;
-    int i, ifd = -1, ffd = -1, rfd = -1, wroteData = 0;
+    const char *name;
+    BackupScratch lScratch;
+    char *pseudo, *pseudoD, *pseudo2, *pseudo2D;
+    int ffd = -1, rfd = -1, wroteData = 0, seeded = 0;
+    struct stat ident;
     size_t namelen;
     unsigned long long lastIncr, curIncr;
-    char incrBuf[4*sizeof(int)+1];
-    ssize_t rd;
+    History hist;
+    unsigned char inlineBuf[HISTORY_INLINE_MAX];
+    ssize_t inlineLen = -1;
     BackupMetadata lastMeta, meta;
+    CatalogRecord crec;
+
+    hist.fd = -1;
+    hist.pseudo = NULL;
+    ident.st_dev = ident.st_ino = ident.st_nlink = 0;
+    crec.codec = CATALOG_CODEC_NONE;
+
+    if (scratch == NULL) {
+        INIT_BUFFER(lScratch.pseudo);
+        INIT_BUFFER(lScratch.pseudo2);
+        scratch = &lScratch;
+    }
 
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
     if (!name[0]) goto done;
 
     /* space for our pseudofiles: ni?<name>/<ull>.{old,new} */
     namelen = strlen(name);
-    pseudo = malloc(namelen + (4*sizeof(unsigned long long)) + 9);
-    if (pseudo == NULL) /* FIXME */ goto done;
-    pseudo2 = malloc(namelen + (4*sizeof(unsigned long long)) + 9);
-    if (pseudo2 == NULL) /* FIXME */ goto done;
+    while (scratch->pseudo.bufsz < namelen + (4*sizeof(unsigned long long)) + 9)
+        EXPAND_BUFFER(scratch->pseudo);
+    while (scratch->pseudo2.bufsz < namelen + (4*sizeof(unsigned long long)) + 9)
+        EXPAND_BUFFER(scratch->pseudo2);
+    pseudo = scratch->pseudo.buf;
+    pseudo2 = scratch->pseudo2.buf;
     pseudoD = pseudo + namelen + 3;
     pseudo2D = pseudo2 + namelen + 3;
     sprintf(pseudo, "ni?%s", name);
     sprintf(pseudo2, "ni?%s", name);
 
-    /* get our increment file */
-    pseudo[2] = 'i';
-    ifd = openat(destDir, pseudo, O_RDWR | O_CREAT, 0600);
-    if (ifd < 0) {
-        PERRLN(pseudo);
-        goto done;
-    }
-    if (flock(ifd, LOCK_EX) != 0) {
-        perror("flock");
-        goto done;
-    }
-
-    /* make all the pseudo-dirs */
-    for (i = 0; pseudos[i]; i++) {
-        pseudo[2] = pseudos[i];
-        if (mkdirat(destDir, pseudo, 0700) < 0) {
-            if (errno != EEXIST) {
-                PERRLN(pseudo);
-                goto done;
-            }
-        }
-    }
-
-    /* find our last increment */
-    incrBuf[0] = 0;
-    rd = read(ifd, incrBuf, sizeof(incrBuf) - 1);
-    if (rd < 0) {
-        goto done;
-    }
-    incrBuf[rd] = 0;
-    lastIncr = atoll(incrBuf);
-    if (lseek(ifd, 0, SEEK_SET) < 0) {
+    /* get our history, which gives our last increment */
+    if (historyOpen(&hist, destDir, name, LOCK_EX,
+            ni->packed ? HISTORY_CREATE_PACKED : HISTORY_CREATE) != 0) {
+        PERRLN(name);
         goto done;
     }
+    lastIncr = hist.cur;
     curIncr = lastIncr + 1;
 
     /* open the file and get its metadata */
@@ -333,10 +706,20 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
         goto done;
     }
 
+    /* big things are worth finding again if they're renamed, and hard links
+     * whenever we see another link */
+    if (ffd >= 0 && fstat(ffd, &ident) == 0) {
+        if (meta.type != MD_TYPE_DIRECTORY && meta.size < RENAME_MIN_SIZE &&
+            ident.st_nlink < 2)
+            ident.st_ino = 0;
+    } else {
+        ident.st_ino = ident.st_nlink = 0;
+    }
+    if (meta.type == MD_TYPE_DIRECTORY && ident.st_ino)
+        notifyDirectory(ni, ffd, ident.st_dev, path);
+
     /* read in the old metadata */
-    pseudo[2] = 'm';
-    sprintf(pseudoD, "/%llu.met", lastIncr);
-    if (readMetadata(&lastMeta, destDir, pseudo, (lastIncr != 0)) != 0) {
+    if (historyGet(&hist, lastIncr, &lastMeta, NULL) != 0) {
         if (errno != ENOENT) {
             PERRLN(name);
             goto done;
@@ -360,18 +743,58 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
         goto done;
     }
 
+    /* a packed history keeps small content itself, unless it's shared with
+     * another link */
+    if (hist.packed && meta.size <= HISTORY_INLINE_MAX &&
+        ((meta.type == MD_TYPE_FILE && ident.st_nlink < 2) ||
+         meta.type == MD_TYPE_LINK)) {
+        if (meta.type == MD_TYPE_LINK)
+            inlineLen = readlinkat(source, name, (char *) inlineBuf, meta.size);
+        else
+            inlineLen = pread(ffd, inlineBuf, meta.size, 0);
+        if (inlineLen < 0) {
+            PERRLN(name);
+            goto done;
+        }
+    }
+
     /* write out the new metadata */
-    pseudo[2] = 'm';
-    sprintf(pseudoD, "/%llu.met", curIncr);
-    if (writeMetadata(&meta, destDir, pseudo) != 0) {
+    if (historyPut(&hist, curIncr, &meta, (inlineLen >= 0) ? inlineBuf : NULL, inlineLen) != 0) {
         PERRLN(name);
         goto done;
     }
 
+    /* and make somewhere for the content */
+    if (inlineLen < 0 && (meta.type == MD_TYPE_FILE || meta.type == MD_TYPE_LINK)) {
+        pseudo[2] = 'c';
+        *pseudoD = 0;
+        if (mkdirat(destDir, pseudo, 0700) < 0) {
+            if (errno != EEXIST) {
+                PERRLN(pseudo);
+                goto done;
+            }
+        }
+    }
+
+    /* if this is new, we may already have its data under an old name, and if
+     * it's a hard link, under another name */
+    if (inlineLen < 0 && meta.type != MD_TYPE_NONEXIST &&
+        (lastMeta.type == MD_TYPE_NONEXIST ||
+         (meta.type == MD_TYPE_FILE && ident.st_nlink > 1)))
+        seeded = backupSeed(ni, path, &meta, &lastMeta, &ident, destDir,
+            pseudo, pseudoD, lastIncr, &crec.codec);
+
     /* and the new data */
     pseudo[2] = 'c';
     sprintf(pseudoD, "/%llu.dat", curIncr);
-    if (meta.type == MD_TYPE_LINK) {
+    if (inlineLen >= 0) {
+        /* already written with the metadata */
+
+    } else if (seeded) {
+        /* nothing to copy, but maybe still something to patch */
+        wroteData = (seeded == 1);
+
+    } else if (meta.type == MD_TYPE_LINK) {
         /* just get the link target */
         char *linkTarget = malloc(meta.size);
         ssize_t rllen;
@@ -388,7 +811,9 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
             goto done;
         }
 
-        /* and write it out */
+        /* and write it out, not through a link a half-finished increment
+         * may have left here */
+        unlinkat(destDir, pseudo, 0);
         ofd = openat(destDir, pseudo, O_WRONLY | O_CREAT | O_TRUNC, 0600);
         if (ofd < 0) {
             PERRLN(name);
@@ -407,8 +832,19 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
         free(linkTarget);
         wroteData = 1;
 
+    } else if (meta.type == MD_TYPE_FILE && ni->chunkFd >= 0) {
+        /* a regular file, split into the chunk store */
+        sprintf(pseudoD, "/%llu." CHUNK_LIST_EXT, curIncr);
+        if (chunkStoreFile(ni->chunkFd, ffd, destDir, pseudo) != 0) {
+            PERRLN(name);
+            goto done;
+        }
+
     } else if (meta.type == MD_TYPE_FILE) {
-        /* a regular file, this we can copy */
+        /* a regular file, this we can copy. A half-finished increment may
+         * have left a link to another file's content here, so don't write
+         * through it. */
+        unlinkat(destDir, pseudo, 0);
         if (copySparse(ffd, destDir, pseudo) != 0) {
             PERRLN(name);
             goto done;
@@ -431,10 +867,10 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
 
     }
 
-    /* we can now safely mark the increment file */
-    if (lseek(ifd, 0, SEEK_SET) == 0) {
-        sprintf(incrBuf, "%llu", curIncr);
-        write(ifd, incrBuf, strlen(incrBuf));
+    /* we can now safely make it current */
+    if (historySetCurrent(&hist, curIncr) != 0) {
+        PERRLN(name);
+        goto done;
     }
 
     /* rename the old metadata */
@@ -445,19 +881,32 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
     renameat(destDir, pseudo, destDir, pseudo2);
 
     /* create the content patchfile */
-    if (wroteData) {
-        int useBsdiff;
+    pseudo[2] = 'c';
+    sprintf(pseudoD, "/%llu." CHUNK_LIST_EXT, lastIncr);
+    if (crec.codec != CATALOG_CODEC_NONE) {
+        /* shared with the hard link we got our content from */
+
+    } else if (faccessat(destDir, pseudo, F_OK, 0) == 0) {
+        /* chunk lists are small and share their chunks, so aren't patched */
+        crec.codec = CATALOG_CODEC_CHUNKS;
+
+    } else if (wroteData && ni->maxdelta >= 0 &&
+        (lastMeta.size > ni->maxdelta || meta.size > ni->maxdelta)) {
+        /* too big to patch in memory, so the old content stays whole */
+        sprintf(pseudoD, "/%llu.dat", lastIncr);
+        if (faccessat(destDir, pseudo, F_OK, 0) == 0)
+            crec.codec = CATALOG_CODEC_PLAIN;
+
+    } else if (wroteData) {
+        const Codec *codec;
         int lastIncrFd, curIncrFd, patchFd;
-        char lastIncrBuf[15+4*sizeof(int)];
-        char curIncrBuf[15+4*sizeof(int)];
-        char patchBuf[15+4*sizeof(int)];
 
         /* decide whether to use bsdiff */
         if (ni->maxbsdiff >= 0 &&
             (lastMeta.size >= ni->maxbsdiff || meta.size >= ni->maxbsdiff)) {
-            useBsdiff = 0;
+            codec = &codecVcdiff;
         } else {
-            useBsdiff = 1;
+            codec = &codecBsdiff;
         }
 
         /* the current increment */
@@ -466,24 +915,19 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
         curIncrFd = openat(destDir, pseudo, O_RDONLY);
 
         if (curIncrFd >= 0) {
-            sprintf(curIncrBuf, "/proc/self/fd/%d", curIncrFd);
-
             /* the last increment */
             sprintf(pseudoD, "/%llu.dat", lastIncr);
             lastIncrFd = openat(destDir, pseudo, O_RDONLY);
 
             if (lastIncrFd >= 0) {
-                sprintf(lastIncrBuf, "/proc/self/fd/%d", lastIncrFd);
+                crec.codec = CATALOG_CODEC_PLAIN;
 
                 /* and the patch */
-                sprintf(pseudoD, "/%llu.%s", lastIncr, useBsdiff ? "bsp" : "x3p");
+                sprintf(pseudoD, "/%llu.%s", lastIncr, codec->ext);
                 patchFd = openat(destDir, pseudo, O_RDWR | O_CREAT | O_TRUNC, 0600);
 
                 if (patchFd >= 0) {
-                    sprintf(patchBuf, "/proc/self/fd/%d", patchFd);
-
-                    if ((useBsdiff ? bsdiff : xdelta3e)
-                        (curIncrBuf, lastIncrBuf, patchBuf) == 0) {
+                    if (codecEncodeFd(codec, curIncrFd, lastIncrFd, patchFd) == 0) {
                         struct stat datStat, patStat;
 
                         /* if the patch is smaller than the original, remove the original */
@@ -492,12 +936,13 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
                             patStat.st_size < datStat.st_size) {
                             /* got smaller */
                             sprintf(pseudoD, "/%llu.dat", lastIncr);
+                            crec.codec = codec->catalogCodec;
                         }
 
-                        /* remove the patch or original */
-                        unlinkat(destDir, pseudo, 0);
                     }
 
+                    /* remove the patch or original */
+                    unlinkat(destDir, pseudo, 0);
                     close(patchFd);
                 }
                 close(lastIncrFd);
@@ -506,136 +951,225 @@ static int backupPath(NiBackup *ni, char *name, int source, int destDir)
         }
     }
 
+    /* and log it */
+    crec.path = (char *) path;
+    crec.incr = curIncr;
+    crec.type = meta.type;
+    crec.size = meta.size;
+    pthread_mutex_lock(&catalogLock);
+    crec.time = time(NULL);
+    if (catalogAppend(ni->catalogFd, &crec) != 0)
+        PERRLN(CATALOG_NAME);
+    pthread_mutex_unlock(&catalogLock);
+
 done:
-    if (ifd >= 0) close(ifd);
+    /* remember where this is, after we've checked where it was */
+    if (ident.st_ino) renameSeen(&ident, path);
+    historyClose(&hist);
     if (ffd >= 0) close(ffd);
-    free(pseudo);
-    free(pseudo2);
+    if (scratch == &lScratch) {
+        FREE_BUFFER(lScratch.pseudo);
+        FREE_BUFFER(lScratch.pseudo2);
+    }
 
     return rfd;
 }
 
+/* link in the content of the path this one was renamed from, or linked to */
+static int backupSeed(NiBackup *ni, const char *path, BackupMetadata *meta,
+    BackupMetadata *lastMeta, const struct stat *ident, int destDir, char *pseudo,
+    char *pseudoD, unsigned long long lastIncr, char *codec)
+{
+    static const char *exts[] = {"dat", CHUNK_LIST_EXT, NULL};
+    char *oldPath, *part, *slash, *opseudo = NULL, *opseudoD, *other;
+    unsigned long long oldIncr;
+    BackupMetadata oldMeta;
+    History ohist;
+    int odir = -1, ndir, i, ret = 0;
+
+    ohist.fd = -1;
+    ohist.pseudo = NULL;
+
+    oldPath = renameSource(path, ident, lastMeta->type == MD_TYPE_NONEXIST);
+    if (oldPath == NULL) return 0;
+
+    /* find the old path in the backup */
+    odir = dup(ni->destFd);
+    for (part = oldPath; odir >= 0 && (slash = strchr(part, '/')); part = slash + 1) {
+        *slash = 0;
+        opseudo = malloc(strlen(part) + 4);
+        if (opseudo == NULL) goto done;
+        sprintf(opseudo, "nid%s", part);
+        ndir = openat(odir, opseudo, O_RDONLY);
+        close(odir);
+        odir = ndir;
+        free(opseudo);
+        opseudo = NULL;
+        *slash = '/';
+    }
+    if (odir < 0) goto done;
+
+    opseudo = malloc(strlen(part) + (4*sizeof(unsigned long long)) + 9);
+    if (opseudo == NULL) goto done;
+    opseudoD = opseudo + strlen(part) + 3;
+    sprintf(opseudo, "nic%s", part);
+
+    /* Lock it, but don't wait: if it's busy (or being renamed back the other
+     * way), just back this up the normal way */
+    if (historyOpen(&ohist, odir, part, LOCK_SH | LOCK_NB, HISTORY_OPEN) != 0) goto done;
+    oldIncr = ohist.cur;
+
+    /* its latest content is from before it was deleted */
+    if (historyGet(&ohist, oldIncr, &oldMeta, NULL) != 0) goto done;
+    if (oldMeta.type == MD_TYPE_NONEXIST && oldIncr > 1) {
+        oldIncr--;
+        if (historyGet(&ohist, oldIncr, &oldMeta, NULL) != 0) goto done;
+    }
+
+    /* make sure it's the same thing */
+    if (oldMeta.type != meta->type) goto done;
+    if (meta->type == MD_TYPE_DIRECTORY) {
+        /* nothing to link, but its children can find their old names */
+        renameHint(path, oldPath);
+        goto done;
+    }
+    if (oldMeta.size != meta->size || oldMeta.mtime != meta->mtime) goto done;
+
+    /* and link in its content, in whatever form it has */
+    pseudo[2] = 'c';
+    for (i = 0; exts[i]; i++) {
+        sprintf(opseudoD, "/%llu.%s", oldIncr, exts[i]);
+        sprintf(pseudoD, "/%llu.%s", lastIncr + 1, exts[i]);
+        unlinkat(destDir, pseudo, 0);
+        if (linkat(odir, opseudo, destDir, pseudo, 0) == 0) {
+            if (ni->verbose >= VERBOSITY_FILE)
+                fprintf(stderr, "%s: same content as %s\n", path, oldPath);
+            ret = i + 1;
+            break;
+        }
+    }
+
+    /* a new hard link changes the other name too, so that needs backing up
+     * again to record it as one */
+    if (ret && meta->linkId &&
+        (other = malloc(ni->sourceLen + strlen(oldPath) + 2))) {
+        sprintf(other, "%s/%s", ni->source, oldPath);
+        queuePush(&ni->queue, other);
+    }
+
+    if (ret != 1 || lastMeta->type != MD_TYPE_FILE || oldIncr < 2) goto done;
+
+    /* If our last version is the same as the other path's last version, it's
+     * already worked out the patch between them, so share that too */
+    sprintf(pseudoD, "/%llu.dat", lastIncr);
+    if (faccessat(destDir, pseudo, F_OK, 0) != 0) goto done;
+    if (historyGet(&ohist, oldIncr - 1, &oldMeta, NULL) != 0 ||
+        oldMeta.type != MD_TYPE_FILE || oldMeta.size != lastMeta->size ||
+        oldMeta.mtime != lastMeta->mtime)
+        goto done;
+
+    sprintf(opseudoD, "/%llu.dat", oldIncr - 1);
+    if (faccessat(odir, opseudo, F_OK, 0) == 0) {
+        /* it kept it whole, so we can too */
+        *codec = CATALOG_CODEC_PLAIN;
+        goto done;
+    }
+    for (i = 0; codecs[i]; i++) {
+        sprintf(opseudoD, "/%llu.%s", oldIncr - 1, codecs[i]->ext);
+        sprintf(pseudoD, "/%llu.%s", lastIncr, codecs[i]->ext);
+        unlinkat(destDir, pseudo, 0);
+        if (linkat(odir, opseudo, destDir, pseudo, 0) == 0) {
+            sprintf(pseudoD, "/%llu.dat", lastIncr);
+            unlinkat(destDir, pseudo, 0);
+            *codec = codecs[i]->catalogCodec;
+            break;
+        }
+    }
+
+done:
+    historyClose(&ohist);
+    if (odir >= 0) close(odir);
+    free(opseudo);
+    free(oldPath);
+    return ret;
+}
+
 /* backupPath, thread version */
-static void *backupPathTh(void *bpavp)
+static void backupPathTh(Pool *pool, int worker, void *bpavp)
 {
     int bpfd;
     BackupPathArgs *bpa = (BackupPathArgs *) bpavp;
 
+    (void) pool;
+
     /* perform the actual backup */
-    bpfd = backupPath(bpa->ni, bpa->name, bpa->source, bpa->destDir);
+    bpfd = backupPath(bpa->ni, bpa->path, bpa->dir->source, bpa->dir->dest,
+        (worker >= 0) ? &bpa->ni->bscratch[worker] : NULL);
     if (bpfd >= 0) close(bpfd);
 
-    /* then mark ourself done */
-    pthread_mutex_lock(&bpa->ni->blocks[bpa->ti]);
-    bpa->ni->brunning[bpa->ti] = 0;
-    pthread_mutex_unlock(&bpa->ni->blocks[bpa->ti]);
-    sem_post(&bpa->ni->bsem);
-
     /* and close stuff */
-    close(bpa->source);
-    close(bpa->destDir);
-    free(bpa->name);
+    dirCacheRelease(bpa->dir);
+    free(bpa->path);
 
     free(bpa);
-
-    return NULL;
 }
 
-/* call backupPath in an available thread, or block 'til one is available */
-static void backupPathInThread(NiBackup *ni, char *name, int source, int destDir)
+/* start the threads for continuous backup */
+int backupThreads(NiBackup *ni)
 {
-    if (ni->threads == 1) {
-        /* we don't need no stinkin' threads! */
-        int bpfd = backupPath(ni, name, source, destDir);
-        if (bpfd >= 0) close(bpfd);
-        free(name);
-        close(source);
-        close(destDir);
-
-    } else {
-        int ti;
-        BackupPathArgs *bpa = malloc(sizeof(BackupPathArgs));
-        if (!bpa) {
-            /* FIXME */
-            close(source);
-            close(destDir);
-            return;
-        }
+    int i;
 
-        bpa->ni = ni;
-        bpa->name = name;
-        bpa->source = source;
-        bpa->destDir = destDir;
-
-        /* wait until a thread is free */
-        sem_wait(&ni->bsem);
-
-        /* and start it */
-        for (ti = 0; ti < ni->threads; ti++) {
-            pthread_mutex_lock(&ni->blocks[ti]);
-            if (!ni->brunning[ti]) {
-                /* not running, take it */
-                ni->brunning[ti] = 1;
-                bpa->ti = ti;
-                pthread_create(&ni->bth[ti], NULL, backupPathTh, bpa);
-                pthread_mutex_unlock(&ni->blocks[ti]);
-                break;
-            }
-            pthread_mutex_unlock(&ni->blocks[ti]);
-        }
+    ni->bscratch = malloc(ni->threads * sizeof(BackupScratch));
+    if (ni->bscratch == NULL)
+        return -1;
+    for (i = 0; i < ni->threads; i++) {
+        INIT_BUFFER(ni->bscratch[i].pseudo);
+        INIT_BUFFER(ni->bscratch[i].pseudo2);
+    }
 
-        if (ti == ni->threads) {
-            /* FIXME: this should never happen */
-            free(bpa);
-            free(name);
-            close(source);
-            close(destDir);
+    ni->bpool = poolCreate(ni->threads);
+    if (ni->bpool == NULL) {
+        for (i = 0; i < ni->threads; i++) {
+            FREE_BUFFER(ni->bscratch[i].pseudo);
+            FREE_BUFFER(ni->bscratch[i].pseudo2);
         }
+        free(ni->bscratch);
+        ni->bscratch = NULL;
+        return -1;
     }
+
+    return 0;
 }
 
-/* utility function to call bsdiff, returning 0 if it succeeds */
-static int bsdiff(const char *from, const char *to, const char *patch)
+/* call backupPath in a backup thread, or block 'til there's room in the queue */
+static void backupPathInThread(NiBackup *ni, char *path, DirCacheEntry *dir)
 {
-    int status;
-    pid_t pid = fork();
-    if (pid < 0) return -1;
+    BackupPathArgs *bpa;
 
-    if (pid == 0) {
-        /* child, call bsdiff */
-        execlp("bsdiff", "bsdiff", from, to, patch, NULL);
-        perror("bsdiff");
-        exit(1);
-        abort();
+    if (ni->bpool == NULL) {
+        /* we don't need no stinkin' threads! */
+        int bpfd = backupPath(ni, path, dir->source, dir->dest, NULL);
+        if (bpfd >= 0) close(bpfd);
+        free(path);
+        dirCacheRelease(dir);
+        return;
     }
 
-    /* wait for bsdiff */
-    if (waitpid(pid, &status, 0) != pid)
-        return -1;
-    if (WEXITSTATUS(status) != 0)
-        return -1;
-    return 0;
-}
+    bpa = malloc(sizeof(BackupPathArgs));
+    if (!bpa) {
+        /* FIXME */
+        free(path);
+        dirCacheRelease(dir);
+        return;
+    }
 
-/* utility function to call xdelta3 -e, returning 0 if it succeeds */
-static int xdelta3e(const char *from, const char *to, const char *patch)
-{
-    int status;
-    pid_t pid = fork();
-    if (pid < 0) return -1;
+    bpa->ni = ni;
+    bpa->path = path;
+    bpa->dir = dir;
 
-    if (pid == 0) {
-        /* child, call xdelta */
-        execlp("xdelta3", "xdelta3", "-e", "-f", "-S", "djw", "-s", from, to, patch, NULL);
-        perror("xdelta3");
-        exit(1);
-        abort();
+    if (poolSubmitBounded(ni->bpool, backupPathTh, bpa,
+            ni->threads * BACKUP_QUEUE_PER_THREAD) != 0) {
+        /* couldn't queue it, so do it ourself */
+        backupPathTh(ni->bpool, -1, bpa);
     }
-
-    /* wait for xdelta */
-    if (waitpid(pid, &status, 0) != pid)
-        return -1;
-    if (WEXITSTATUS(status) != 0)
-        return -1;
-    return 0;
 }
@@ -1,15 +1,28 @@
 #ifndef BACKUP_H
 #define BACKUP_H
 
+#include <stddef.h>
+
 struct NiBackup_;
 
+struct BackupScratch_;
+typedef struct BackupScratch_ BackupScratch;
+
 /* initialize backup structures */
 void backupInit(int source);
 
+/* start the threads for continuous backup */
+int backupThreads(struct NiBackup_ *ni);
+
 /* recursively back up everything */
 void backupRecursive(struct NiBackup_ *ni);
 
-/* back up this path and all containing directories */
-void backupContaining(struct NiBackup_ *ni, char *path);
+/* back up these paths and the directories they're in, each directory only
+ * once, keeping directories open for later batches. Sorts paths. */
+void backupBatch(struct NiBackup_ *ni, char **paths, size_t count);
+
+/* Back up these directories (absolute paths) and everything under them, as a
+ * full sync would. For a queue's collapsed rescans, alongside batches. */
+void backupSubtrees(struct NiBackup_ *ni, char **paths, size_t count);
 
 #endif
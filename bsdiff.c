@@ -0,0 +1,565 @@
+/*
+ * bsdiff.c: In-process bsdiff (BSDIFF40) codec
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * The suffix sort, match search and patch format are those of bsdiff 4.3:
+ *
+ * Copyright 2003-2005 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <bzlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "catalog.h"
+#include "codec.h"
+
+#define BSDIFF_HEADER_SIZE 32
+
+/* largest piece we hand to bzip2 at once, which counts in unsigned ints */
+#define BZ_CHUNK (1<<30)
+
+/* a bzip2 stream being read out of a patch */
+struct BzReader_ {
+    bz_stream strm;
+    const unsigned char *in; /* input not yet given to bzip2 */
+    size_t inLeft;
+    int end;
+};
+typedef struct BzReader_ BzReader;
+
+static int bsdiffEncode(const unsigned char *from, size_t fromSz,
+    const unsigned char *to, size_t toSz, struct Buffer_char *patch);
+
+static int bsdiffDecode(const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to);
+
+const Codec codecBsdiff = {
+    "bsdiff",
+    "bsp",
+    CATALOG_CODEC_BSDIFF,
+    bsdiffEncode,
+    bsdiffDecode,
+    NULL
+};
+
+/* bsdiff's sign-magnitude 64-bit integers */
+static long long offtin(const unsigned char *buf)
+{
+    long long y;
+    int i;
+
+    y = buf[7] & 0x7F;
+    for (i = 6; i >= 0; i--)
+        y = y * 256 + buf[i];
+    if (buf[7] & 0x80) y = -y;
+    return y;
+}
+
+static void offtout(long long x, unsigned char *buf)
+{
+    unsigned long long y = (x < 0) ? -x : x;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        buf[i] = y & 0xFF;
+        y >>= 8;
+    }
+    if (x < 0) buf[7] |= 0x80;
+}
+
+/* bzip2 a block onto the end of a buffer */
+static int bzAppend(struct Buffer_char *out, const unsigned char *in, size_t len)
+{
+    bz_stream strm;
+    int ret, action;
+    size_t space;
+
+    memset(&strm, 0, sizeof(strm));
+    if (BZ2_bzCompressInit(&strm, 9, 0, 0) != BZ_OK)
+        return -1;
+
+    do {
+        strm.next_in = (char *) in;
+        strm.avail_in = (len > BZ_CHUNK) ? BZ_CHUNK : len;
+        in += strm.avail_in;
+        len -= strm.avail_in;
+        action = len ? BZ_RUN : BZ_FINISH;
+
+        do {
+            while (BUFFER_SPACE(*out) < 4096)
+                EXPAND_BUFFER(*out);
+            space = BUFFER_SPACE(*out);
+            strm.next_out = BUFFER_END(*out);
+            strm.avail_out = (space > BZ_CHUNK) ? BZ_CHUNK : space;
+            space = strm.avail_out;
+            ret = BZ2_bzCompress(&strm, action);
+            STEP_BUFFER(*out, space - strm.avail_out);
+        } while ((action == BZ_RUN && ret == BZ_RUN_OK && strm.avail_in) ||
+                 (action == BZ_FINISH && ret == BZ_FINISH_OK));
+    } while (action == BZ_RUN && ret == BZ_RUN_OK);
+
+    BZ2_bzCompressEnd(&strm);
+    return (ret == BZ_STREAM_END) ? 0 : -1;
+}
+
+/* start reading a bzip2 block */
+static int bzReaderInit(BzReader *rd, const unsigned char *in, size_t len)
+{
+    memset(rd, 0, sizeof(BzReader));
+    if (BZ2_bzDecompressInit(&rd->strm, 0, 0) != BZ_OK)
+        return -1;
+    rd->in = in;
+    rd->inLeft = len;
+    return 0;
+}
+
+/* read exactly len bytes out of a bzip2 block */
+static int bzRead(BzReader *rd, unsigned char *buf, size_t len)
+{
+    int ret;
+    while (len) {
+        if (rd->end) return -1;
+        if (rd->strm.avail_in == 0 && rd->inLeft) {
+            rd->strm.next_in = (char *) rd->in;
+            rd->strm.avail_in = (rd->inLeft > BZ_CHUNK) ? BZ_CHUNK : rd->inLeft;
+            rd->in += rd->strm.avail_in;
+            rd->inLeft -= rd->strm.avail_in;
+        }
+        rd->strm.next_out = (char *) buf;
+        rd->strm.avail_out = (len > BZ_CHUNK) ? BZ_CHUNK : len;
+        ret = BZ2_bzDecompress(&rd->strm);
+        if (ret == BZ_STREAM_END)
+            rd->end = 1;
+        else if (ret != BZ_OK)
+            return -1;
+        else if (rd->strm.next_out == (char *) buf &&
+                 rd->strm.avail_in == 0 && rd->inLeft == 0)
+            return -1; /* truncated */
+        len -= rd->strm.next_out - (char *) buf;
+        buf = (unsigned char *) rd->strm.next_out;
+    }
+    return 0;
+}
+
+static void bzReaderEnd(BzReader *rd)
+{
+    BZ2_bzDecompressEnd(&rd->strm);
+}
+
+/* one step of Larsson and Sadakane's qsufsort */
+static void split(long long *I, long long *V, long long start, long long len, long long h)
+{
+    long long i, j, k, x, tmp, jj, kk;
+
+    if (len < 16) {
+        for (k = start; k < start + len; k += j) {
+            j = 1;
+            x = V[I[k] + h];
+            for (i = 1; k + i < start + len; i++) {
+                if (V[I[k + i] + h] < x) {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+                if (V[I[k + i] + h] == x) {
+                    tmp = I[k + j]; I[k + j] = I[k + i]; I[k + i] = tmp;
+                    j++;
+                }
+            }
+            for (i = 0; i < j; i++) V[I[k + i]] = k + j - 1;
+            if (j == 1) I[k] = -1;
+        }
+        return;
+    }
+
+    x = V[I[start + len / 2] + h];
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++) {
+        if (V[I[i] + h] < x) jj++;
+        if (V[I[i] + h] == x) kk++;
+    }
+    jj += start;
+    kk += jj;
+
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj) {
+        if (V[I[i] + h] < x) {
+            i++;
+        } else if (V[I[i] + h] == x) {
+            tmp = I[i]; I[i] = I[jj + j]; I[jj + j] = tmp;
+            j++;
+        } else {
+            tmp = I[i]; I[i] = I[kk + k]; I[kk + k] = tmp;
+            k++;
+        }
+    }
+
+    while (jj + j < kk) {
+        if (V[I[jj + j] + h] == x) {
+            j++;
+        } else {
+            tmp = I[jj + j]; I[jj + j] = I[kk + k]; I[kk + k] = tmp;
+            k++;
+        }
+    }
+
+    if (jj > start) split(I, V, start, jj - start, h);
+
+    for (i = 0; i < kk - jj; i++) V[I[jj + i]] = kk - 1;
+    if (jj == kk - 1) I[jj] = -1;
+
+    if (start + len > kk) split(I, V, kk, start + len - kk, h);
+}
+
+/* suffix sort old into I */
+static void qsufsort(long long *I, long long *V, const unsigned char *old, long long oldsize)
+{
+    long long buckets[256];
+    long long i, h, len;
+
+    for (i = 0; i < 256; i++) buckets[i] = 0;
+    for (i = 0; i < oldsize; i++) buckets[old[i]]++;
+    for (i = 1; i < 256; i++) buckets[i] += buckets[i - 1];
+    for (i = 255; i > 0; i--) buckets[i] = buckets[i - 1];
+    buckets[0] = 0;
+
+    for (i = 0; i < oldsize; i++) I[++buckets[old[i]]] = i;
+    I[0] = oldsize;
+    for (i = 0; i < oldsize; i++) V[i] = buckets[old[i]];
+    V[oldsize] = 0;
+    for (i = 1; i < 256; i++) if (buckets[i] == buckets[i - 1] + 1) I[buckets[i]] = -1;
+    I[0] = -1;
+
+    for (h = 1; I[0] != -(oldsize + 1); h += h) {
+        len = 0;
+        for (i = 0; i < oldsize + 1;) {
+            if (I[i] < 0) {
+                len -= I[i];
+                i -= I[i];
+            } else {
+                if (len) I[i - len] = -len;
+                len = V[I[i]] + 1 - i;
+                split(I, V, i, len, h);
+                i += len;
+                len = 0;
+            }
+        }
+        if (len) I[i - len] = -len;
+    }
+
+    for (i = 0; i < oldsize + 1; i++) I[V[i]] = i;
+}
+
+static long long matchlen(const unsigned char *old, long long oldsize,
+    const unsigned char *new, long long newsize)
+{
+    long long i;
+    for (i = 0; i < oldsize && i < newsize; i++)
+        if (old[i] != new[i]) break;
+    return i;
+}
+
+/* binary search the suffix array for the longest match of new */
+static long long search(const long long *I, const unsigned char *old, long long oldsize,
+    const unsigned char *new, long long newsize, long long st, long long en, long long *pos)
+{
+    long long x, y;
+
+    while (en - st >= 2) {
+        x = st + (en - st) / 2;
+        y = oldsize - I[x];
+        if (memcmp(old + I[x], new, (y < newsize) ? y : newsize) < 0)
+            st = x;
+        else
+            en = x;
+    }
+
+    x = matchlen(old + I[st], oldsize - I[st], new, newsize);
+    y = matchlen(old + I[en], oldsize - I[en], new, newsize);
+    if (x > y) {
+        *pos = I[st];
+        return x;
+    } else {
+        *pos = I[en];
+        return y;
+    }
+}
+
+/* make a BSDIFF40 patch turning from (old) into to (new) */
+static int bsdiffEncode(const unsigned char *old, size_t fromSz,
+    const unsigned char *new, size_t toSz, struct Buffer_char *patch)
+{
+    long long oldsize = fromSz, newsize = toSz;
+    long long *I = NULL, *V = NULL;
+    unsigned char *db = NULL, *eb = NULL;
+    long long dblen = 0, eblen = 0;
+    struct Buffer_char ctrl;
+    unsigned char header[BSDIFF_HEADER_SIZE], cbuf[24];
+    long long scan, pos = 0, len;
+    long long lastscan, lastpos, lastoffset;
+    long long oldscore, scsc;
+    long long s, Sf, lenf, Sb, lenb;
+    long long overlap, Ss, lens;
+    long long i;
+    size_t start, ctrlEnd;
+    int ret = -1;
+
+    ctrl.buf = NULL;
+
+    I = malloc((oldsize + 1) * sizeof(long long));
+    V = malloc((oldsize + 1) * sizeof(long long));
+    db = malloc(newsize + 1);
+    eb = malloc(newsize + 1);
+    if (!I || !V || !db || !eb) {
+        perror("malloc");
+        goto done;
+    }
+    INIT_BUFFER(ctrl);
+
+    qsufsort(I, V, old, oldsize);
+    free(V);
+    V = NULL;
+
+    scan = 0;
+    len = 0;
+    lastscan = 0;
+    lastpos = 0;
+    lastoffset = 0;
+    while (scan < newsize) {
+        oldscore = 0;
+
+        for (scsc = scan += len; scan < newsize; scan++) {
+            len = search(I, old, oldsize, new + scan, newsize - scan, 0, oldsize, &pos);
+
+            for (; scsc < scan + len; scsc++)
+                if (scsc + lastoffset < oldsize &&
+                    old[scsc + lastoffset] == new[scsc])
+                    oldscore++;
+
+            if ((len == oldscore && len != 0) || len > oldscore + 8)
+                break;
+
+            if (scan + lastoffset < oldsize &&
+                old[scan + lastoffset] == new[scan])
+                oldscore--;
+        }
+
+        if (len != oldscore || scan == newsize) {
+            s = 0;
+            Sf = 0;
+            lenf = 0;
+            for (i = 0; lastscan + i < scan && lastpos + i < oldsize;) {
+                if (old[lastpos + i] == new[lastscan + i]) s++;
+                i++;
+                if (s * 2 - i > Sf * 2 - lenf) {
+                    Sf = s;
+                    lenf = i;
+                }
+            }
+
+            lenb = 0;
+            if (scan < newsize) {
+                s = 0;
+                Sb = 0;
+                for (i = 1; scan >= lastscan + i && pos >= i; i++) {
+                    if (old[pos - i] == new[scan - i]) s++;
+                    if (s * 2 - i > Sb * 2 - lenb) {
+                        Sb = s;
+                        lenb = i;
+                    }
+                }
+            }
+
+            if (lastscan + lenf > scan - lenb) {
+                overlap = (lastscan + lenf) - (scan - lenb);
+                s = 0;
+                Ss = 0;
+                lens = 0;
+                for (i = 0; i < overlap; i++) {
+                    if (new[lastscan + lenf - overlap + i] ==
+                        old[lastpos + lenf - overlap + i]) s++;
+                    if (new[scan - lenb + i] == old[pos - lenb + i]) s--;
+                    if (s > Ss) {
+                        Ss = s;
+                        lens = i + 1;
+                    }
+                }
+
+                lenf += lens - overlap;
+                lenb -= lens;
+            }
+
+            for (i = 0; i < lenf; i++)
+                db[dblen + i] = new[lastscan + i] - old[lastpos + i];
+            for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
+                eb[eblen + i] = new[lastscan + lenf + i];
+
+            dblen += lenf;
+            eblen += (scan - lenb) - (lastscan + lenf);
+
+            offtout(lenf, cbuf);
+            offtout((scan - lenb) - (lastscan + lenf), cbuf + 8);
+            offtout((pos - lenb) - (lastpos + lenf), cbuf + 16);
+            WRITE_BUFFER(ctrl, cbuf, 24);
+
+            lastscan = scan - lenb;
+            lastpos = pos - lenb;
+            lastoffset = pos - scan;
+        }
+    }
+
+    /* header, then the three compressed blocks */
+    start = patch->bufused;
+    memset(header, 0, BSDIFF_HEADER_SIZE);
+    WRITE_BUFFER(*patch, header, BSDIFF_HEADER_SIZE);
+    if (bzAppend(patch, (unsigned char *) ctrl.buf, ctrl.bufused) != 0)
+        goto done;
+    ctrlEnd = patch->bufused;
+    if (bzAppend(patch, db, dblen) != 0)
+        goto done;
+
+    memcpy(header, "BSDIFF40", 8);
+    offtout(ctrlEnd - start - BSDIFF_HEADER_SIZE, header + 8);
+    offtout(patch->bufused - ctrlEnd, header + 16);
+    offtout(newsize, header + 24);
+    memcpy(patch->buf + start, header, BSDIFF_HEADER_SIZE);
+
+    if (bzAppend(patch, eb, eblen) != 0)
+        goto done;
+
+    ret = 0;
+
+done:
+    free(I);
+    free(V);
+    free(db);
+    free(eb);
+    if (ctrl.buf) FREE_BUFFER(ctrl);
+    return ret;
+}
+
+/* apply a BSDIFF40 patch to from */
+static int bsdiffDecode(const unsigned char *old, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to)
+{
+    long long oldsize = fromSz, newsize, bzctrllen, bzdatalen;
+    long long oldpos, newpos, ctrl[3], i;
+    unsigned char cbuf[24], *new;
+    BzReader crd, drd, erd;
+    int inited = 0, ret = -1;
+
+    if (patchSz < BSDIFF_HEADER_SIZE || memcmp(patch, "BSDIFF40", 8)) {
+        fprintf(stderr, "Corrupt bsdiff patch\n");
+        return -1;
+    }
+    bzctrllen = offtin(patch + 8);
+    bzdatalen = offtin(patch + 16);
+    newsize = offtin(patch + 24);
+    if (bzctrllen < 0 || bzdatalen < 0 || newsize < 0 ||
+        bzctrllen > (long long) patchSz - BSDIFF_HEADER_SIZE ||
+        bzdatalen > (long long) patchSz - BSDIFF_HEADER_SIZE - bzctrllen) {
+        fprintf(stderr, "Corrupt bsdiff patch\n");
+        return -1;
+    }
+
+    if (bzReaderInit(&crd, patch + BSDIFF_HEADER_SIZE, bzctrllen) != 0)
+        return -1;
+    if (bzReaderInit(&drd, patch + BSDIFF_HEADER_SIZE + bzctrllen, bzdatalen) != 0) {
+        bzReaderEnd(&crd);
+        return -1;
+    }
+    if (bzReaderInit(&erd, patch + BSDIFF_HEADER_SIZE + bzctrllen + bzdatalen,
+            patchSz - BSDIFF_HEADER_SIZE - bzctrllen - bzdatalen) != 0) {
+        bzReaderEnd(&crd);
+        bzReaderEnd(&drd);
+        return -1;
+    }
+    inited = 1;
+
+    while (BUFFER_SPACE(*to) < (size_t) newsize)
+        EXPAND_BUFFER(*to);
+    new = (unsigned char *) BUFFER_END(*to);
+
+    oldpos = 0;
+    newpos = 0;
+    while (newpos < newsize) {
+        if (bzRead(&crd, cbuf, 24) != 0)
+            goto corrupt;
+        for (i = 0; i < 3; i++)
+            ctrl[i] = offtin(cbuf + i * 8);
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            ctrl[0] > newsize - newpos ||
+            ctrl[1] > newsize - newpos - ctrl[0])
+            goto corrupt;
+
+        /* add the difference to the old data */
+        if (bzRead(&drd, new + newpos, ctrl[0]) != 0)
+            goto corrupt;
+        for (i = 0; i < ctrl[0]; i++)
+            if (oldpos + i >= 0 && oldpos + i < oldsize)
+                new[newpos + i] += old[oldpos + i];
+        newpos += ctrl[0];
+        oldpos += ctrl[0];
+
+        /* then the extra data */
+        if (bzRead(&erd, new + newpos, ctrl[1]) != 0)
+            goto corrupt;
+        newpos += ctrl[1];
+        oldpos += ctrl[2];
+    }
+
+    STEP_BUFFER(*to, newsize);
+    ret = 0;
+    goto done;
+
+corrupt:
+    fprintf(stderr, "Corrupt bsdiff patch\n");
+
+done:
+    if (inited) {
+        bzReaderEnd(&crd);
+        bzReaderEnd(&drd);
+        bzReaderEnd(&erd);
+    }
+    return ret;
+}
@@ -0,0 +1,278 @@
+/*
+ * catalog.c: Time-ordered log of every increment written to a backup
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "catalog.h"
+
+/* The catalog is a flat file of records, each a fixed header followed by the
+ * path. Every record is written with a single O_APPEND write, so the only
+ * damage a crash can do is a torn record at the end. Each record carries a
+ * checksum, and readers skip forward byte by byte over anything that doesn't
+ * check out, so a torn record never hides the records after it. */
+#define CATALOG_MAGIC 0x4e494341 /* NICA */
+
+struct CatalogDisk_ {
+    uint32_t magic;
+    uint32_t check;
+    uint64_t incr;
+    int64_t time;
+    int64_t size;
+    uint16_t pathLen;
+    char type;
+    char codec;
+    uint32_t reserved;
+};
+typedef struct CatalogDisk_ CatalogDisk;
+
+#define CATALOG_READ_SZ 65536
+
+/* FNV-1a checksum of a record */
+static uint32_t catalogCheck(CatalogDisk *hdr, const char *path)
+{
+    uint32_t hash = 2166136261u, check;
+    const unsigned char *cur;
+    size_t i;
+
+    check = hdr->check;
+    hdr->check = 0;
+    cur = (const unsigned char *) hdr;
+    for (i = 0; i < sizeof(CatalogDisk); i++)
+        hash = (hash ^ cur[i]) * 16777619u;
+    cur = (const unsigned char *) path;
+    for (i = 0; i < hdr->pathLen; i++)
+        hash = (hash ^ cur[i]) * 16777619u;
+    hdr->check = check;
+
+    return hash;
+}
+
+/* open (or create) the catalog for appending */
+int catalogOpen(int destFd)
+{
+    return openat(destFd, CATALOG_NAME, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/* append a record to the catalog */
+int catalogAppend(int fd, CatalogRecord *rec)
+{
+    CatalogDisk hdr;
+    size_t pathLen, len;
+    char *buf;
+    ssize_t wr;
+
+    pathLen = strlen(rec->path);
+    if (pathLen > UINT16_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CATALOG_MAGIC;
+    hdr.incr = rec->incr;
+    hdr.time = rec->time;
+    hdr.size = rec->size;
+    hdr.pathLen = pathLen;
+    hdr.type = rec->type;
+    hdr.codec = rec->codec;
+    hdr.check = catalogCheck(&hdr, rec->path);
+
+    /* must be a single write to be safe */
+    len = sizeof(hdr) + pathLen;
+    buf = malloc(len);
+    if (buf == NULL) return -1;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), rec->path, pathLen);
+
+    wr = write(fd, buf, len);
+    free(buf);
+    if (wr < 0) return -1;
+    if ((size_t) wr != len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* open a reader on the catalog, starting at the given offset */
+int catalogReaderOpen(CatalogReader *rd, int destFd, long long offset)
+{
+    memset(rd, 0, sizeof(CatalogReader));
+    rd->fd = openat(destFd, CATALOG_NAME, O_RDONLY | O_CLOEXEC);
+    if (rd->fd < 0) return -1;
+    if (offset && lseek(rd->fd, offset, SEEK_SET) < 0) {
+        close(rd->fd);
+        rd->fd = -1;
+        return -1;
+    }
+    rd->offset = offset;
+
+    rd->bufSz = CATALOG_READ_SZ;
+    rd->buf = malloc(rd->bufSz);
+    if (rd->buf == NULL) {
+        close(rd->fd);
+        rd->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* make sure at least len bytes are buffered. Returns 1 on success, 0 at the
+ * end of the file, -1 on error */
+static int catalogFill(CatalogReader *rd, size_t len)
+{
+    ssize_t rdl;
+
+    if (rd->bufUsed - rd->bufStart >= len) return 1;
+
+    /* move what we have to the front */
+    memmove(rd->buf, rd->buf + rd->bufStart, rd->bufUsed - rd->bufStart);
+    rd->offset += rd->bufStart;
+    rd->bufUsed -= rd->bufStart;
+    rd->bufStart = 0;
+
+    if (len > rd->bufSz) {
+        char *nbuf = realloc(rd->buf, len);
+        if (nbuf == NULL) return -1;
+        rd->buf = nbuf;
+        rd->bufSz = len;
+    }
+
+    while (rd->bufUsed < len) {
+        rdl = read(rd->fd, rd->buf + rd->bufUsed, rd->bufSz - rd->bufUsed);
+        if (rdl < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (rdl == 0) return 0;
+        rd->bufUsed += rdl;
+    }
+
+    return 1;
+}
+
+/* read the next record */
+int catalogRead(CatalogReader *rd, CatalogRecord *rec)
+{
+    CatalogDisk hdr;
+    char *path;
+    int tmpi;
+
+    while (1) {
+        tmpi = catalogFill(rd, sizeof(CatalogDisk));
+        if (tmpi <= 0) return tmpi;
+        memcpy(&hdr, rd->buf + rd->bufStart, sizeof(CatalogDisk));
+        if (hdr.magic != CATALOG_MAGIC) {
+            /* garbage, resynchronize */
+            rd->bufStart++;
+            continue;
+        }
+
+        tmpi = catalogFill(rd, sizeof(CatalogDisk) + hdr.pathLen);
+        if (tmpi < 0) return tmpi;
+        if (tmpi == 0) {
+            /* a torn record at the end, but there may be more after it */
+            rd->bufStart++;
+            continue;
+        }
+
+        path = rd->buf + rd->bufStart + sizeof(CatalogDisk);
+        if (catalogCheck(&hdr, path) != hdr.check) {
+            /* torn record */
+            rd->bufStart++;
+            continue;
+        }
+
+        break;
+    }
+
+    rec->offset = rd->offset + rd->bufStart;
+    rec->next = rec->offset + sizeof(CatalogDisk) + hdr.pathLen;
+    rec->incr = hdr.incr;
+    rec->time = hdr.time;
+    rec->size = hdr.size;
+    rec->type = hdr.type;
+    rec->codec = hdr.codec;
+    /* move the path over the consumed header to terminate it in place */
+    memmove(rd->buf + rd->bufStart, path, hdr.pathLen);
+    rd->buf[rd->bufStart + hdr.pathLen] = 0;
+    rec->path = rd->buf + rd->bufStart;
+
+    rd->bufStart += sizeof(CatalogDisk) + hdr.pathLen;
+    return 1;
+}
+
+/* close a reader */
+void catalogReaderClose(CatalogReader *rd)
+{
+    if (rd->fd >= 0) close(rd->fd);
+    free(rd->buf);
+    rd->fd = -1;
+    rd->buf = NULL;
+}
+
+/* scan records in a time range, under a path prefix */
+int catalogScan(int destFd, long long offset, long long from, long long to,
+    const char *prefix, CatalogScanCallback cb, void *arg, long long *until)
+{
+    CatalogReader rd;
+    CatalogRecord rec;
+    size_t prefixLen = prefix ? strlen(prefix) : 0;
+    long long first = -1;
+    int tmpi;
+
+    if (catalogReaderOpen(&rd, destFd, offset) != 0)
+        return -1;
+
+    while ((tmpi = catalogRead(&rd, &rec)) > 0) {
+        /* a step back of the clock puts older records after newer ones, so
+         * keep going past anything too new */
+        if (rec.time >= to) {
+            if (first < 0) first = rec.offset;
+            continue;
+        }
+        if (rec.time < from) continue;
+        if (prefixLen &&
+            (strncmp(rec.path, prefix, prefixLen) ||
+             (rec.path[prefixLen] && rec.path[prefixLen] != '/')))
+            continue;
+
+        if (cb(&rec, arg)) {
+            if (first < 0) first = rec.next;
+            break;
+        }
+    }
+
+    if (until) {
+        if (first < 0) first = rd.offset + rd.bufStart;
+        *until = first;
+    }
+
+    catalogReaderClose(&rd);
+    return (tmpi < 0) ? -1 : 0;
+}
@@ -0,0 +1,68 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+/* the catalog lives in the root of the backup under this name */
+#define CATALOG_NAME "catalog"
+
+/* and nibackup-purge -I records how far it's gotten here */
+#define CATALOG_CURSOR_NAME "catalog.purged"
+
+/* one catalog record: path at increment incr was written at time */
+struct CatalogRecord_ {
+    char *path; /* relative to the backup root */
+    unsigned long long incr;
+    long long time;
+    long long size;
+    char type; /* MD_TYPE_* */
+    char codec; /* how incr-1 is now stored, CATALOG_CODEC_* */
+
+    long long offset; /* offset of this record in the catalog (read only) */
+    long long next; /* offset of the following record (read only) */
+};
+typedef struct CatalogRecord_ CatalogRecord;
+
+/* storage of the superseded increment */
+#define CATALOG_CODEC_NONE      '-'
+#define CATALOG_CODEC_PLAIN     'd'
+#define CATALOG_CODEC_BSDIFF    'b'
+#define CATALOG_CODEC_XDELTA3   'x'
+#define CATALOG_CODEC_CHUNKS    'c'
+
+/* a sequential catalog reader */
+struct CatalogReader_ {
+    int fd;
+    long long offset; /* file offset of buf[0] */
+    size_t bufStart, bufUsed, bufSz;
+    char *buf;
+};
+typedef struct CatalogReader_ CatalogReader;
+
+/* callback for catalogScan. Return nonzero to stop the scan. */
+typedef int (*CatalogScanCallback)(CatalogRecord *rec, void *arg);
+
+/* open (or create) the catalog for appending */
+int catalogOpen(int destFd);
+
+/* append a record to the catalog. Records are appended with the time they
+ * were written, which is usually in order, but goes back if the clock does. */
+int catalogAppend(int fd, CatalogRecord *rec);
+
+/* open a reader on the catalog, starting at the given offset */
+int catalogReaderOpen(CatalogReader *rd, int destFd, long long offset);
+
+/* read the next record. Returns 1 on success, 0 at the end, -1 on error.
+ * rec->path is only valid until the next read. */
+int catalogRead(CatalogReader *rd, CatalogRecord *rec);
+
+/* close a reader */
+void catalogReaderClose(CatalogReader *rd);
+
+/* Call cb for every record with from <= time < to under the path prefix
+ * (NULL for all), starting at the given offset. Times needn't be in order, so
+ * every record to the end is read. If until isn't NULL, it's set to the offset
+ * of the first record not dealt with: the first at or after to (or that cb
+ * stopped the scan at), or the end. */
+int catalogScan(int destFd, long long offset, long long from, long long to,
+    const char *prefix, CatalogScanCallback cb, void *arg, long long *until);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * chunk.c: Content-defined chunking into a shared chunk store
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "chunk.h"
+
+/* we read files this much at a time */
+#define CHUNK_READ_SIZE (1024*1024)
+
+/* Cut masks for normalized chunking: before the average size, cuts need more
+ * zero bits, after it fewer, which pulls chunk sizes in toward the average.
+ * The gear hash shifts left, so its high bits see the most input. */
+#define CHUNK_MASK_SMALL 0xFFFE000000000000ULL /* 15 bits */
+#define CHUNK_MASK_LARGE 0xFFE0000000000000ULL /* 11 bits */
+
+/* unique temporary names for chunks being written */
+static unsigned long tmpCounter = 0;
+
+/* The gear table. It must never change, or new chunks will stop lining up
+ * with old ones, so it's generated from a fixed seed. */
+static void chunkGear(uint64_t *gear)
+{
+    uint64_t x = 0x4e69426b43444321ULL, z;
+    int i;
+    for (i = 0; i < 256; i++) {
+        /* splitmix64 */
+        z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* find the length of the next chunk in buf */
+static size_t chunkCut(const uint64_t *gear, const unsigned char *buf, size_t len)
+{
+    size_t i, normal, max;
+    uint64_t h = 0;
+
+    if (len <= CHUNK_MIN_SIZE)
+        return len;
+    normal = (len < CHUNK_AVG_SIZE) ? len : CHUNK_AVG_SIZE;
+    max = (len < CHUNK_MAX_SIZE) ? len : CHUNK_MAX_SIZE;
+
+    for (i = CHUNK_MIN_SIZE; i < normal; i++) {
+        h = (h << 1) + gear[buf[i]];
+        if (!(h & CHUNK_MASK_SMALL)) return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[buf[i]];
+        if (!(h & CHUNK_MASK_LARGE)) return i + 1;
+    }
+    return max;
+}
+
+/* write a hash in hex */
+static void chunkHex(const unsigned char *hash, char *hexHash)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA256_SIZE; i++) {
+        *hexHash++ = hex[hash[i] >> 4];
+        *hexHash++ = hex[hash[i] & 0xF];
+    }
+    *hexHash = 0;
+}
+
+/* the name of a chunk in the store, <2 hex>/<62 hex> */
+void chunkName(const unsigned char *hash, char *name)
+{
+    chunkHex(hash, name + 1);
+    name[0] = name[1];
+    name[1] = name[2];
+    name[2] = '/';
+}
+
+/* parse a hex hash */
+static int chunkParseHash(const char *hexHash, unsigned char *hash)
+{
+    int i, j, v;
+    for (i = 0; i < SHA256_SIZE; i++) {
+        v = 0;
+        for (j = 0; j < 2; j++) {
+            char c = *hexHash++;
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= c - '0';
+            else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else return -1;
+        }
+        hash[i] = v;
+    }
+    return 0;
+}
+
+/* open the chunk store */
+int chunkStoreOpen(int destFd, int create)
+{
+    if (create && mkdirat(destFd, CHUNK_DIR_NAME, 0700) < 0 && errno != EEXIST)
+        return -1;
+    return openat(destFd, CHUNK_DIR_NAME, O_RDONLY | O_DIRECTORY);
+}
+
+/* put a chunk in the store, if it's not already there */
+static int chunkPut(int storeFd, const unsigned char *buf, size_t len, Chunk *chunk)
+{
+    char name[CHUNK_NAME_SIZE], tmpName[CHUNK_NAME_SIZE + 64];
+    ssize_t wr;
+    size_t off;
+    int fd;
+
+    sha256(buf, len, chunk->hash);
+    chunk->size = len;
+    chunkName(chunk->hash, name);
+
+    /* already have it? Freshen it so a concurrent GC leaves it alone */
+    if (utimensat(storeFd, name, NULL, 0) == 0)
+        return 0;
+
+    name[2] = 0;
+    if (mkdirat(storeFd, name, 0700) < 0 && errno != EEXIST) {
+        perror(name);
+        return -1;
+    }
+    name[2] = '/';
+
+    /* write it under a temporary name, then move it into place */
+    sprintf(tmpName, "%s.%d.%lu.tmp", name, (int) getpid(),
+        __sync_fetch_and_add(&tmpCounter, 1));
+    fd = openat(storeFd, tmpName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(tmpName);
+        return -1;
+    }
+    for (off = 0; off < len; off += wr) {
+        wr = write(fd, buf + off, len - off);
+        if (wr < 0) {
+            if (errno == EINTR) {
+                wr = 0;
+                continue;
+            }
+            perror(tmpName);
+            close(fd);
+            unlinkat(storeFd, tmpName, 0);
+            return -1;
+        }
+    }
+    close(fd);
+
+    if (renameat(storeFd, tmpName, storeFd, name) < 0) {
+        perror(name);
+        unlinkat(storeFd, tmpName, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* split ifd's content into the chunk store, and write its chunk list */
+int chunkStoreFile(int storeFd, int ifd, int ddirfd, const char *dname)
+{
+    uint64_t gear[256];
+    unsigned char *buf = NULL;
+    char hexHash[SHA256_SIZE*2 + 1];
+    size_t bufUsed = 0, start = 0, len;
+    off_t off = 0;
+    ssize_t rd;
+    char *tmpName = NULL;
+    int lfd, eof = 0, ret = -1;
+    FILE *lf = NULL;
+    Chunk chunk;
+
+    chunkGear(gear);
+
+    /* the list may be a link shared with another path, so write a new one and
+     * move it into place */
+    tmpName = malloc(strlen(dname) + 64);
+    if (tmpName == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    sprintf(tmpName, "%s.%d.%lu.tmp", dname, (int) getpid(),
+        __sync_fetch_and_add(&tmpCounter, 1));
+
+    buf = malloc(CHUNK_READ_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        goto done;
+    }
+
+    lfd = openat(ddirfd, tmpName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (lfd < 0) {
+        perror(tmpName);
+        goto done;
+    }
+    lf = fdopen(lfd, "w");
+    if (lf == NULL) {
+        perror(tmpName);
+        close(lfd);
+        unlinkat(ddirfd, tmpName, 0);
+        goto done;
+    }
+
+    while (1) {
+        /* keep at least a maximum chunk in the buffer */
+        if (!eof && bufUsed - start < CHUNK_MAX_SIZE) {
+            memmove(buf, buf + start, bufUsed - start);
+            bufUsed -= start;
+            start = 0;
+            while (!eof && bufUsed < CHUNK_READ_SIZE) {
+                rd = pread(ifd, buf + bufUsed, CHUNK_READ_SIZE - bufUsed, off);
+                if (rd < 0) {
+                    if (errno == EINTR) continue;
+                    perror("read");
+                    goto done;
+                }
+                if (rd == 0) eof = 1;
+                bufUsed += rd;
+                off += rd;
+            }
+        }
+        if (start == bufUsed) break;
+
+        len = chunkCut(gear, buf + start, bufUsed - start);
+        if (chunkPut(storeFd, buf + start, len, &chunk) != 0)
+            goto done;
+        chunkHex(chunk.hash, hexHash);
+        fprintf(lf, "%s %lu\n", hexHash, (unsigned long) len);
+        start += len;
+    }
+
+    if (fclose(lf) != 0) {
+        lf = NULL;
+        perror(tmpName);
+        goto done;
+    }
+    lf = NULL;
+    if (renameat(ddirfd, tmpName, ddirfd, dname) < 0) {
+        perror(dname);
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if (lf) fclose(lf);
+    if (ret != 0 && tmpName) unlinkat(ddirfd, tmpName, 0);
+    free(tmpName);
+    free(buf);
+    return ret;
+}
+
+/* call cb for each chunk in a chunk list */
+int chunkListRead(int ddirfd, const char *dname, ChunkListCallback cb, void *arg)
+{
+    char line[SHA256_SIZE*2 + 64], hexHash[SHA256_SIZE*2 + 1];
+    unsigned long size;
+    Chunk chunk;
+    FILE *lf;
+    int fd, ret = 0;
+
+    fd = openat(ddirfd, dname, O_RDONLY);
+    if (fd < 0) return -1;
+    lf = fdopen(fd, "r");
+    if (lf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), lf)) {
+        if (sscanf(line, "%64s %lu", hexHash, &size) != 2 ||
+            strlen(hexHash) != SHA256_SIZE*2 ||
+            chunkParseHash(hexHash, chunk.hash) != 0) {
+            fprintf(stderr, "%s: corrupt chunk list\n", dname);
+            ret = -1;
+            break;
+        }
+        chunk.size = size;
+        if (cb(&chunk, arg)) break;
+    }
+    if (ferror(lf)) ret = -1;
+
+    fclose(lf);
+    return ret;
+}
+
+/* read a chunk from the store, checking it */
+static int chunkGet(int storeFd, Chunk *chunk, unsigned char *buf)
+{
+    char name[CHUNK_NAME_SIZE];
+    unsigned char hash[SHA256_SIZE];
+    size_t off;
+    ssize_t rd;
+    int fd;
+
+    chunkName(chunk->hash, name);
+    fd = openat(storeFd, name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    for (off = 0; off < chunk->size; off += rd) {
+        rd = read(fd, buf + off, chunk->size - off);
+        if (rd < 0 && errno == EINTR) {
+            rd = 0;
+            continue;
+        }
+        if (rd <= 0) break;
+    }
+    close(fd);
+
+    sha256(buf, chunk->size, hash);
+    if (off != chunk->size || memcmp(hash, chunk->hash, SHA256_SIZE)) {
+        fprintf(stderr, "%s: corrupt chunk\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/* state for chunkLoad and chunkRestore */
+struct ChunkRead_ {
+    int storeFd, fd;
+    off_t off;
+    struct Buffer_char *out;
+    unsigned char *buf;
+    int err;
+};
+typedef struct ChunkRead_ ChunkRead;
+
+static int chunkLoadCb(Chunk *chunk, void *crvp)
+{
+    ChunkRead *cr = (ChunkRead *) crvp;
+    while (BUFFER_SPACE(*cr->out) < chunk->size)
+        EXPAND_BUFFER(*cr->out);
+    if (chunkGet(cr->storeFd, chunk, (unsigned char *) BUFFER_END(*cr->out)) != 0) {
+        cr->err = 1;
+        return 1;
+    }
+    STEP_BUFFER(*cr->out, chunk->size);
+    return 0;
+}
+
+/* load the content named by a chunk list onto the end of a buffer */
+int chunkLoad(int storeFd, int ddirfd, const char *dname, struct Buffer_char *out)
+{
+    ChunkRead cr;
+    cr.storeFd = storeFd;
+    cr.out = out;
+    cr.err = 0;
+    if (chunkListRead(ddirfd, dname, chunkLoadCb, &cr) != 0 || cr.err)
+        return -1;
+    return 0;
+}
+
+static int chunkRestoreCb(Chunk *chunk, void *crvp)
+{
+    ChunkRead *cr = (ChunkRead *) crvp;
+    size_t i;
+
+    if (chunk->size > CHUNK_MAX_SIZE ||
+        chunkGet(cr->storeFd, chunk, cr->buf) != 0) {
+        cr->err = 1;
+        return 1;
+    }
+
+    /* leave a hole for zeroes */
+    for (i = 0; i < chunk->size && !cr->buf[i]; i++);
+    if (i < chunk->size &&
+        pwrite(cr->fd, cr->buf, chunk->size, cr->off) != (ssize_t) chunk->size) {
+        perror("write");
+        cr->err = 1;
+        return 1;
+    }
+    cr->off += chunk->size;
+    return 0;
+}
+
+/* restore the content named by a chunk list into a (sparse) file */
+int chunkRestore(int storeFd, int ddirfd, const char *dname, int tdirfd, const char *tname)
+{
+    ChunkRead cr;
+    int ret = -1;
+
+    cr.storeFd = storeFd;
+    cr.off = 0;
+    cr.err = 0;
+    cr.buf = malloc(CHUNK_MAX_SIZE);
+    if (cr.buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    cr.fd = openat(tdirfd, tname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (cr.fd < 0) {
+        perror(tname);
+        free(cr.buf);
+        return -1;
+    }
+
+    if (chunkListRead(ddirfd, dname, chunkRestoreCb, &cr) == 0 && !cr.err &&
+        ftruncate(cr.fd, cr.off) == 0)
+        ret = 0;
+
+    close(cr.fd);
+    free(cr.buf);
+    return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+
+#include "sha256.h"
+
+struct Buffer_char;
+
+/* the chunk store lives in the root of the backup under this name */
+#define CHUNK_DIR_NAME "chunks"
+
+/* increments stored as chunks have a chunk list, <n>.chl, instead of content */
+#define CHUNK_LIST_EXT "chl"
+
+/* content-defined chunk sizes */
+#define CHUNK_MIN_SIZE  (2*1024)
+#define CHUNK_AVG_SIZE  (8*1024)
+#define CHUNK_MAX_SIZE  (64*1024)
+
+/* a chunk, as named in a chunk list */
+struct Chunk_ {
+    unsigned char hash[SHA256_SIZE];
+    size_t size;
+};
+typedef struct Chunk_ Chunk;
+
+/* callback for chunkListRead. Return nonzero to stop. */
+typedef int (*ChunkListCallback)(Chunk *chunk, void *arg);
+
+/* open the chunk store, creating it if asked. Returns -1 (ENOENT) if it
+ * doesn't exist and create is 0. */
+int chunkStoreOpen(int destFd, int create);
+
+/* split ifd's content into the chunk store, and write its chunk list */
+int chunkStoreFile(int storeFd, int ifd, int ddirfd, const char *dname);
+
+/* call cb for each chunk in a chunk list */
+int chunkListRead(int ddirfd, const char *dname, ChunkListCallback cb, void *arg);
+
+/* load the content named by a chunk list onto the end of a buffer */
+int chunkLoad(int storeFd, int ddirfd, const char *dname, struct Buffer_char *out);
+
+/* restore the content named by a chunk list into a (sparse) file */
+int chunkRestore(int storeFd, int ddirfd, const char *dname, int tdirfd, const char *tname);
+
+/* the name of a chunk in the store, <2 hex>/<62 hex> */
+void chunkName(const unsigned char *hash, char *name);
+#define CHUNK_NAME_SIZE (SHA256_SIZE*2 + 2)
+
+#endif
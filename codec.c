@@ -0,0 +1,224 @@
+/*
+ * codec.c: In-process delta codecs
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "codec.h"
+
+const Codec *const codecs[] = {
+    &codecBsdiff,
+    &codecVcdiff,
+    NULL
+};
+
+/* write all of a buffer at the given offset */
+static int writeAll(int fd, const char *buf, size_t len, off_t off);
+
+/* run a codec's external decoder on in-memory data, through temporary files */
+static int codecExternal(const Codec *codec, const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to);
+
+/* find a codec by patch extension */
+const Codec *codecByExt(const char *ext)
+{
+    int i;
+    for (i = 0; codecs[i]; i++)
+        if (!strcmp(codecs[i]->ext, ext)) return codecs[i];
+    return NULL;
+}
+
+/* map a whole file for reading */
+const unsigned char *codecMap(int fd, size_t *sz)
+{
+    struct stat sbuf;
+    void *buf;
+
+    if (fstat(fd, &sbuf) != 0)
+        return NULL;
+    *sz = sbuf.st_size;
+
+    /* can't map nothing */
+    if (*sz == 0)
+        return (const unsigned char *) "";
+
+    buf = mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+    return (const unsigned char *) buf;
+}
+
+/* unmap a file mapped by codecMap */
+void codecUnmap(const unsigned char *buf, size_t sz)
+{
+    if (sz) munmap((void *) buf, sz);
+}
+
+/* apply a patch in memory, falling back to the external decoder if needed */
+int codecDecode(const Codec *codec, const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to)
+{
+    size_t start = to->bufused;
+    int ret = codec->decode(from, fromSz, patch, patchSz, to);
+    if (ret == CODEC_EXTERNAL && codec->external) {
+        to->bufused = start;
+        ret = codecExternal(codec, from, fromSz, patch, patchSz, to);
+    }
+    return ret;
+}
+
+/* make a patch turning fromFd's content into toFd's, written to patchFd */
+int codecEncodeFd(const Codec *codec, int fromFd, int toFd, int patchFd)
+{
+    const unsigned char *from = NULL, *to = NULL;
+    size_t fromSz = 0, toSz = 0;
+    struct Buffer_char patch;
+    int ret = -1;
+
+    patch.buf = NULL;
+
+    from = codecMap(fromFd, &fromSz);
+    if (from == NULL) goto done;
+    to = codecMap(toFd, &toSz);
+    if (to == NULL) goto done;
+
+    INIT_BUFFER(patch);
+    if (codec->encode(from, fromSz, to, toSz, &patch) != 0)
+        goto done;
+
+    if (writeAll(patchFd, patch.buf, patch.bufused, 0) != 0 ||
+        ftruncate(patchFd, patch.bufused) != 0)
+        goto done;
+
+    ret = 0;
+
+done:
+    if (from) codecUnmap(from, fromSz);
+    if (to) codecUnmap(to, toSz);
+    if (patch.buf) FREE_BUFFER(patch);
+    return ret;
+}
+
+/* apply patchFd to fromFd's content, replacing toFd's content */
+int codecDecodeFd(const Codec *codec, int fromFd, int patchFd, int toFd)
+{
+    const unsigned char *from = NULL, *patch = NULL;
+    size_t fromSz = 0, patchSz = 0;
+    struct Buffer_char to;
+    int ret = -1;
+
+    to.buf = NULL;
+
+    from = codecMap(fromFd, &fromSz);
+    if (from == NULL) goto done;
+    patch = codecMap(patchFd, &patchSz);
+    if (patch == NULL) goto done;
+
+    INIT_BUFFER(to);
+    if (codecDecode(codec, from, fromSz, patch, patchSz, &to) != 0)
+        goto done;
+
+    /* from may be the same file as to, so let it go before writing */
+    codecUnmap(from, fromSz);
+    from = NULL;
+
+    if (writeAll(toFd, to.buf, to.bufused, 0) != 0 ||
+        ftruncate(toFd, to.bufused) != 0)
+        goto done;
+
+    ret = 0;
+
+done:
+    if (from) codecUnmap(from, fromSz);
+    if (patch) codecUnmap(patch, patchSz);
+    if (to.buf) FREE_BUFFER(to);
+    return ret;
+}
+
+/* write all of a buffer at the given offset */
+static int writeAll(int fd, const char *buf, size_t len, off_t off)
+{
+    ssize_t wr;
+    while (len) {
+        wr = pwrite(fd, buf, len, off);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += wr;
+        len -= wr;
+        off += wr;
+    }
+    return 0;
+}
+
+/* run a codec's external decoder on in-memory data, through temporary files */
+static int codecExternal(const Codec *codec, const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to)
+{
+    FILE *fromF = NULL, *patchF = NULL, *toF = NULL;
+    char fromBuf[15+4*sizeof(int)];
+    char patchBuf[15+4*sizeof(int)];
+    char toBuf[15+4*sizeof(int)];
+    int ret = -1;
+
+    fromF = tmpfile();
+    patchF = tmpfile();
+    toF = tmpfile();
+    if (!fromF || !patchF || !toF) {
+        perror("tmpfile");
+        goto done;
+    }
+
+    if (writeAll(fileno(fromF), (const char *) from, fromSz, 0) != 0 ||
+        writeAll(fileno(patchF), (const char *) patch, patchSz, 0) != 0) {
+        perror("write");
+        goto done;
+    }
+
+    sprintf(fromBuf, "/proc/self/fd/%d", fileno(fromF));
+    sprintf(patchBuf, "/proc/self/fd/%d", fileno(patchF));
+    sprintf(toBuf, "/proc/self/fd/%d", fileno(toF));
+    if (codec->external(fromBuf, patchBuf, toBuf) != 0)
+        goto done;
+
+    /* the external tool wrote through its own file description */
+    rewind(toF);
+    if (BUFFER_SPACE(*to) == 0)
+        EXPAND_BUFFER(*to);
+    READ_FILE_BUFFER(*to, toF);
+    if (ferror(toF))
+        goto done;
+
+    ret = 0;
+
+done:
+    if (fromF) fclose(fromF);
+    if (patchF) fclose(patchF);
+    if (toF) fclose(toF);
+    return ret;
+}
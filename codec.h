@@ -0,0 +1,60 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+struct Buffer_char;
+
+/* returned by a decoder for a patch only its external tool can read */
+#define CODEC_EXTERNAL (-2)
+
+/* a delta codec. A patch turns one version of a file (from) into another (to).
+ * Both directions work entirely in memory. */
+struct Codec_ {
+    const char *name;
+    const char *ext; /* patch file extension */
+    char catalogCodec; /* CATALOG_CODEC_* */
+
+    /* make a patch turning from into to, appended to patch. Returns 0 on
+     * success. */
+    int (*encode)(const unsigned char *from, size_t fromSz,
+        const unsigned char *to, size_t toSz, struct Buffer_char *patch);
+
+    /* apply a patch to from, appending the result to to. Returns 0 on
+     * success or CODEC_EXTERNAL. */
+    int (*decode)(const unsigned char *from, size_t fromSz,
+        const unsigned char *patch, size_t patchSz, struct Buffer_char *to);
+
+    /* run an external decoder on files named by path, for patches decode
+     * can't handle. May be NULL. */
+    int (*external)(const char *from, const char *patch, const char *to);
+};
+typedef struct Codec_ Codec;
+
+extern const Codec codecBsdiff, codecVcdiff;
+
+/* all codecs, in the order restore looks for their patches, NULL terminated */
+extern const Codec *const codecs[];
+
+/* find a codec by patch extension */
+const Codec *codecByExt(const char *ext);
+
+/* map a whole file for reading. Returns NULL on error. */
+const unsigned char *codecMap(int fd, size_t *sz);
+
+/* unmap a file mapped by codecMap */
+void codecUnmap(const unsigned char *buf, size_t sz);
+
+/* apply a patch in memory, falling back to the external decoder if needed */
+int codecDecode(const Codec *codec, const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to);
+
+/* make a patch turning fromFd's content into toFd's, written to patchFd. The
+ * patch is built in memory, so needs memory in proportion to the change. */
+int codecEncodeFd(const Codec *codec, int fromFd, int toFd, int patchFd);
+
+/* apply patchFd to fromFd's content, replacing toFd's content with the
+ * result. fromFd and toFd may be the same file. */
+int codecDecodeFd(const Codec *codec, int fromFd, int patchFd, int toFd);
+
+#endif
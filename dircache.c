@@ -0,0 +1,180 @@
+/*
+ * dircache.c: Cache of open directories for continuous backup
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dircache.h"
+
+/* the table never grows, since the cache is bounded */
+#define DIR_CACHE_BUCKETS (DIR_CACHE_SIZE * 2)
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static DirCacheEntry *buckets[DIR_CACHE_BUCKETS];
+static DirCacheEntry lru = {.lruPrev = &lru, .lruNext = &lru};
+static int count = 0;
+
+/* classic (Bernstein) hash */
+static size_t hashPath(const char *str)
+{
+    size_t hash = 5381;
+    int c;
+
+    while ((c = (unsigned char) *str++))
+        hash = ((hash << 5) + hash) ^ c; /* hash * 33 ^ c */
+
+    return hash;
+}
+
+/* drop a reference, with the lock held */
+static void release(DirCacheEntry *entry)
+{
+    if (--entry->refs > 0) return;
+    if (entry->source >= 0) close(entry->source);
+    if (entry->dest >= 0) close(entry->dest);
+    free(entry->path);
+    free(entry);
+}
+
+/* take an entry out of the cache, with the lock held */
+static void evict(DirCacheEntry *entry)
+{
+    DirCacheEntry **ep;
+
+    for (ep = &buckets[entry->hash % DIR_CACHE_BUCKETS]; *ep != entry; ep = &(*ep)->hashNext);
+    *ep = entry->hashNext;
+    entry->lruPrev->lruNext = entry->lruNext;
+    entry->lruNext->lruPrev = entry->lruPrev;
+    count--;
+    release(entry);
+}
+
+/* find a directory */
+DirCacheEntry *dirCacheGet(const char *path)
+{
+    DirCacheEntry *entry;
+    size_t hash = hashPath(path);
+
+    pthread_mutex_lock(&cacheLock);
+    for (entry = buckets[hash % DIR_CACHE_BUCKETS]; entry; entry = entry->hashNext) {
+        if (entry->hash == hash && !strcmp(entry->path, path)) {
+            /* most recently used */
+            entry->lruPrev->lruNext = entry->lruNext;
+            entry->lruNext->lruPrev = entry->lruPrev;
+            entry->lruPrev = lru.lruPrev;
+            entry->lruNext = &lru;
+            lru.lruPrev->lruNext = entry;
+            lru.lruPrev = entry;
+            entry->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    return entry;
+}
+
+/* cache a directory */
+DirCacheEntry *dirCacheAdd(const char *path, int source, int dest)
+{
+    DirCacheEntry *entry, *old;
+    size_t b;
+
+    entry = malloc(sizeof(DirCacheEntry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        close(source);
+        close(dest);
+        return NULL;
+    }
+    entry->hash = hashPath(path);
+    entry->source = source;
+    entry->dest = dest;
+    entry->refs = 2;
+    entry->checked = entry->verified = 0;
+
+    pthread_mutex_lock(&cacheLock);
+
+    /* replace any old version */
+    b = entry->hash % DIR_CACHE_BUCKETS;
+    for (old = buckets[b]; old; old = old->hashNext) {
+        if (old->hash == entry->hash && !strcmp(old->path, path)) {
+            evict(old);
+            break;
+        }
+    }
+
+    /* make room */
+    if (count >= DIR_CACHE_SIZE)
+        evict(lru.lruNext);
+
+    entry->hashNext = buckets[b];
+    buckets[b] = entry;
+    entry->lruPrev = lru.lruPrev;
+    entry->lruNext = &lru;
+    lru.lruPrev->lruNext = entry;
+    lru.lruPrev = entry;
+    count++;
+
+    pthread_mutex_unlock(&cacheLock);
+
+    return entry;
+}
+
+/* take another reference */
+void dirCacheHold(DirCacheEntry *entry)
+{
+    pthread_mutex_lock(&cacheLock);
+    entry->refs++;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* drop a reference */
+void dirCacheRelease(DirCacheEntry *entry)
+{
+    pthread_mutex_lock(&cacheLock);
+    release(entry);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* forget a directory and everything under it */
+void dirCacheInvalidate(const char *path)
+{
+    DirCacheEntry *entry, *next;
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&cacheLock);
+    for (entry = lru.lruNext; entry != &lru; entry = next) {
+        next = entry->lruNext;
+        if (!strncmp(entry->path, path, len) &&
+            (entry->path[len] == 0 || entry->path[len] == '/'))
+            evict(entry);
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* forget everything */
+void dirCacheClear(void)
+{
+    pthread_mutex_lock(&cacheLock);
+    while (lru.lruNext != &lru)
+        evict(lru.lruNext);
+    pthread_mutex_unlock(&cacheLock);
+}
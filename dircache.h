@@ -0,0 +1,42 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stddef.h>
+
+/* most directories to keep open (each is two fds) */
+#define DIR_CACHE_SIZE 128
+
+/* a directory, by its path relative to the source, open in the source and the
+ * backup */
+struct DirCacheEntry_ {
+    struct DirCacheEntry_ *hashNext, *lruPrev, *lruNext;
+    char *path;
+    size_t hash;
+    int source, dest;
+    int refs; /* users, plus one while it's in the cache */
+    unsigned long checked; /* the last batch that checked its metadata */
+    unsigned long verified; /* the last batch that checked it's still there */
+};
+typedef struct DirCacheEntry_ DirCacheEntry;
+
+/* find a directory, taking a reference to it. Returns NULL if it's not cached. */
+DirCacheEntry *dirCacheGet(const char *path);
+
+/* cache a directory, taking its fds, and return a reference to it. Returns
+ * NULL (having closed the fds) on error. */
+DirCacheEntry *dirCacheAdd(const char *path, int source, int dest);
+
+/* take another reference */
+void dirCacheHold(DirCacheEntry *entry);
+
+/* drop a reference */
+void dirCacheRelease(DirCacheEntry *entry);
+
+/* a directory (path relative to the source) was deleted or renamed, so forget
+ * it and everything under it */
+void dirCacheInvalidate(const char *path);
+
+/* forget everything */
+void dirCacheClear(void);
+
+#endif
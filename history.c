@@ -0,0 +1,536 @@
+/*
+ * history.c: Each backed-up path's increments, in either store layout
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+
+/* the header, before the padding */
+#define HISTORY_HEADER_SIZE 16
+
+/* where a packed record's fields are */
+#define REC_TIME        MD_RECORD_SIZE
+#define REC_FLAGS       (REC_TIME + 8)
+#define REC_INLINE_LEN  (REC_FLAGS + 1)
+
+/* read a packed record. Returns -1 (ENOENT) if it's empty. */
+static int readRecord(History *h, unsigned long long incr, unsigned char *rec);
+
+/* where an increment's time is, in either layout */
+static off_t timeOffset(History *h, unsigned long long incr);
+
+/* read an increment's time from the index. Returns -1 if it isn't indexed. */
+static int readTime(History *h, unsigned long long incr, long long *time);
+
+/* the time to give a new increment, indexing any before it that aren't */
+static long long nextTime(History *h, unsigned long long incr);
+
+/* does this directory entry name a history? */
+int historyEntry(const char *dname)
+{
+    return !strncmp(dname, "nii", 3) || !strncmp(dname, "nih", 3);
+}
+
+/* should new paths in this backup be packed? */
+int historyPackedStore(int destFd, int create)
+{
+    int fd;
+
+    if (faccessat(destFd, HISTORY_PACKED_NAME, F_OK, 0) == 0)
+        return 1;
+    if (errno != ENOENT)
+        return -1;
+    if (!create)
+        return 0;
+
+    fd = openat(destFd, HISTORY_PACKED_NAME, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0)
+        return -1;
+    close(fd);
+    return 1;
+}
+
+/* open and lock a path's history */
+int historyOpen(History *h, int dirfd, const char *name, int lock, int how)
+{
+    int mode = (lock & LOCK_EX) ? O_RDWR : O_RDONLY;
+    char incrBuf[HISTORY_COUNTER_SIZE+1];
+    unsigned char header[HISTORY_HEADER_SIZE];
+    ssize_t rd;
+    int err;
+
+    h->dirfd = dirfd;
+    h->fd = -1;
+    h->cur = 0;
+
+    /* room for ni?<name>/<ull>.<ext> */
+    h->pseudo = malloc(strlen(name) + (4*sizeof(unsigned long long)) + 9);
+    if (h->pseudo == NULL)
+        return -1;
+    h->pseudoD = h->pseudo + strlen(name) + 3;
+    sprintf(h->pseudo, "nih%s", name);
+
+    /* packed, or the original layout, or neither yet */
+    h->packed = 1;
+    h->fd = openat(dirfd, h->pseudo, mode);
+    if (h->fd < 0 && errno == ENOENT) {
+        h->packed = 0;
+        h->pseudo[2] = 'i';
+        h->fd = openat(dirfd, h->pseudo, mode);
+        if (h->fd < 0 && errno == ENOENT && how != HISTORY_OPEN) {
+            if (how == HISTORY_CREATE_PACKED) {
+                h->packed = 1;
+                h->pseudo[2] = 'h';
+            }
+            h->fd = openat(dirfd, h->pseudo, mode | O_CREAT, 0600);
+        }
+    }
+    if (h->fd < 0)
+        goto fail;
+    if (flock(h->fd, lock) != 0)
+        goto fail;
+
+    if (h->packed) {
+        /* an empty file is one we've only just created */
+        rd = pread(h->fd, header, sizeof(header), 0);
+        if (rd < 0)
+            goto fail;
+        if (rd > 0) {
+            if (rd != sizeof(header) || memcmp(header, HISTORY_MAGIC, 3) ||
+                header[3] != HISTORY_VERSION) {
+                errno = EIO;
+                goto fail;
+            }
+            h->cur = getLE(header + 8, 8);
+        }
+
+    } else {
+        rd = pread(h->fd, incrBuf, sizeof(incrBuf) - 1, 0);
+        if (rd < 0)
+            goto fail;
+        incrBuf[rd] = 0;
+        h->cur = atoll(incrBuf);
+
+        /* and somewhere for the metadata */
+        if (how == HISTORY_CREATE) {
+            h->pseudo[2] = 'm';
+            *h->pseudoD = 0;
+            if (mkdirat(dirfd, h->pseudo, 0700) < 0 && errno != EEXIST)
+                goto fail;
+        }
+
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    historyClose(h);
+    errno = err;
+    return -1;
+}
+
+/* read a packed record */
+static int readRecord(History *h, unsigned long long incr, unsigned char *rec)
+{
+    ssize_t rd;
+
+    if (incr == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    rd = pread(h->fd, rec, HISTORY_RECORD_SIZE, incr * HISTORY_RECORD_SIZE);
+    if (rd < 0)
+        return -1;
+    if (rd < HISTORY_RECORD_SIZE || memcmp(rec, MD_MAGIC, 3)) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* get an increment's metadata and time */
+int historyGet(History *h, unsigned long long incr, BackupMetadata *meta, long long *time)
+{
+    unsigned char rec[HISTORY_RECORD_SIZE];
+    struct stat sbuf;
+    int err;
+
+    if (h->packed) {
+        if (readRecord(h, incr, rec) != 0)
+            goto fail;
+        if (meta && decodeMetadata(meta, rec) != 0) {
+            errno = EIO;
+            goto fail;
+        }
+        if (time)
+            *time = getLE(rec + REC_TIME, 8);
+        return 0;
+    }
+
+    h->pseudo[2] = 'm';
+    sprintf(h->pseudoD, "/%llu.met", incr);
+    if (time && readTime(h, incr, time) != 0) {
+        /* from before the index, so all we have is when it was written */
+        if (fstatat(h->dirfd, h->pseudo, &sbuf, 0) != 0)
+            goto fail;
+        *time = sbuf.st_mtime;
+        if (!meta)
+            return 0;
+    }
+    if (meta)
+        return readMetadata(meta, h->dirfd, h->pseudo, 1);
+    if (faccessat(h->dirfd, h->pseudo, F_OK, 0) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    if (meta) {
+        err = errno;
+        memset(meta, 0, sizeof(BackupMetadata));
+        meta->type = MD_TYPE_NONEXIST;
+        errno = err;
+    }
+    return -1;
+}
+
+/* get an increment's inline content */
+ssize_t historyInline(History *h, unsigned long long incr, unsigned char *buf)
+{
+    unsigned char rec[HISTORY_RECORD_SIZE];
+    size_t len;
+
+    if (!h->packed || readRecord(h, incr, rec) != 0 ||
+        !(rec[REC_FLAGS] & HISTORY_FLAG_INLINE))
+        return -1;
+
+    len = rec[REC_INLINE_LEN];
+    if (len > HISTORY_INLINE_MAX)
+        len = HISTORY_INLINE_MAX;
+    memcpy(buf, rec + HISTORY_INLINE_OFFSET, len);
+    return len;
+}
+
+/* write an increment */
+int historyPut(History *h, unsigned long long incr, BackupMetadata *meta,
+    const unsigned char *content, size_t len)
+{
+    unsigned char rec[HISTORY_RECORD_SIZE];
+    long long now = nextTime(h, incr);
+
+    if (!h->packed) {
+        h->pseudo[2] = 'm';
+        sprintf(h->pseudoD, "/%llu.met", incr);
+        if (writeMetadata(meta, h->dirfd, h->pseudo) != 0)
+            return -1;
+
+        /* and index it */
+        putLE(rec, now, 8);
+        if (pwrite(h->fd, rec, 8, timeOffset(h, incr)) != 8)
+            return -1;
+        return 0;
+    }
+
+    memset(rec, 0, sizeof(rec));
+    encodeMetadata(meta, rec);
+    putLE(rec + REC_TIME, now, 8);
+    if (content) {
+        if (len > HISTORY_INLINE_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        rec[REC_FLAGS] = HISTORY_FLAG_INLINE;
+        rec[REC_INLINE_LEN] = len;
+        memcpy(rec + HISTORY_INLINE_OFFSET, content, len);
+    }
+
+    if (pwrite(h->fd, rec, sizeof(rec), incr * HISTORY_RECORD_SIZE) != sizeof(rec))
+        return -1;
+    return 0;
+}
+
+/* where an increment's time is */
+static off_t timeOffset(History *h, unsigned long long incr)
+{
+    if (h->packed)
+        return incr * HISTORY_RECORD_SIZE + REC_TIME;
+    return HISTORY_COUNTER_SIZE + (incr - 1) * 8;
+}
+
+/* read an increment's time from the index */
+static int readTime(History *h, unsigned long long incr, long long *time)
+{
+    unsigned char buf[8];
+
+    if (incr == 0 || pread(h->fd, buf, 8, timeOffset(h, incr)) != 8)
+        return -1;
+    *time = getLE(buf, 8);
+
+    /* a zero time is a purged record, or one from before the index */
+    return *time ? 0 : -1;
+}
+
+/* the time to give a new increment */
+static long long nextTime(History *h, unsigned long long incr)
+{
+    unsigned char buf[8];
+    unsigned long long ii;
+    long long now = time(NULL), last = 0, t;
+    struct stat sbuf;
+
+    if (incr > 1 && readTime(h, incr - 1, &last) != 0 && !h->packed) {
+        /* An increment file from before the index. Index what it has, by
+         * when it was written; whatever's purged stays zero. */
+        for (ii = 1; ii < incr; ii++) {
+            if (readTime(h, ii, &t) == 0) {
+                if (t > last) last = t;
+                continue;
+            }
+            h->pseudo[2] = 'm';
+            sprintf(h->pseudoD, "/%llu.met", ii);
+            if (fstatat(h->dirfd, h->pseudo, &sbuf, 0) != 0) continue;
+            if (sbuf.st_mtime > last) last = sbuf.st_mtime;
+            putLE(buf, last, 8);
+            if (pwrite(h->fd, buf, 8, timeOffset(h, ii)) != 8) break;
+        }
+    }
+
+    /* times only go up, even if the clock doesn't */
+    return (now > last) ? now : last;
+}
+
+/* find the increment current at a time */
+unsigned long long historyFind(History *h, long long time)
+{
+    struct stat sbuf;
+    unsigned char *map;
+    unsigned long long incr, indexed, lo, hi, mid;
+    long long t;
+
+    if (h->cur == 0 || fstat(h->fd, &sbuf) != 0)
+        return 0;
+
+    /* how many increments are indexed */
+    if (h->packed && sbuf.st_size >= HISTORY_RECORD_SIZE)
+        indexed = sbuf.st_size / HISTORY_RECORD_SIZE - 1;
+    else if (!h->packed && sbuf.st_size > HISTORY_COUNTER_SIZE)
+        indexed = (sbuf.st_size - HISTORY_COUNTER_SIZE) / 8;
+    else
+        indexed = 0;
+    if (indexed > h->cur) indexed = h->cur;
+
+    /* anything newer is from before the index, so search it the slow way */
+    for (incr = h->cur; incr > indexed; incr--)
+        if (historyGet(h, incr, NULL, &t) == 0 && t <= time)
+            return incr;
+    if (indexed == 0)
+        return 0;
+
+    map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (map == MAP_FAILED) {
+        for (incr = indexed; incr > 0; incr--)
+            if (historyGet(h, incr, NULL, &t) == 0 && t <= time)
+                return incr;
+        return 0;
+    }
+
+    /* times only go up, so look for the first that's too new */
+    lo = 1;
+    hi = indexed + 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        t = getLE(map + timeOffset(h, mid), 8);
+        if (t <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    munmap(map, sbuf.st_size);
+
+    /* the one before it is current, unless it's purged, as is everything
+     * before it */
+    incr = lo - 1;
+    if (incr && historyGet(h, incr, NULL, NULL) != 0)
+        incr = 0;
+    return incr;
+}
+
+/* make an increment current */
+int historySetCurrent(History *h, unsigned long long incr)
+{
+    unsigned char header[HISTORY_HEADER_SIZE];
+    char incrBuf[4*sizeof(unsigned long long)+1];
+    ssize_t len;
+
+    if (h->packed) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, HISTORY_MAGIC, 3);
+        header[3] = HISTORY_VERSION;
+        putLE(header + 8, incr, 8);
+        if (pwrite(h->fd, header, sizeof(header), 0) != sizeof(header))
+            return -1;
+
+    } else {
+        /* increments only grow, so this overwrites every digit */
+        len = sprintf(incrBuf, "%llu", incr);
+        if (pwrite(h->fd, incrBuf, len, 0) != len)
+            return -1;
+
+    }
+
+    h->cur = incr;
+    return 0;
+}
+
+/* sort increments (for historyEach) */
+static int cmpIncr(const void *l, const void *r)
+{
+    unsigned long long a = *(const unsigned long long *) l,
+                       b = *(const unsigned long long *) r;
+    return (a > b) - (a < b);
+}
+
+/* each increment that's still there */
+int historyEach(History *h, unsigned long long upTo, HistoryEachCallback cb, void *arg)
+{
+    unsigned char *buf;
+    unsigned long long *incrs = NULL, *nincrs, incr, first;
+    size_t count = 0, i;
+    ssize_t rd, n;
+    struct dirent *de;
+    char *end;
+    DIR *dh;
+    int dfd, ret = 0;
+
+    if (h->packed) {
+        /* read the records a block at a time */
+#define EACH_RECORDS 512
+        buf = malloc(EACH_RECORDS * HISTORY_RECORD_SIZE);
+        if (buf == NULL) return -1;
+        for (first = 1; first <= upTo && !ret; first += EACH_RECORDS) {
+            rd = pread(h->fd, buf, EACH_RECORDS * HISTORY_RECORD_SIZE, first * HISTORY_RECORD_SIZE);
+            if (rd < 0) {
+                ret = -1;
+                break;
+            }
+            for (n = 0; (n + 1) * HISTORY_RECORD_SIZE <= rd && first + n <= upTo; n++) {
+                if (memcmp(buf + n * HISTORY_RECORD_SIZE, MD_MAGIC, 3)) continue;
+                if ((ret = cb(h, first + n, arg))) break;
+            }
+            if (rd < EACH_RECORDS * HISTORY_RECORD_SIZE) break;
+        }
+#undef EACH_RECORDS
+        free(buf);
+        return ret;
+    }
+
+    /* in the original layout, each is a file in nim<name>/ */
+    h->pseudo[2] = 'm';
+    *h->pseudoD = 0;
+    dfd = openat(h->dirfd, h->pseudo, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) return (errno == ENOENT) ? 0 : -1;
+    dh = fdopendir(dfd);
+    if (dh == NULL) {
+        close(dfd);
+        return -1;
+    }
+    while ((de = readdir(dh))) {
+        incr = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".met") || incr == 0 || incr > upTo)
+            continue;
+        if (count % 64 == 0) {
+            nincrs = realloc(incrs, (count + 64) * sizeof(unsigned long long));
+            if (nincrs == NULL) {
+                ret = -1;
+                break;
+            }
+            incrs = nincrs;
+        }
+        incrs[count++] = incr;
+    }
+    closedir(dh);
+
+    if (count) qsort(incrs, count, sizeof(unsigned long long), cmpIncr);
+    for (i = 0; i < count && !ret; i++)
+        ret = cb(h, incrs[i], arg);
+    free(incrs);
+    return ret;
+}
+
+/* forget an increment */
+int historyDrop(History *h, unsigned long long incr)
+{
+    unsigned char rec[HISTORY_RECORD_SIZE];
+
+    if (!h->packed) {
+        h->pseudo[2] = 'm';
+        sprintf(h->pseudoD, "/%llu.met", incr);
+        return unlinkat(h->dirfd, h->pseudo, 0);
+    }
+
+    memset(rec, 0, sizeof(rec));
+    if (pwrite(h->fd, rec, sizeof(rec), incr * HISTORY_RECORD_SIZE) != sizeof(rec))
+        return -1;
+    return 0;
+}
+
+/* remove a history if it's empty */
+int historyRemove(History *h)
+{
+    /* the original layout is empty when its metadata directory is */
+    const char *pseudos = h->packed ? "cd" : "cmd";
+    int i;
+
+    /* increments are dropped oldest first, so if the current one is gone,
+     * they all are */
+    if (h->packed && historyGet(h, h->cur, NULL, NULL) == 0)
+        return -1;
+
+    *h->pseudoD = 0;
+    for (i = 0; pseudos[i]; i++) {
+        h->pseudo[2] = pseudos[i];
+        if (unlinkat(h->dirfd, h->pseudo, AT_REMOVEDIR) != 0 && errno != ENOENT)
+            return -1;
+    }
+
+    h->pseudo[2] = h->packed ? 'h' : 'i';
+    return unlinkat(h->dirfd, h->pseudo, 0);
+}
+
+/* unlock and close a history */
+void historyClose(History *h)
+{
+    if (h->fd >= 0) close(h->fd);
+    h->fd = -1;
+    free(h->pseudo);
+    h->pseudo = NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <sys/types.h>
+
+#include "metadata.h"
+
+/* A path's history is either the original layout, an increment file
+ * (nii<name>) with one metadata file per increment in nim<name>/, or a single
+ * packed history file, nih<name>. Either way, its content is in nic<name>/
+ * and, if it's a directory, its children are in nid<name>/.
+ *
+ * The packed file is an array of HISTORY_RECORD_SIZE records, so increment n
+ * is at n * HISTORY_RECORD_SIZE. Record 0 is the header: "NiH", a version
+ * byte, four bytes of padding, then the current increment as 64-bit. Each
+ * increment's record is its serialized metadata, then the time it was backed
+ * up as 64-bit, a flags byte and the length of its inline content, padding
+ * to HISTORY_INLINE_OFFSET, then the inline content itself. Purged and
+ * unfinished records are zero.
+ *
+ * In the original layout, the increment file starts with the current
+ * increment in ASCII, padded to HISTORY_COUNTER_SIZE, then indexes the time
+ * each increment was backed up: increment n's is a 64-bit at
+ * HISTORY_COUNTER_SIZE + (n-1)*8. Times only go up, so either layout can be
+ * searched by time. Older increment files have no index, and are indexed by
+ * their metadata files' mtimes when next written. */
+#define HISTORY_MAGIC           "NiH"
+#define HISTORY_VERSION         1
+#define HISTORY_RECORD_SIZE     128
+#define HISTORY_INLINE_OFFSET   64
+#define HISTORY_INLINE_MAX      (HISTORY_RECORD_SIZE - HISTORY_INLINE_OFFSET)
+#define HISTORY_COUNTER_SIZE    32
+
+/* record flags */
+#define HISTORY_FLAG_INLINE     1 /* content is in the record, not nic<name>/ */
+
+/* a backup stores new paths packed if it has this in its root */
+#define HISTORY_PACKED_NAME     "packed"
+
+/* ways to open a history */
+#define HISTORY_OPEN            0 /* only if it exists */
+#define HISTORY_CREATE          1 /* create it in the original layout */
+#define HISTORY_CREATE_PACKED   2 /* create it packed */
+
+/* an open (and locked) history */
+struct History_ {
+    int dirfd; /* the backup directory it's in */
+    int fd; /* nii<name> or nih<name> */
+    int packed;
+    char *pseudo, *pseudoD; /* ni?<name>, and where to put /<n>.<ext> */
+    unsigned long long cur; /* the current increment */
+};
+typedef struct History_ History;
+
+/* does this directory entry name a history? */
+int historyEntry(const char *dname);
+
+/* should new paths in this backup be packed? Marks it so if create is set.
+ * Returns -1 on error. */
+int historyPackedStore(int destFd, int create);
+
+/* Open and lock (with flock's lock, which may include LOCK_NB) the history of
+ * name in dirfd. Returns -1 (ENOENT) if it has none and how is HISTORY_OPEN. */
+int historyOpen(History *h, int dirfd, const char *name, int lock, int how);
+
+/* Get an increment's metadata and the time it was backed up, either of which
+ * may be NULL. Returns -1 (ENOENT) if it was purged or never finished. */
+int historyGet(History *h, unsigned long long incr, BackupMetadata *meta, long long *time);
+
+/* Find the latest increment backed up at or before time, by binary search of
+ * the index. Returns 0 if there is none, or it's been purged. */
+unsigned long long historyFind(History *h, long long time);
+
+/* Get an increment's inline content, into a HISTORY_INLINE_MAX buffer.
+ * Returns its length, or -1 if its content isn't inline. */
+ssize_t historyInline(History *h, unsigned long long incr, unsigned char *buf);
+
+/* Write an increment, with inline content if content isn't NULL (packed
+ * only). It isn't current until historySetCurrent. */
+int historyPut(History *h, unsigned long long incr, BackupMetadata *meta,
+    const unsigned char *content, size_t len);
+
+/* make an increment current */
+int historySetCurrent(History *h, unsigned long long incr);
+
+/* Call cb with each increment up to upTo that's still there, oldest first,
+ * until it returns nonzero. Gaps (from purges) cost nothing to skip. */
+typedef int (*HistoryEachCallback)(History *h, unsigned long long incr, void *arg);
+int historyEach(History *h, unsigned long long upTo, HistoryEachCallback cb, void *arg);
+
+/* forget an increment's metadata (but not its content in nic<name>/) */
+int historyDrop(History *h, unsigned long long incr);
+
+/* If every increment has been dropped, remove the history and its (empty)
+ * directories. Must be locked exclusively. */
+int historyRemove(History *h);
+
+/* unlock and close a history */
+void historyClose(History *h);
+
+#endif
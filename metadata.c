@@ -17,18 +17,41 @@
  */
 
 #define _XOPEN_SOURCE 700
-#define _GNU_SOURCE /* for SEEK_DATA|SEEK_HOLE */
+#define _GNU_SOURCE /* for SEEK_DATA|SEEK_HOLE and copy_file_range */
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "metadata.h"
+#include "uring.h"
+
+/* writeSparse leaves holes for zero blocks this big */
+#define SPARSE_BLOCK_SIZE 4096
+
+/* copySparse copies through a buffer this big if it can't do it in the kernel */
+#define COPY_BUFFER_SIZE (1024*1024)
+
+/* copy one extent of a file, returning how much was copied */
+static off_t copyExtent(int ifd, int ofd, off_t off, off_t len, char **buf);
+
+/* the linkId of a file with other links */
+static unsigned int linkId(dev_t dev, ino_t ino)
+{
+    unsigned long long h = ((unsigned long long) dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+    unsigned int id;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    id = h ^ (h >> 32);
+    return (id == 0 || id == MD_LINK_UNKNOWN) ? 1 : id;
+}
 
 /* utility function to open a file and retrieve its metadata */
 int openMetadata(BackupMetadata *meta, int *fd, int dirfd, const char *name)
@@ -92,15 +115,98 @@ int openMetadata(BackupMetadata *meta, int *fd, int dirfd, const char *name)
     meta->size = lsbuf.st_size;
     meta->mtime = lsbuf.st_mtime;
     meta->ctime = lsbuf.st_ctime;
+    meta->linkId = (S_ISREG(lsbuf.st_mode) && lsbuf.st_nlink > 1) ?
+        linkId(lsbuf.st_dev, lsbuf.st_ino) : 0;
+
+    return 0;
+}
+
+/* decode the old text format: the fields in order, one per line */
+static int parseLegacyMetadata(BackupMetadata *meta, const char *buf, size_t len)
+{
+    long long vals[6];
+    const char *end = buf + len;
+    int i, neg;
+
+    if (len < 2 || buf[1] != '\n') return -1;
+    meta->type = buf[0];
+    buf += 2;
+
+    for (i = 0; i < 6; i++) {
+        neg = 0;
+        if (buf < end && *buf == '-') {
+            neg = 1;
+            buf++;
+        }
+        if (buf >= end || *buf < '0' || *buf > '9') return -1;
+        for (vals[i] = 0; buf < end && *buf >= '0' && *buf <= '9'; buf++)
+            vals[i] = vals[i] * 10 + (*buf - '0');
+        if (neg) vals[i] = -vals[i];
+        if (buf >= end || *buf != '\n') return -1;
+        buf++;
+    }
+
+    meta->mode = vals[0];
+    meta->uid = vals[1];
+    meta->gid = vals[2];
+    meta->size = vals[3];
+    meta->mtime = vals[4];
+    meta->ctime = vals[5];
+    meta->linkId = MD_LINK_UNKNOWN;
+    return 0;
+}
+
+/* little-endian fields */
+unsigned long long getLE(const unsigned char *buf, int bytes)
+{
+    unsigned long long ret = 0;
+    while (bytes--) ret = (ret << 8) | buf[bytes];
+    return ret;
+}
+
+void putLE(unsigned char *buf, unsigned long long val, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++, val >>= 8) buf[i] = val;
+}
+
+/* serialize metadata into a record */
+void encodeMetadata(BackupMetadata *meta, unsigned char *buf)
+{
+    memset(buf, 0, MD_RECORD_SIZE);
+    memcpy(buf, MD_MAGIC, 3);
+    buf[3] = MD_VERSION;
+    buf[4] = meta->type;
+    putLE(buf + 8, meta->mode, 4);
+    putLE(buf + 12, meta->uid, 4);
+    putLE(buf + 16, meta->gid, 4);
+    putLE(buf + 20, meta->linkId, 4);
+    putLE(buf + 24, meta->size, 8);
+    putLE(buf + 32, meta->mtime, 8);
+    putLE(buf + 40, meta->ctime, 8);
+}
 
+/* deserialize a record. Returns -1 if it isn't one. */
+int decodeMetadata(BackupMetadata *meta, const unsigned char *buf)
+{
+    if (memcmp(buf, MD_MAGIC, 3) || buf[3] < 1 || buf[3] > MD_VERSION) return -1;
+    meta->type = buf[4];
+    meta->mode = getLE(buf + 8, 4);
+    meta->uid = getLE(buf + 12, 4);
+    meta->gid = getLE(buf + 16, 4);
+    meta->size = getLE(buf + 24, 8);
+    meta->mtime = getLE(buf + 32, 8);
+    meta->ctime = getLE(buf + 40, 8);
+    meta->linkId = (buf[3] >= 2) ? getLE(buf + 20, 4) : MD_LINK_UNKNOWN;
     return 0;
 }
 
 /* utility function to read serialized metadata */
 int readMetadata(BackupMetadata *meta, int dirfd, const char *name, int failIfNotFound)
 {
+    unsigned char buf[MD_LEGACY_MAX];
+    ssize_t rd;
     int fd;
-    FILE *fh;
 
     fd = openat(dirfd, name, O_RDONLY);
     if (fd < 0) {
@@ -113,44 +219,38 @@ int readMetadata(BackupMetadata *meta, int dirfd, const char *name, int failIfNo
         }
         return -1;
     }
-    fh = fdopen(fd, "r");
-
-    /* backup metadata:
-    char type;
-    int mode;
-    int uid;
-    int gid;
-    long long size;
-    long long mtime;
-    long long ctime;
-    */
-    if (fscanf(fh, "%c\n%d\n%d\n%d\n%lld\n%lld\n%lld\n",
-            &meta->type, &meta->mode, &meta->uid, &meta->gid,
-            &meta->size, &meta->mtime, &meta->ctime) != 7) {
+
+    /* either format fits in one read */
+    rd = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+    if (rd < 0) return -1;
+
+    if (rd == MD_RECORD_SIZE && decodeMetadata(meta, buf) == 0)
+        return 0;
+
+    if (parseLegacyMetadata(meta, (char *) buf, rd) != 0) {
         errno = EIO;
-        fclose(fh);
         return -1;
     }
-
-    fclose(fh);
     return 0;
 }
 
 /* utility function to write serialized metadata */
 int writeMetadata(BackupMetadata *meta, int dirfd, const char *name)
 {
+    unsigned char buf[MD_RECORD_SIZE];
     int fd;
-    FILE *fh;
+
+    encodeMetadata(meta, buf);
 
     fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if (fd < 0) return -1;
-    fh = fdopen(fd, "w");
-
-    fprintf(fh, "%c\n%d\n%d\n%d\n%lld\n%lld\n%lld\n",
-        meta->type, meta->mode, meta->uid, meta->gid,
-        meta->size, meta->mtime, meta->ctime);
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        close(fd);
+        return -1;
+    }
 
-    fclose(fh);
+    close(fd);
     return 0;
 }
 
@@ -169,30 +269,77 @@ int cmpMetadata(BackupMetadata *l, BackupMetadata *r)
     return 1;
 }
 
+/* copy one extent of a file */
+static off_t copyExtent(int ifd, int ofd, off_t off, off_t len, char **buf)
+{
+    loff_t inOff = off, outOff = off;
+    off_t done = 0;
+    ssize_t rd;
+    Uring *ring;
+
+    /* in the kernel if we can (which may even share the blocks) */
+    while (!*buf && done < len) {
+        rd = copy_file_range(ifd, &inOff, ofd, &outOff, len - done, 0);
+        if (rd < 0) {
+            if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                errno != EOPNOTSUPP)
+                return -1;
+
+            /* not between these files, so by hand */
+            *buf = malloc(COPY_BUFFER_SIZE);
+            if (*buf == NULL) return -1;
+            break;
+        }
+        if (rd == 0) return done; /* it shrank */
+        done += rd;
+    }
+
+    /* with several chunks in flight if we can, finishing off by hand */
+    if ((ring = uringGet())) {
+        rd = uringCopy(ring, ifd, ofd, off + done, len - done, *buf, COPY_BUFFER_SIZE);
+        if (rd > 0) done += rd;
+    }
+
+    while (done < len) {
+        rd = pread(ifd, *buf, (len - done > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : len - done,
+            off + done);
+        if (rd < 0) return -1;
+        if (rd == 0) break;
+        if (pwrite(ofd, *buf, rd, off + done) != rd) return -1;
+        done += rd;
+    }
+
+    return done;
+}
+
 /* utility function to copy a file sparsely */
 int copySparse(int ifd, int ddirfd, const char *dname)
 {
     char *buf = NULL;
-    size_t bufsz = 4096;
-    ssize_t rd;
-    off_t dataStart, dataEnd = 0, toRd;
+    off_t dataStart, dataEnd = 0, copied, size;
+    struct stat sbuf;
     int ofd = -1, ret = -1;
 
-    buf = malloc(bufsz);
-    if (buf == NULL) {
-        perror("malloc");
-        goto done;
-    }
-
     ofd = openat(ddirfd, dname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if (ofd < 0) {
         perror(dname);
         goto done;
     }
 
-    /* read a sparse chunk at a time */
+    /* on a copy-on-write filesystem, just share the blocks */
+    if (ioctl(ofd, FICLONE, ifd) == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    if (fstat(ifd, &sbuf) != 0) {
+        perror("fstat");
+        goto done;
+    }
+
+    /* otherwise copy a data extent at a time, leaving the holes */
+    size = sbuf.st_size;
     while (1) {
-        /* find the next data offset */
         dataStart = lseek(ifd, dataEnd, SEEK_DATA);
         if (dataStart < 0)
             break;
@@ -201,29 +348,25 @@ int copySparse(int ifd, int ddirfd, const char *dname)
             perror("lseek");
             goto done;
         }
-        if (lseek(ifd, dataStart, SEEK_SET) < 0) {
-            perror("lseek");
+
+        copied = copyExtent(ifd, ofd, dataStart, dataEnd - dataStart, &buf);
+        if (copied < 0) {
+            perror(dname);
             goto done;
         }
-        if (lseek(ofd, dataStart, SEEK_SET) < 0) {
-            perror("lseek");
-            goto done;
+        if (copied < dataEnd - dataStart) {
+            /* it shrank while we were copying it */
+            size = dataStart + copied;
+            break;
         }
+        if (dataEnd > size)
+            size = dataEnd;
+    }
 
-        /* read the right amount of data in */
-        toRd = dataEnd - dataStart;
-        while ((rd = read(ifd, buf, (toRd > bufsz ? bufsz : toRd))) >= 0) {
-            if (write(ofd, buf, rd) != rd) {
-                perror("write");
-                goto done;
-            }
-            toRd -= rd;
-            if (toRd == 0) break;
-        }
-        if (rd < 0) {
-            perror("read");
-            goto done;
-        }
+    /* and any hole at the end */
+    if (ftruncate(ofd, size) != 0) {
+        perror("ftruncate");
+        goto done;
     }
 
     ret = 0;
@@ -234,3 +377,39 @@ done:
     return ret;
 }
 
+/* utility function to write a buffer to a file, leaving holes where it's zero */
+int writeSparse(const unsigned char *buf, size_t len, int ddirfd, const char *dname)
+{
+    static const unsigned char zero[SPARSE_BLOCK_SIZE];
+    size_t off, blk;
+    int ofd, ret = -1;
+
+    ofd = openat(ddirfd, dname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (ofd < 0) {
+        perror(dname);
+        return -1;
+    }
+
+    for (off = 0; off < len; off += blk) {
+        blk = len - off;
+        if (blk > SPARSE_BLOCK_SIZE) blk = SPARSE_BLOCK_SIZE;
+        if (!memcmp(buf + off, zero, blk))
+            continue;
+        if (pwrite(ofd, buf + off, blk, off) != (ssize_t) blk) {
+            perror("write");
+            goto done;
+        }
+    }
+
+    /* make sure any trailing hole is there too */
+    if (ftruncate(ofd, len) != 0) {
+        perror("ftruncate");
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    close(ofd);
+    return ret;
+}
@@ -17,6 +17,8 @@
 #ifndef METADATA_H
 #define METADATA_H
 
+#include <stddef.h>
+
 /* backup metadata */
 struct BackupMetadata_ {
     char type;
@@ -26,6 +28,7 @@ struct BackupMetadata_ {
     long long size;
     long long mtime;
     long long ctime;
+    unsigned int linkId;
 };
 typedef struct BackupMetadata_ BackupMetadata;
 
@@ -37,6 +40,21 @@ typedef struct BackupMetadata_ BackupMetadata;
 #define MD_TYPE_FIFO           'p'
 #define MD_TYPE_OTHER          'x'
 
+/* A file with other links has a linkId, a hash of its identity that its
+ * links share. Files without have 0, and metadata from before linkIds has
+ * MD_LINK_UNKNOWN. */
+#define MD_LINK_UNKNOWN        0xFFFFFFFFU
+
+/* Serialized metadata is a fixed-size record: "NiM", a version byte, the type
+ * byte, three bytes of padding, then mode, uid, gid and linkId as 32-bit and
+ * size, mtime and ctime as 64-bit, all little-endian, each aligned. Version 1
+ * records have no linkId. Older backups have each field as a line of text,
+ * which is still read. */
+#define MD_MAGIC        "NiM"
+#define MD_VERSION      2
+#define MD_RECORD_SIZE  48
+#define MD_LEGACY_MAX   128
+
 /* open a file and retrieve its metadata */
 int openMetadata(BackupMetadata *meta, int *fd, int dirfd, const char *name);
 
@@ -46,10 +64,22 @@ int readMetadata(BackupMetadata *meta, int dirfd, const char *name, int failIfNo
 /* write serialized metadata */
 int writeMetadata(BackupMetadata *meta, int dirfd, const char *name);
 
+/* serialize metadata into an MD_RECORD_SIZE record, or back. decodeMetadata
+ * returns -1 if the buffer isn't a record. */
+void encodeMetadata(BackupMetadata *meta, unsigned char *buf);
+int decodeMetadata(BackupMetadata *meta, const unsigned char *buf);
+
+/* little-endian fields of serialized records */
+unsigned long long getLE(const unsigned char *buf, int bytes);
+void putLE(unsigned char *buf, unsigned long long val, int bytes);
+
 /* Compare metadata. Returns 0 if equal, 1 otherwise. */
 int cmpMetadata(BackupMetadata *l, BackupMetadata *r);
 
 /* utility function to copy a file sparsely */
 int copySparse(int ffd, int ddirfd, const char *dname);
 
+/* utility function to write a buffer to a file, leaving holes where it's zero */
+int writeSparse(const unsigned char *buf, size_t len, int ddirfd, const char *dname);
+
 #endif
@@ -17,8 +17,8 @@
  */
 
 #define _XOPEN_SOURCE 700 /* for realpath */
-#define _GNU_SOURCE /* for pthread_tryjoin_np */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -33,13 +33,13 @@
 
 #include "arg.h"
 #include "backup.h"
+#include "catalog.h"
+#include "chunk.h"
 #include "exclude.h"
+#include "history.h"
 #include "nibackup.h"
 #include "notify.h"
-
-#define VERBOSITY_FULL_SYNC 1
-#define VERBOSITY_INCREMENTAL 2
-#define VERBOSITY_FILE 3
+#include "uring.h"
 
 /* usage statement */
 static void usage(void);
@@ -54,6 +54,19 @@ static void *fullBackup(void *nivp);
 /* method to trigger a full update occasionally */
 static void *periodicFull(void *nivp);
 
+/* Rescans waiting for the rescan thread, which runs apart from the batches so
+ * they keep draining, and only one at a time, so these pile up meanwhile. */
+static pthread_mutex_t rescanLock = PTHREAD_MUTEX_INITIALIZER;
+static char **rescanPaths = NULL;
+static size_t rescanCount = 0, rescanSize = 0;
+static int rescanRunning = 0;
+
+/* hand a rescan to the rescan thread, starting it if it isn't running */
+static void rescan(NiBackup *ni, char *dir);
+
+/* background function for rescans */
+static void *rescanBackup(void *nivp);
+
 int main(int argc, char **argv)
 {
     ARG_VARS;
@@ -61,30 +74,43 @@ int main(int argc, char **argv)
     pthread_t cycleTh,
               fullTh;
     struct stat sbuf;
-    int i, tmpi;
+    int tmpi, useChunks = 0, usePacked = 0, useUring = 0;
     char *exclusionsFile = NULL;
 
     ni.source = NULL;
     ni.dest = NULL;
     ni.verbose = 0;
-    ni.waitAfterNotif = 10;
+    ni.waitAfterNotif = 2;
+    ni.maxWaitAfterNotif = 60;
     ni.fullSyncCycle = 21600;
     ni.noRootDotfiles = 0;
     ni.threads = 16;
     ni.maxInotifyWatches = 1024;
     ni.maxbsdiff = 33554432;
+    ni.maxdelta = 1073741824;
+    ni.queueBudget = 67108864;
 
     ni.fanotifFd = ni.inotifFd = -1;
+    ni.fanotifFid = 0;
+    ni.bpool = NULL;
+    ni.bscratch = NULL;
 
     ARG_NEXT();
     while (argType) {
         if (argType != ARG_VAL) {
             ARGV(., no-root-dotfiles, ni.noRootDotfiles)
+            ARGV(c, chunks, useChunks)
+            ARGV(P, packed, usePacked)
+            ARGV(U, io-uring, useUring)
             ARGNV(x, exclude-from, exclusionsFile)
             ARGN(w, notification-wait) {
                 ARG_GET();
                 ni.waitAfterNotif = atoi(arg);
 
+            } else ARGN(W, max-notification-wait) {
+                ARG_GET();
+                ni.maxWaitAfterNotif = atoi(arg);
+
             } else ARGN(F, full-sync-cycle) {
                 ARG_GET();
                 ni.fullSyncCycle = atoi(arg);
@@ -98,6 +124,19 @@ int main(int argc, char **argv)
                 ARG_GET();
                 ni.maxbsdiff = atoll(arg);
 
+            } else ARGLN(max-delta) {
+                ARG_GET();
+                ni.maxdelta = atoll(arg);
+
+            } else ARGN(M, queue-memory) {
+                ARG_GET();
+                ni.queueBudget = atoll(arg);
+
+            } else ARGN(I, inotify-watches) {
+                ARG_GET();
+                ni.maxInotifyWatches = atoi(arg);
+                if (ni.maxInotifyWatches <= 0) ni.maxInotifyWatches = 1;
+
             } else ARGN(v, verbose) {
                 ARG_GET();
                 ni.verbose = atoi(arg);
@@ -108,6 +147,9 @@ int main(int argc, char **argv)
                 arg = argv[++argi];
                 ni.inotifFd = atoi(arg);
 
+            } else if (ARGLC(fanotify-fid)) {
+                ni.fanotifFid = 1;
+
             } else {
                 usage();
                 return 1;
@@ -165,7 +207,7 @@ int main(int argc, char **argv)
         if (sbuf.st_uid == 0) {
             char **nargv;
             char fbuf[128], ibuf[128];
-            nargv = malloc((argc + 4) * sizeof(char *));
+            nargv = malloc((argc + 5) * sizeof(char *));
             if (!nargv) {
                 perror("malloc");
                 return 1;
@@ -176,6 +218,7 @@ int main(int argc, char **argv)
             nargv[argi++] = "--notification-fds";
             nargv[argi++] = fbuf;
             nargv[argi++] = ibuf;
+            if (ni.fanotifFid) nargv[argi++] = "--fanotify-fid";
             nargv[argi++] = NULL;
             execv("/proc/self/exe", nargv);
             perror("execv");
@@ -214,6 +257,28 @@ int main(int argc, char **argv)
         perror(ni.dest);
         return 1;
     }
+    ni.catalogFd = catalogOpen(ni.destFd);
+    if (ni.catalogFd < 0) {
+        perror(CATALOG_NAME);
+        return 1;
+    }
+
+    /* once a backup has a chunk store, keep using it */
+    ni.chunkFd = chunkStoreOpen(ni.destFd, useChunks);
+    if (ni.chunkFd < 0 && (useChunks || errno != ENOENT)) {
+        perror(CHUNK_DIR_NAME);
+        return 1;
+    }
+
+    /* and likewise packed histories */
+    ni.packed = historyPackedStore(ni.destFd, usePacked);
+    if (ni.packed < 0) {
+        perror(HISTORY_PACKED_NAME);
+        return 1;
+    }
+
+    /* each thread sets up its own ring when it first needs one */
+    if (useUring) uringEnable();
 
     /* load our exclusions */
     if (exclusionsFile) {
@@ -232,79 +297,75 @@ int main(int argc, char **argv)
 
     /* perform the initial backup */
     fprintf(stderr, "Starting initial sync.\n");
-    pthread_create(&fullTh, NULL, fullBackup, &ni);
+    queueFullSync(&ni.queue);
 
     /* and schedule full backups */
     pthread_create(&cycleTh, NULL, periodicFull, &ni);
 
     /* make the threads for continuous backup */
     if (ni.threads > 1) {
-        if (sem_init(&ni.bsem, 0, 0) < 0) {
-            perror("sem_init");
-            return 1;
-        }
-        for (i = 0; i < ni.threads; i++) {
-            sem_post(&ni.bsem);
-        }
-        ni.blocks = malloc(ni.threads * sizeof(pthread_mutex_t));
-        if (ni.blocks == NULL) {
-            perror("malloc");
-            return 1;
-        }
-        ni.bth = malloc(ni.threads * sizeof(pthread_t));
-        if (ni.bth == NULL) {
-            perror("malloc");
+        if (backupThreads(&ni) != 0) {
+            perror("backupThreads");
             return 1;
         }
-        ni.brunning = malloc(ni.threads * sizeof(int));
-        if (ni.brunning == NULL) {
-            perror("malloc");
-            return 1;
-        }
-        for (i = 0; i < ni.threads; i++) {
-            if (pthread_mutex_init(&ni.blocks[i], NULL) < 0) {
-                perror("pthraed_mutex_init");
-                return 1;
-            }
-            ni.brunning[i] = 0;
-        }
     }
 
     /* then continuous backup */
     fprintf(stderr, "Entering continuous mode.\n");
-    while (sem_wait(&ni.qsem) == 0) {
-        NotifyQueue *ev, *evn;
+    while (1) {
+        QueueEntry *ev, *evn;
+        char **paths;
+        size_t count, rescans, i;
+        int fullSync;
         time_t iStart, iEnd;
 
-        /* wait for 10 seconds of messages */
-        sleep(ni.waitAfterNotif);
-        if (ni.verbose >= VERBOSITY_INCREMENTAL) fprintf(stderr, "Incremental backup.\n");
+        /* wait for paths to settle down */
+        queueWait(&ni.queue);
+
+        /* pull off the ones that have */
+        ev = queueDrain(&ni.queue, &fullSync);
 
-        /* pull off current messages */
-        pthread_mutex_lock(&ni.qlock);
-        ev = ni.notifs;
-        ni.notifs = NULL;
-        pthread_mutex_unlock(&ni.qlock);
+        if (fullSync) {
+            if (ni.verbose >= VERBOSITY_FULL_SYNC) fprintf(stderr, "Starting full sync.\n");
+            if (pthread_create(&fullTh, NULL, fullBackup, &ni) == 0)
+                pthread_detach(fullTh);
+            else
+                queueFullSyncDone(&ni.queue);
+        }
+
+        /* remember where the events are, in case we're restarted */
+        notifySaveHeat(&ni);
+
+        if (!ev) continue;
 
         /* then back them up */
-        if (ni.verbose >= VERBOSITY_INCREMENTAL) iStart = time(NULL);
-        while (ev) {
-            if (ev->file) {
-                if (ni.verbose >= VERBOSITY_FILE) fprintf(stderr, "%s\n", ev->file);
-                backupContaining(&ni, ev->file);
-                free(ev->file);
-            } else {
-                if (pthread_tryjoin_np(fullTh, NULL) == 0) {
-                    if (ni.verbose >= VERBOSITY_FULL_SYNC) fprintf(stderr, "Starting full sync.\n");
-                    pthread_create(&fullTh, NULL, fullBackup, &ni);
-                }
-            }
+        if (ni.verbose >= VERBOSITY_INCREMENTAL) {
+            fprintf(stderr, "Incremental backup.\n");
+            iStart = time(NULL);
+        }
+        for (count = 0, evn = ev; evn; evn = evn->next) count++;
+        paths = malloc(count * sizeof(char *));
+        if (paths == NULL) {
+            perror("malloc");
+            return 1;
+        }
 
+        /* paths from the front, directories to rescan from the back */
+        for (i = 0, rescans = count; ev;) {
+            if (ni.verbose >= VERBOSITY_FILE)
+                fprintf(stderr, "%s%s\n", ev->file, ev->rescan ? "/ (rescan)" : "");
+            if (ev->rescan)
+                paths[--rescans] = ev->file;
+            else
+                paths[i++] = ev->file;
             evn = ev->next;
             free(ev);
             ev = evn;
-            if (ev) sem_wait(&ni.qsem);
         }
+        backupBatch(&ni, paths, rescans);
+        for (i = 0; i < rescans; i++) free(paths[i]);
+        for (i = rescans; i < count; i++) rescan(&ni, paths[i]);
+        free(paths);
 
         if (ni.verbose >= VERBOSITY_INCREMENTAL) {
             iEnd = time(NULL);
@@ -314,7 +375,6 @@ int main(int argc, char **argv)
     }
 
     pthread_join(cycleTh, NULL);
-    pthread_join(fullTh, NULL);
 
     return 0;
 }
@@ -325,17 +385,40 @@ static void usage()
     fprintf(stderr, "Use: nibackup [options] <source> <target>\n"
                     "Options:\n"
                     "  -w|--notification-wait <time>:\n"
-                    "      Wait <time> seconds after notifications arrive before syncing.\n"
+                    "      Back up a path once it has had no notifications for <time>\n"
+                    "      seconds (default 2).\n"
+                    "  -W|--max-notification-wait <time>:\n"
+                    "      But back it up no later than <time> seconds after its first\n"
+                    "      notification, even if it's still changing (default 60).\n"
                     "  -F|--full-sync-cycle <time>:\n"
                     "      Perform a full sync every <time> seconds.\n"
                     "  -x|--exclude-from <file>:\n"
                     "      Load exclusions (fully-anchored regexes) from <file>.\n"
                     "  -.|--no-root-dotfiles:\n"
                     "      Do not back up dotfiles in the root of <source> (useful for homedirs).\n"
+                    "  -c|--chunks:\n"
+                    "      Store files as content-defined chunks shared across the whole\n"
+                    "      backup, instead of as patches.\n"
+                    "  -P|--packed:\n"
+                    "      Keep each new path's history in a single packed file, with small\n"
+                    "      content inline, instead of a file per increment.\n"
+                    "  -U|--io-uring:\n"
+                    "      Batch full sync lookups and buffered copies through io_uring, if\n"
+                    "      the kernel allows it.\n"
                     "  -j|--threads <threads>:\n"
                     "      Use <threads> threads for backup.\n"
                     "  --max-bsdiff <bytes>:\n"
                     "      Use xdelta for all files large than <bytes> bytes.\n"
+                    "  --max-delta <bytes>:\n"
+                    "      Keep older content of files larger than <bytes> bytes whole\n"
+                    "      instead of patching it, as patches are made in memory\n"
+                    "      (default 1GiB, -1 for no limit).\n"
+                    "  -M|--queue-memory <bytes>:\n"
+                    "      When queued paths take more than <bytes> bytes, rescan their\n"
+                    "      directories instead (default 64MiB, 0 for no limit).\n"
+                    "  -I|--inotify-watches <count>:\n"
+                    "      Without fanotify directory entry events, watch up to <count>\n"
+                    "      directories with inotify (default 1024).\n"
                     "  -v|--verbose <level>:\n"
                     "      Set verbosity level to <level>.\n");
 }
@@ -449,32 +532,96 @@ static void *fullBackup(void *nivp)
         fEnd = time(NULL);
         fprintf(stderr, "Finished full sync in %d seconds.\n", (int) (fEnd - fStart));
     }
+    queueFullSyncDone(&ni->queue);
 
     return NULL;
 }
 
-/* method to trigger a full update occasionally */
-static void *periodicFull(void *nivp)
+/* hand a rescan to the rescan thread */
+static void rescan(NiBackup *ni, char *dir)
 {
-    NiBackup *ni = (NiBackup *) nivp;
+    pthread_t th;
+    char **paths;
+    size_t i;
+
+    /* all of it is a full sync, which has its own thread */
+    if (!strcmp(dir, ni->source)) {
+        free(dir);
+        queueFullSync(&ni->queue);
+        return;
+    }
 
-    while (1) {
-        NotifyQueue *ev;
+    pthread_mutex_lock(&rescanLock);
+    for (i = 0; i < rescanCount && strcmp(rescanPaths[i], dir); i++);
+    if (i < rescanCount) {
+        /* already waiting */
+        free(dir);
+        dir = NULL;
+
+    } else if (rescanCount < rescanSize ||
+               (paths = realloc(rescanPaths, (rescanSize * 2 + 8) * sizeof(char *)))) {
+        if (rescanCount == rescanSize) {
+            rescanPaths = paths;
+            rescanSize = rescanSize * 2 + 8;
+        }
+        rescanPaths[rescanCount++] = dir;
+        dir = NULL;
 
-        sleep(ni->fullSyncCycle);
+    }
+    if (!rescanRunning && rescanCount) {
+        rescanRunning = 1;
+        if (pthread_create(&th, NULL, rescanBackup, ni) == 0) {
+            pthread_detach(th);
+        } else {
+            /* no thread, so do them now */
+            pthread_mutex_unlock(&rescanLock);
+            rescanBackup(ni);
+            pthread_mutex_lock(&rescanLock);
+        }
+    }
+    pthread_mutex_unlock(&rescanLock);
+
+    if (dir) {
+        /* nowhere to put it, so do it now */
+        backupSubtrees(ni, &dir, 1);
+        free(dir);
+    }
+}
 
-        ev = malloc(sizeof(NotifyQueue));
-        if (ev == NULL) continue;
-        ev->next = NULL;
-        ev->file = NULL;
+/* background function for rescans */
+static void *rescanBackup(void *nivp)
+{
+    NiBackup *ni = (NiBackup *) nivp;
+    char **paths;
+    size_t count, i;
+
+    while (1) {
+        /* take everything that's waiting */
+        pthread_mutex_lock(&rescanLock);
+        paths = rescanPaths;
+        count = rescanCount;
+        rescanPaths = NULL;
+        rescanCount = rescanSize = 0;
+        if (!count) rescanRunning = 0;
+        pthread_mutex_unlock(&rescanLock);
+        if (!count) break;
+
+        backupSubtrees(ni, paths, count);
+        for (i = 0; i < count; i++) free(paths[i]);
+        free(paths);
+    }
 
-        pthread_mutex_lock(&ni->qlock);
+    return NULL;
+}
 
-        ev->next = ni->notifs;
-        ni->notifs = ev;
+/* method to trigger a full update occasionally */
+static void *periodicFull(void *nivp)
+{
+    NiBackup *ni = (NiBackup *) nivp;
 
-        pthread_mutex_unlock(&ni->qlock);
-        sem_post(&ni->qsem);
+    while (1) {
+        sleep(ni->fullSyncCycle);
+        queueFullSync(&ni->queue);
     }
 
     return NULL;
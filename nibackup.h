@@ -18,9 +18,13 @@
 #define NIBACKUP_H
 
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "notify.h"
+#include "queue.h"
+
+#define VERBOSITY_FULL_SYNC 1
+#define VERBOSITY_INCREMENTAL 2
+#define VERBOSITY_FILE 3
 
 struct NiBackup_ {
     size_t sourceLen;
@@ -31,27 +35,35 @@ struct NiBackup_ {
     const char *dest;
     int destFd;
 
+    /* log of increments */
+    int catalogFd;
+
+    /* content-defined chunk store, or -1 to store whole files */
+    int chunkFd;
+
+    /* new paths get a packed history file (see history.h) */
+    int packed;
+
     /* configuration */
     int verbose;
-    int waitAfterNotif;
+    int waitAfterNotif, maxWaitAfterNotif;
     int fullSyncCycle;
     int noRootDotfiles;
     int threads;
     int maxInotifyWatches;
     long long maxbsdiff;
+    long long maxdelta; /* bytes above which old content isn't patched */
+    size_t queueBudget; /* bytes of queued paths before they collapse */
 
     /* notification thread info */
     pthread_t fanotifTh, inotifTh;
-    pthread_mutex_t qlock;
-    sem_t qsem;
-    NotifyQueue *notifs;
+    NotifyQueue queue;
     int fanotifFd, inotifFd;
+    int fanotifFid; /* fanotify reports directory entries, so no inotify */
 
     /* threads for actual backup */
-    sem_t bsem;
-    pthread_mutex_t *blocks;
-    pthread_t *bth;
-    int *brunning;
+    struct Pool_ *bpool;
+    struct BackupScratch_ *bscratch; /* one per thread */
 
     /* exclusions */
     struct Exclusion_ *exclusions;
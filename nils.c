@@ -19,6 +19,7 @@
 #define _XOPEN_SOURCE 700
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +33,8 @@
 
 #include "arg.h"
 #include "buffer.h"
+#include "catalog.h"
+#include "history.h"
 #include "metadata.h"
 
 #define REP(into, func, bad, err, args) do { \
@@ -45,6 +48,8 @@ struct NiLsOpt_ {
     int history;    /* -H */
 
     long long newest; /* -t */
+    long long since; /* -C */
+    int changes;
 
     int dir;        /* -d */
     int llong;      /* -l */
@@ -71,6 +76,9 @@ static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName);
 /* print this metadata */
 static void lsMeta(BackupMetadata *meta);
 
+/* list changes recorded in the catalog */
+static void lsChanges(NiLsOpt *opt, int sourceDir, char *selection);
+
 /* strcmp for qsort */
 static int strppcmp(const void *l, const void *r);
 
@@ -94,7 +102,12 @@ int main(int argc, char **argv)
             ARGV(d, directory, opt.dir)
             ARGV(l, long, opt.llong)
             ARGV(R, recursive, opt.recursive)
-            ARGN(a, age) {
+            ARGN(C, changes) {
+                ARG_GET();
+                opt.since = atoll(arg);
+                opt.changes = 1;
+
+            } else ARGN(a, age) {
                 ARG_GET();
                 maxAge = atoll(arg);
                 setAge = 1;
@@ -157,7 +170,10 @@ int main(int argc, char **argv)
     direntLen = sizeof(struct dirent) + name_max + 1;
 
     /* select */
-    if (selection) {
+    if (opt.changes) {
+        lsChanges(&opt, sourceFd, selection);
+
+    } else if (selection) {
         lsSelected(&opt, sourceFd, selection);
     } else {
         struct Buffer_char fullName;
@@ -187,7 +203,10 @@ static void usage()
                     "  -l|--long:\n"
                     "      List in long format.\n"
                     "  -R|--recursive:\n"
-                    "      List subdirectories recursively.\n");
+                    "      List subdirectories recursively.\n"
+                    "  -C|--changes <time>:\n"
+                    "      List every increment written between time <time> and the listing\n"
+                    "      time, oldest first.\n");
 }
 
 /* select a given file or directory in the backup */
@@ -263,7 +282,7 @@ static void lsDir(NiLsOpt *opt, int sourceDir, struct Buffer_char *fullName)
 
         if (readdir_r(dh, de, &der) != 0) break;
         if (der == NULL) break;
-        if (strncmp(de->d_name, "nii", 3)) continue;
+        if (!historyEntry(de->d_name)) continue;
         SF(dname, strdup, NULL, (de->d_name + 3));
         WRITE_ONE_BUFFER(names, dname);
 
@@ -321,12 +340,11 @@ static void lsDir(NiLsOpt *opt, int sourceDir, struct Buffer_char *fullName)
 /* List a single file or directory. Returns 1 for directories. */
 static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName)
 {
-    char *pseudo, *pseudoD;
-    int ifd, tmpi;
-    char incrBuf[4*sizeof(unsigned long long)+1];
-    unsigned long long curIncr, oldIncr;
+    int tmpi;
+    unsigned long long oldIncr;
+    long long incrTime = 0, iiTime;
     BackupMetadata meta;
-    struct stat sbuf;
+    History hist;
     struct tm tmbuf;
     time_t tmt;
 
@@ -335,35 +353,19 @@ static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName)
 
     meta.type = MD_TYPE_NONEXIST;
 
-    /* make room for our pseudos: ni?<name>/<ull>.{old,new} */
-    SF(pseudo, malloc, NULL, (strlen(name) + (4*sizeof(unsigned long long)) + 9));
-    pseudoD = pseudo + strlen(name) + 3;
-    sprintf(pseudo, "nii%s", name);
-
-    /* open and lock the increment file */
-    SFE(ifd, openat, -1, name, (sourceDir, pseudo, O_RDONLY));
-    SFE(tmpi, flock, -1, pseudo, (ifd, LOCK_SH));
-
-    /* read in the current increment */
-    incrBuf[read(ifd, incrBuf, sizeof(incrBuf))] = 0;
-    curIncr = atoll(incrBuf);
-    if (curIncr == 0) goto done;
-
-    /* now find the acceptable increment */
-    pseudo[2] = 'm';
-    for (oldIncr = curIncr; oldIncr > 0; oldIncr--) {
-        sprintf(pseudoD, "/%llu.met", oldIncr);
-        if (fstatat(sourceDir, pseudo, &sbuf, 0) == 0) {
-            if (sbuf.st_mtime <= opt->newest)
-                break;
-        }
-    }
+    /* open and lock the history */
+    SFE(tmpi, historyOpen, -1, name, (&hist, sourceDir, name, LOCK_SH, HISTORY_OPEN));
+    if (hist.cur == 0) goto done;
 
-    /* maybe skip it */
+    /* now find the acceptable increment, or maybe skip it */
+    oldIncr = historyFind(&hist, opt->newest);
     if (oldIncr == 0) goto done;
 
     /* load in the metadata */
-    SFE(tmpi, readMetadata, -1, pseudo, (&meta, sourceDir, pseudo, 0));
+    if (historyGet(&hist, oldIncr, &meta, &incrTime) != 0 && errno != ENOENT) {
+        perror(name);
+        exit(1);
+    }
 
     /* skip it if it doesn't exist */
     if (meta.type == MD_TYPE_NONEXIST && !opt->history) goto done;
@@ -371,11 +373,11 @@ static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName)
     /* list out the metadata, possibly in long format */
     printf("%-*s ", (int) longestName, name);
     if (opt->history) {
-        tmt = sbuf.st_mtime;
+        tmt = incrTime;
         gmtime_r(&tmt, &tmbuf);
         tmstr[0] = '\0';
         strftime(tmstr, TMSZ, "%Y-%m-%dT%H:%M:%S", &tmbuf);
-        printf("%11llu %s %5llu ", (unsigned long long) sbuf.st_mtime, tmstr, oldIncr);
+        printf("%11llu %s %5llu ", (unsigned long long) incrTime, tmstr, oldIncr);
     }
     if (opt->llong)
         lsMeta(&meta);
@@ -384,14 +386,11 @@ static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName)
     if (opt->history) {
         /* list full history as well */
         unsigned long long ii;
-        for (ii = curIncr; ii > 0; ii--) {
+        for (ii = hist.cur; ii > 0; ii--) {
             if (ii == oldIncr) continue;
 
-            sprintf(pseudoD, "/%llu.met", ii);
-
-            if (fstatat(sourceDir, pseudo, &sbuf, 0) == 0 &&
-                readMetadata(&meta, sourceDir, pseudo, 0) == 0) {
-                printf("%*llu %5llu ", (int) longestName + 12, (unsigned long long) sbuf.st_mtime, ii);
+            if (historyGet(&hist, ii, &meta, &iiTime) == 0) {
+                printf("%*llu %5llu ", (int) longestName + 12, (unsigned long long) iiTime, ii);
                 if (opt->llong)
                     lsMeta(&meta);
                 putchar('\n');
@@ -401,8 +400,7 @@ static int ls(NiLsOpt *opt, int sourceDir, char *name, size_t longestName)
     }
 
 done:
-    close(ifd);
-    free(pseudo);
+    historyClose(&hist);
 
     return (meta.type == MD_TYPE_DIRECTORY);
 }
@@ -443,6 +441,43 @@ static void lsMeta(BackupMetadata *meta) {
     printf(" %5d:%-5d %12lld %lld", meta->uid, meta->gid, meta->size, meta->mtime);
 }
 
+/* print one catalog record */
+static int lsChange(CatalogRecord *rec, void *optvp)
+{
+    NiLsOpt *opt = (NiLsOpt *) optvp;
+    struct tm tmbuf;
+    time_t tmt;
+    char tmstr[TMSZ];
+
+    tmt = rec->time;
+    gmtime_r(&tmt, &tmbuf);
+    tmstr[0] = '\0';
+    strftime(tmstr, TMSZ, "%Y-%m-%dT%H:%M:%S", &tmbuf);
+    printf("%11lld %s %5llu %c", rec->time, tmstr, rec->incr,
+        (rec->type == MD_TYPE_FILE) ? '-' : rec->type);
+    if (opt->llong)
+        printf(" %12lld %c", rec->size, rec->codec);
+    printf(" %s\n", rec->path);
+
+    return 0;
+}
+
+/* list changes recorded in the catalog */
+static void lsChanges(NiLsOpt *opt, int sourceDir, char *selection)
+{
+    int tmpi;
+
+    /* the catalog doesn't store trailing slashes */
+    if (selection) {
+        size_t len = strlen(selection);
+        while (len > 0 && selection[len-1] == '/')
+            selection[--len] = 0;
+    }
+
+    SFE(tmpi, catalogScan, -1, CATALOG_NAME,
+        (sourceDir, 0, opt->since, opt->newest + 1, selection, lsChange, opt, NULL));
+}
+
 
 /* strcmp for qsort */
 static int strppcmp(const void *l, const void *r)
@@ -21,6 +21,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,7 +33,11 @@
 #include <unistd.h>
 
 #include "arg.h"
+#include "catalog.h"
+#include "chunk.h"
+#include "history.h"
 #include "metadata.h"
+#include "pool.h"
 
 #define SF(into, func, bad, err, args) do { \
     (into) = func args; \
@@ -41,27 +47,92 @@
     } \
 } while (0)
 
+/* an increment the catalog says was superseded before the purge time */
+struct Expired_ {
+    char *path;
+    unsigned long long incr;
+};
+typedef struct Expired_ Expired;
+
+struct ExpiredList_ {
+    size_t bufsz, bufused;
+    Expired *buf;
+};
+typedef struct ExpiredList_ ExpiredList;
+
+/* output, which is buffered per directory entry when purging in parallel */
+struct PurgeOut_ {
+    size_t bufsz, bufused;
+    char *buf;
+};
+typedef struct PurgeOut_ PurgeOut;
+
+struct PurgeEntry_ {
+    char *name;
+    PurgeOut out;
+};
+typedef struct PurgeEntry_ PurgeEntry;
+
+/* a directory being purged in parallel */
+struct PurgeTask_ {
+    struct PurgeTask_ *parent;
+    size_t parentEntry;
+    long long oldest;
+    int inDeadDir;
+    int dirfd;
+
+    /* pending is 1 for this directory itself, plus one per unfinished
+     * subdirectory task */
+    pthread_mutex_t lock;
+    int pending;
+
+    size_t entryCount;
+    PurgeEntry *entries;
+    PurgeOut out;
+};
+typedef struct PurgeTask_ PurgeTask;
+
+/* don't hold more directories open than this waiting for a thread */
+#define PURGE_MAX_QUEUED 256
+
+/* unreferenced chunks newer than this may be about to be used by a running
+ * backup, so are left alone */
+#define CHUNK_GC_GRACE (60*60)
+
 static size_t direntLen;
 
 /* FIXME: this should not be a global */
 static int dryRun = 0;
 static int verbose = 0;
+static Pool *pool = NULL;
 
 /* usage statement */
 static void usage(void);
 
 /* purge this directory */
-static void purgeDir(long long maxAge, int inDeadDir, int dirfd);
+static void purgeDir(long long maxAge, int inDeadDir, int dirfd, PurgeOut *out);
 
-/* purge this backup */
-static void purge(long long maxAge, int inDeadDir, int dirfd, char *name);
+/* purge this directory with a pool of threads */
+static void purgeParallel(long long oldest, int dirfd, int threads);
+
+/* purge only what the catalog says has expired */
+static void purgeIndexed(long long oldest, int dirfd);
+
+/* delete chunks that no chunk list refers to */
+static void purgeChunks(int dirfd, long long grace);
+
+/* Purge this backup. If expiredIncr is nonzero, purge up to that increment
+ * instead of searching by time. If task is set, subdirectories may be handed
+ * off to other threads. */
+static void purge(long long maxAge, int inDeadDir, int dirfd, char *name,
+    unsigned long long expiredIncr, PurgeOut *out, PurgeTask *task, size_t entry);
 
 int main(int argc, char **argv)
 {
     ARG_VARS;
     const char *backupDir = NULL;
     long long maxAge, oldest;
-    int setAge = 0, setTime = 0;
+    int setAge = 0, setTime = 0, useIndex = 0, gc = 0, threads = 1;
     int fd;
     long name_max;
 
@@ -69,6 +140,8 @@ int main(int argc, char **argv)
     while (argType) {
         if (argType != ARG_VAL) {
             ARGV(n, dry-run, dryRun)
+            ARGV(I, index, useIndex)
+            ARGV(G, gc, gc)
             ARGN(a, age) {
                 ARG_GET();
                 maxAge = atoll(arg);
@@ -87,6 +160,11 @@ int main(int argc, char **argv)
                     return 1;
                 }
 
+            } else ARGN(j, threads) {
+                ARG_GET();
+                threads = atoi(arg);
+                if (threads <= 0) threads = 1;
+
             } else ARGN(v, verbose) {
                 ARG_GET();
                 verbose = atoi(arg);
@@ -112,7 +190,7 @@ int main(int argc, char **argv)
         ARG_NEXT();
     }
 
-    if (!backupDir || setAge == setTime) {
+    if (!backupDir || (setAge && setTime) || (!setAge && !setTime && !gc)) {
         usage();
         return 1;
     }
@@ -130,7 +208,18 @@ int main(int argc, char **argv)
     direntLen = sizeof(struct dirent) + name_max + 1;
 
     /* and begin the purge */
-    purgeDir(oldest, 0, fd);
+    if (!setAge && !setTime)
+        ; /* only collecting chunks */
+    else if (useIndex)
+        purgeIndexed(oldest, fd);
+    else if (threads > 1)
+        purgeParallel(oldest, fd, threads);
+    else
+        purgeDir(oldest, 0, fd, NULL);
+
+    /* then any chunks that are no longer needed */
+    if (gc)
+        purgeChunks(fd, CHUNK_GC_GRACE);
 
     return 0;
 }
@@ -138,25 +227,75 @@ int main(int argc, char **argv)
 /* usage statement */
 void usage()
 {
-    fprintf(stderr, "Use: nibackup-purge [options] <-a age|-t time> <backup>\n"
+    fprintf(stderr, "Use: nibackup-purge [options] <-a age|-t time|-G> <backup>\n"
                     "Options:\n"
                     "  -a|--age <time>:\n"
                     "      Purge overridden data older than <time> seconds.\n"
                     "  -t|--time <time>:\n"
                     "      Purge overridden data changed before time <time>.\n"
+                    "  -G|--gc:\n"
+                    "      Delete chunks no longer referred to by any increment (after\n"
+                    "      purging, if -a or -t is also given).\n"
+                    "  -I|--index:\n"
+                    "      Only visit increments the catalog says were overridden since the\n"
+                    "      last indexed purge, instead of crawling the whole backup. These\n"
+                    "      expire by when they were overridden, not when they were written,\n"
+                    "      so each path keeps the increment current at the purge time.\n"
+                    "  -j|--threads <threads>:\n"
+                    "      Crawl the backup with <threads> threads.\n"
                     "  -n|--dry-run:\n"
                     "      Just say what would be purged, don't purge.\n"
                     "  -v|--verbose <verbosity>:\n"
                     "      Be more verbose.\n");
 }
 
-/* purge this directory */
-void purgeDir(long long oldest, int inDeadDir, int dirfd)
+/* append to output */
+static void outAppend(PurgeOut *out, const char *buf, size_t len)
+{
+    if (out->bufused + len > out->bufsz) {
+        out->bufsz = out->bufsz ? out->bufsz : 128;
+        while (out->bufused + len > out->bufsz) out->bufsz *= 2;
+        SF(out->buf, realloc, NULL, "realloc", (out->buf, out->bufsz));
+    }
+    memcpy(out->buf + out->bufused, buf, len);
+    out->bufused += len;
+}
+
+/* say something, to stderr or buffered */
+static void report(PurgeOut *out, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[1024];
+    int len;
+
+    va_start(ap, fmt);
+    if (out == NULL) {
+        vfprintf(stderr, fmt, ap);
+    } else {
+        len = vsnprintf(buf, sizeof(buf), fmt, ap);
+        if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+        if (len > 0) outAppend(out, buf, len);
+    }
+    va_end(ap);
+}
+
+/* strcmp for qsort */
+static int strppcmp(const void *l, const void *r)
+{
+    return strcmp(*((char **) l), *((char **) r));
+}
+
+/* get the names backed up in this directory, in sorted order so that output
+ * doesn't depend on readdir or on threads */
+static char **readEntries(int dirfd, size_t *count)
 {
     int hdirfd;
     DIR *dh;
     struct dirent *de, *der;
+    char **names = NULL;
+    size_t namesSz = 0;
 
+    *count = 0;
     SF(de, malloc, NULL, "malloc", (direntLen));
     SF(hdirfd, dup, -1, "dup", (dirfd));
     SF(dh, fdopendir, NULL, "fdopendir", (hdirfd));
@@ -165,41 +304,529 @@ void purgeDir(long long oldest, int inDeadDir, int dirfd)
         if (readdir_r(dh, de, &der) != 0) break;
         if (der == NULL) break;
 
-        /* looking for increment files */
-        if (strncmp(de->d_name, "nii", 3)) continue;
+        /* looking for histories */
+        if (!historyEntry(de->d_name)) continue;
 
-        /* purge this */
-        purge(oldest, inDeadDir, dirfd, de->d_name + 3);
+        if (*count == namesSz) {
+            namesSz = namesSz ? namesSz * 2 : 16;
+            SF(names, realloc, NULL, "realloc", (names, namesSz * sizeof(char *)));
+        }
+        SF(names[*count], strdup, NULL, "strdup", (de->d_name + 3));
+        (*count)++;
     }
 
     closedir(dh);
+    free(de);
+
+    if (*count)
+        qsort(names, *count, sizeof(char *), strppcmp);
+    return names;
+}
+
+/* purge this directory */
+void purgeDir(long long oldest, int inDeadDir, int dirfd, PurgeOut *out)
+{
+    char **names;
+    size_t count, i;
+
+    names = readEntries(dirfd, &count);
+    for (i = 0; i < count; i++) {
+        /* purge this */
+        purge(oldest, inDeadDir, dirfd, names[i], 0, out, NULL, 0);
+        free(names[i]);
+    }
+    free(names);
+}
+
+/* remove an entry, if it's completely purged. Its history must be locked
+ * exclusively. */
+static void purgeRemove(History *hist)
+{
+    if (dryRun) return;
+    historyRemove(hist);
+}
+
+/* Remove an entry after its subdirectory was purged by another thread. We
+ * didn't keep the history locked while waiting, so lock it again; if
+ * nibackup got to it in the meantime, it won't be empty. */
+static void purgeFinish(int dirfd, const char *name)
+{
+    History hist;
+
+    if (historyOpen(&hist, dirfd, name, LOCK_EX, HISTORY_OPEN) == 0) {
+        purgeRemove(&hist);
+        historyClose(&hist);
+    }
+}
+
+/* a directory task is done (or one of its children is), so see if the whole
+ * subtree is, and if so, hand its output and removal up to its parent */
+static void purgeTaskDone(PurgeTask *task)
+{
+    PurgeTask *parent;
+    PurgeEntry *pentry;
+    size_t i;
+    int done;
+
+    while (task) {
+        pthread_mutex_lock(&task->lock);
+        done = (--task->pending == 0);
+        pthread_mutex_unlock(&task->lock);
+        if (!done) return;
+
+        /* gather our output in order */
+        for (i = 0; i < task->entryCount; i++) {
+            outAppend(&task->out, task->entries[i].out.buf, task->entries[i].out.bufused);
+            free(task->entries[i].out.buf);
+            free(task->entries[i].name);
+        }
+        free(task->entries);
+        task->entries = NULL;
+
+        /* the root is collected by purgeParallel */
+        parent = task->parent;
+        if (!parent) return;
+
+        close(task->dirfd);
+        pentry = &parent->entries[task->parentEntry];
+        purgeFinish(parent->dirfd, pentry->name);
+
+        pthread_mutex_lock(&parent->lock);
+        outAppend(&pentry->out, task->out.buf, task->out.bufused);
+        pthread_mutex_unlock(&parent->lock);
+
+        free(task->out.buf);
+        pthread_mutex_destroy(&task->lock);
+        free(task);
+
+        task = parent;
+    }
+}
+
+/* purge a directory as a pool task */
+static void purgeDirTask(Pool *pool, int worker, void *tvp)
+{
+    PurgeTask *task = (PurgeTask *) tvp;
+    char **names;
+    size_t i;
+
+    /* purges share the pool through the global, and need no scratch */
+    (void) pool;
+    (void) worker;
+
+    names = readEntries(task->dirfd, &task->entryCount);
+    SF(task->entries, calloc, NULL, "calloc",
+        (task->entryCount ? task->entryCount : 1, sizeof(PurgeEntry)));
+    for (i = 0; i < task->entryCount; i++)
+        task->entries[i].name = names[i];
+    free(names);
+
+    for (i = 0; i < task->entryCount; i++)
+        purge(task->oldest, task->inDeadDir, task->dirfd, task->entries[i].name,
+            0, &task->entries[i].out, task, i);
+
+    purgeTaskDone(task);
+}
+
+/* make a directory task */
+static PurgeTask *newPurgeTask(PurgeTask *parent, size_t parentEntry,
+    long long oldest, int inDeadDir, int dirfd)
+{
+    PurgeTask *task;
+
+    SF(task, calloc, NULL, "calloc", (1, sizeof(PurgeTask)));
+    task->parent = parent;
+    task->parentEntry = parentEntry;
+    task->oldest = oldest;
+    task->inDeadDir = inDeadDir;
+    task->dirfd = dirfd;
+    pthread_mutex_init(&task->lock, NULL);
+    task->pending = 1;
+
+    return task;
+}
+
+/* hand a subdirectory off to the pool */
+static void purgeSpawn(PurgeTask *parent, size_t entry, int inDeadDir, int dirfd)
+{
+    PurgeTask *task = newPurgeTask(parent, entry, parent->oldest, inDeadDir, dirfd);
+
+    pthread_mutex_lock(&parent->lock);
+    parent->pending++;
+    pthread_mutex_unlock(&parent->lock);
+
+    if (poolSubmit(pool, purgeDirTask, task) != 0)
+        purgeDirTask(pool, -1, task);
+}
 
+/* purge this directory with a pool of threads */
+static void purgeParallel(long long oldest, int dirfd, int threads)
+{
+    PurgeTask *root;
+
+    SF(pool, poolCreate, NULL, "poolCreate", (threads));
+    root = newPurgeTask(NULL, 0, oldest, 0, dirfd);
+
+    if (poolSubmit(pool, purgeDirTask, root) != 0)
+        purgeDirTask(pool, -1, root);
+    poolWait(pool);
+    poolDestroy(pool);
+    pool = NULL;
+
+    if (root->out.bufused)
+        fwrite(root->out.buf, 1, root->out.bufused, stderr);
+    free(root->out.buf);
+    pthread_mutex_destroy(&root->lock);
+    free(root);
+}
+
+/* collect expired increments from the catalog */
+static int collectExpired(CatalogRecord *rec, void *elvp)
+{
+    ExpiredList *el = (ExpiredList *) elvp;
+    Expired *exp;
+
+    /* each increment supersedes the one before it */
+    if (rec->incr <= 1) return 0;
+
+    if (el->bufused == el->bufsz) {
+        el->bufsz = el->bufsz ? el->bufsz * 2 : 1024;
+        SF(el->buf, realloc, NULL, "realloc", (el->buf, el->bufsz * sizeof(Expired)));
+    }
+    exp = &el->buf[el->bufused++];
+    SF(exp->path, strdup, NULL, "strdup", (rec->path));
+    exp->incr = rec->incr - 1;
+
+    return 0;
+}
+
+/* sort expired increments by path, newest first */
+static int expiredCmp(const void *lvp, const void *rvp)
+{
+    const Expired *l = (const Expired *) lvp, *r = (const Expired *) rvp;
+    int cmp = strcmp(l->path, r->path);
+    if (cmp) return cmp;
+    if (l->incr > r->incr) return -1;
+    if (l->incr < r->incr) return 1;
+    return 0;
+}
+
+/* purge a single path named by the catalog */
+static void purgePath(long long oldest, int dirfd, char *path, unsigned long long incr)
+{
+    char *part, *nextPart, *saveptr, *pseudo;
+    int newDirfd;
+
+    SF(dirfd, dup, -1, "dup", (dirfd));
+    SF(pseudo, malloc, NULL, "malloc", (strlen(path) + 4));
+
+    /* find the containing directory, which may already be purged */
+    part = strtok_r(path, "/", &saveptr);
+    while (part && (nextPart = strtok_r(NULL, "/", &saveptr))) {
+        sprintf(pseudo, "nid%s", part);
+        newDirfd = openat(dirfd, pseudo, O_RDONLY);
+        close(dirfd);
+        if (newDirfd < 0) goto done;
+        dirfd = newDirfd;
+        part = nextPart;
+    }
+
+    if (part) {
+        sprintf(pseudo, "nih%s", part);
+        if (faccessat(dirfd, pseudo, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+            pseudo[2] = 'i';
+        if (faccessat(dirfd, pseudo, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+            purge(oldest, 0, dirfd, part, incr, NULL, NULL, 0);
+    }
+    close(dirfd);
+
+done:
+    free(pseudo);
+}
+
+/* purge only what the catalog says has expired */
+static void purgeIndexed(long long oldest, int dirfd)
+{
+    ExpiredList el;
+    char cursorBuf[4*sizeof(long long)+1];
+    long long cursor = 0, next;
+    ssize_t rd;
+    size_t i;
+    int cfd, tmpi;
+
+    /* the cursor says how far the last indexed purge got */
+    cfd = openat(dirfd, CATALOG_CURSOR_NAME, O_RDONLY);
+    if (cfd >= 0) {
+        SF(rd, read, -1, CATALOG_CURSOR_NAME, (cfd, cursorBuf, sizeof(cursorBuf) - 1));
+        cursorBuf[rd] = 0;
+        cursor = atoll(cursorBuf);
+        close(cfd);
+    }
+
+    /* Everything since then that was superseded before the purge time. The
+     * next purge starts from the first record that was too new, and anything
+     * after it that wasn't (if the clock went back) is just seen again. */
+    memset(&el, 0, sizeof(el));
+    SF(tmpi, catalogScan, -1, CATALOG_NAME,
+        (dirfd, cursor, 0, oldest, NULL, collectExpired, &el, &next));
+
+    /* only the newest expired increment of each path matters */
+    qsort(el.buf, el.bufused, sizeof(Expired), expiredCmp);
+    for (i = 0; i < el.bufused; i++) {
+        if (i == 0 || strcmp(el.buf[i].path, el.buf[i-1].path))
+            purgePath(oldest, dirfd, el.buf[i].path, el.buf[i].incr);
+    }
+    for (i = 0; i < el.bufused; i++)
+        free(el.buf[i].path);
+    free(el.buf);
+
+    /* and remember where to start next time */
+    if (!dryRun && next != cursor) {
+        int len = sprintf(cursorBuf, "%lld", next);
+        SF(cfd, openat, -1, CATALOG_CURSOR_NAME ".new",
+            (dirfd, CATALOG_CURSOR_NAME ".new", O_WRONLY | O_CREAT | O_TRUNC, 0600));
+        if (write(cfd, cursorBuf, len) != len) {
+            perror(CATALOG_CURSOR_NAME);
+            exit(1);
+        }
+        close(cfd);
+        SF(tmpi, renameat, -1, CATALOG_CURSOR_NAME,
+            (dirfd, CATALOG_CURSOR_NAME ".new", dirfd, CATALOG_CURSOR_NAME));
+    }
+}
+
+/* the set of chunks referenced by any chunk list, for the chunk GC */
+struct ChunkSet_ {
+    size_t size, used; /* size is a power of 2 */
+    unsigned char (*hashes)[SHA256_SIZE];
+    char *full;
+};
+typedef struct ChunkSet_ ChunkSet;
+
+/* find a hash's slot in the set */
+static size_t chunkSetSlot(ChunkSet *set, const unsigned char *hash)
+{
+    size_t i;
+    memcpy(&i, hash, sizeof(size_t));
+    for (i &= set->size - 1;
+         set->full[i] && memcmp(set->hashes[i], hash, SHA256_SIZE);
+         i = (i + 1) & (set->size - 1));
+    return i;
+}
+
+/* add a chunk to the set (chunkListRead callback) */
+static int chunkSetAdd(Chunk *chunk, void *setvp)
+{
+    ChunkSet *set = (ChunkSet *) setvp;
+    size_t i;
+
+    /* keep it at most half full */
+    if ((set->used + 1) * 2 > set->size) {
+        ChunkSet bigger;
+        bigger.size = set->size ? set->size * 2 : 1024;
+        bigger.used = set->used;
+        SF(bigger.hashes, malloc, NULL, "malloc", (bigger.size * SHA256_SIZE));
+        SF(bigger.full, calloc, NULL, "calloc", (bigger.size, 1));
+        for (i = 0; i < set->size; i++) {
+            if (set->full[i]) {
+                size_t j = chunkSetSlot(&bigger, set->hashes[i]);
+                memcpy(bigger.hashes[j], set->hashes[i], SHA256_SIZE);
+                bigger.full[j] = 1;
+            }
+        }
+        free(set->hashes);
+        free(set->full);
+        *set = bigger;
+    }
+
+    i = chunkSetSlot(set, chunk->hash);
+    if (!set->full[i]) {
+        memcpy(set->hashes[i], chunk->hash, SHA256_SIZE);
+        set->full[i] = 1;
+        set->used++;
+    }
+    return 0;
+}
+
+/* mark every chunk referenced from this directory of the backup */
+static void gcMarkDir(int dirfd, ChunkSet *set)
+{
+    char **names, *pseudo;
+    size_t count, i, len;
+    int sdirfd, hdirfd;
+    DIR *dh;
+    struct dirent *de, *der;
+
+    SF(de, malloc, NULL, "malloc", (direntLen));
+    names = readEntries(dirfd, &count);
+    for (i = 0; i < count; i++) {
+        SF(pseudo, malloc, NULL, "malloc", (strlen(names[i]) + 4));
+
+        /* chunk lists in the content directory */
+        sprintf(pseudo, "nic%s", names[i]);
+        sdirfd = openat(dirfd, pseudo, O_RDONLY | O_DIRECTORY);
+        if (sdirfd >= 0) {
+            SF(hdirfd, dup, -1, "dup", (sdirfd));
+            SF(dh, fdopendir, NULL, "fdopendir", (hdirfd));
+            while (readdir_r(dh, de, &der) == 0 && der) {
+                len = strlen(de->d_name);
+                if (len < 5 || strcmp(de->d_name + len - 4, "." CHUNK_LIST_EXT))
+                    continue;
+                if (chunkListRead(sdirfd, de->d_name, chunkSetAdd, set) != 0) {
+                    /* can't tell what this needs, so don't delete anything */
+                    fprintf(stderr, "%s/%s: unreadable chunk list, not collecting chunks\n",
+                        pseudo, de->d_name);
+                    exit(1);
+                }
+            }
+            closedir(dh);
+            close(sdirfd);
+        }
+
+        /* and subdirectories */
+        pseudo[2] = 'd';
+        sdirfd = openat(dirfd, pseudo, O_RDONLY | O_DIRECTORY);
+        if (sdirfd >= 0) {
+            gcMarkDir(sdirfd, set);
+            close(sdirfd);
+        }
+
+        free(pseudo);
+        free(names[i]);
+    }
+    free(names);
     free(de);
 }
 
-static const char pseudos[] = "cmd";
+/* delete chunks that no chunk list refers to */
+static void purgeChunks(int dirfd, long long grace)
+{
+    ChunkSet set;
+    unsigned char hash[SHA256_SIZE];
+    char sub[3], name[CHUNK_NAME_SIZE + 64];
+    long long cutoff = time(NULL) - grace;
+    unsigned long long swept = 0;
+    int storeFd, sfd, hdirfd, i, j;
+    size_t len;
+    DIR *dh;
+    struct dirent *de, *der;
+    struct stat sbuf;
+
+    storeFd = chunkStoreOpen(dirfd, 0);
+    if (storeFd < 0) return;
+
+    /* mark */
+    memset(&set, 0, sizeof(set));
+    gcMarkDir(dirfd, &set);
+
+    /* and sweep */
+    SF(de, malloc, NULL, "malloc", (direntLen));
+    for (i = 0; i < 256; i++) {
+        sprintf(sub, "%02x", i);
+        sfd = openat(storeFd, sub, O_RDONLY | O_DIRECTORY);
+        if (sfd < 0) continue;
+        SF(hdirfd, dup, -1, "dup", (sfd));
+        SF(dh, fdopendir, NULL, "fdopendir", (hdirfd));
+
+        while (readdir_r(dh, de, &der) == 0 && der) {
+            if (de->d_name[0] == '.') continue;
+            len = strlen(de->d_name);
+
+            /* only chunks and leftover temporaries, old enough that no backup
+             * could still be about to refer to them */
+            if (fstatat(sfd, de->d_name, &sbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !S_ISREG(sbuf.st_mode) || sbuf.st_mtime >= cutoff)
+                continue;
+            if (len == SHA256_SIZE*2 - 2) {
+                hash[0] = i;
+                for (j = 1; j < SHA256_SIZE; j++)
+                    if (sscanf(de->d_name + j*2 - 2, "%2hhx", &hash[j]) != 1) break;
+                if (j < SHA256_SIZE) continue;
+                if (set.size && set.full[chunkSetSlot(&set, hash)])
+                    continue;
+            } else if (len < 4 || strcmp(de->d_name + len - 4, ".tmp")) {
+                continue;
+            }
+
+            snprintf(name, sizeof(name), "%s/%s", sub, de->d_name);
+            if (dryRun || verbose)
+                fprintf(stderr, "Purge %s/%s\n", CHUNK_DIR_NAME, name);
+            if (!dryRun) unlinkat(storeFd, name, 0);
+            swept++;
+        }
+
+        closedir(dh);
+        close(sfd);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Chunks: %llu referenced, %llu purged\n",
+            (unsigned long long) set.used, swept);
+
+    free(de);
+    free(set.hashes);
+    free(set.full);
+    close(storeFd);
+}
+
+/* delete the content of every increment up to oldIncr in the content
+ * directory nic<name> */
+static void purgeContent(int dirfd, const char *nic, unsigned long long oldIncr)
+{
+    unsigned long long incr;
+    struct dirent *de, *der;
+    char *end;
+    DIR *dh;
+    int cfd;
+
+    cfd = openat(dirfd, nic, O_RDONLY | O_DIRECTORY);
+    if (cfd < 0) return;
+    dh = fdopendir(cfd);
+    if (dh == NULL) {
+        close(cfd);
+        return;
+    }
+    SF(de, malloc, NULL, "malloc", (direntLen));
+
+    while (readdir_r(dh, de, &der) == 0 && der) {
+        incr = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || incr == 0 || incr > oldIncr) continue;
+        if (strcmp(end, ".dat") && strcmp(end, ".bsp") && strcmp(end, ".x3p") &&
+            strcmp(end, "." CHUNK_LIST_EXT))
+            continue;
+        unlinkat(cfd, de->d_name, 0);
+    }
+
+    free(de);
+    closedir(dh);
+}
+
+/* drop an increment's metadata (historyEach callback) */
+static int dropIncrement(History *h, unsigned long long incr, void *arg)
+{
+    (void) arg;
+    historyDrop(h, incr);
+    return 0;
+}
 
 /* purge this backup */
-void purge(long long oldest, int inDeadDir, int dirfd, char *name)
+void purge(long long oldest, int inDeadDir, int dirfd, char *name,
+    unsigned long long expiredIncr, PurgeOut *out, PurgeTask *task, size_t entry)
 {
     char *pseudo, *pseudoD;
-    int i, ifd, dfd, tmpi;
-    char incrBuf[4*sizeof(unsigned long long)+1];
+    int dfd, tmpi;
     unsigned long long curIncr, oldIncr, ii;
     BackupMetadata curMeta;
+    History hist;
 
-    /* make room for our pseudos: ni?<name>/<ull>.{old,new} */
+    /* make room for our pseudos: ni?<name>/<ull>.<ext> */
     SF(pseudo, malloc, NULL, "malloc", (strlen(name) + (4*sizeof(unsigned long long)) + 9));
     pseudoD = pseudo + strlen(name) + 3;
-    sprintf(pseudo, "nii%s", name);
-
-    /* open and lock the increment file */
-    SF(ifd, openat, -1, pseudo, (dirfd, pseudo, O_RDONLY));
-    SF(tmpi, flock, -1, pseudo, (ifd, LOCK_EX));
+    sprintf(pseudo, "nic%s", name);
 
-    /* read in the current increment */
-    incrBuf[read(ifd, incrBuf, sizeof(incrBuf))] = 0;
-    curIncr = atoll(incrBuf);
+    /* open and lock the history */
+    SF(tmpi, historyOpen, -1, name, (&hist, dirfd, name, LOCK_EX, HISTORY_OPEN));
+    curIncr = hist.cur;
     if (curIncr == 0) {
         memset(&curMeta, 0, sizeof(BackupMetadata));
         curMeta.type = MD_TYPE_DIRECTORY; /* just in case */
@@ -207,9 +834,7 @@ void purge(long long oldest, int inDeadDir, int dirfd, char *name)
     }
 
     /* and the current metadata */
-    pseudo[2] = 'm';
-    sprintf(pseudoD, "/%llu.met", curIncr);
-    if (readMetadata(&curMeta, dirfd,  pseudo, 1) != 0) {
+    if (historyGet(&hist, curIncr, &curMeta, NULL) != 0) {
         if (errno == ENOENT)
             goto tryRemoveSubdirs;
         else
@@ -217,23 +842,23 @@ void purge(long long oldest, int inDeadDir, int dirfd, char *name)
     }
 
     /* now find the first dead increment */
-    for (oldIncr = curIncr - (inDeadDir ? 0 : 1); oldIncr > 0; oldIncr--) {
-        struct stat sbuf;
-        sprintf(pseudoD, "/%llu.met", oldIncr);
-        if (fstatat(dirfd, pseudo, &sbuf, 0) == 0) {
-            if (sbuf.st_mtime < oldest) {
-                /* this is old enough to purge */
-                break;
-            }
-        }
+    oldIncr = curIncr - (inDeadDir ? 0 : 1);
+    if (expiredIncr) {
+        /* the catalog already told us */
+        if (expiredIncr < oldIncr) oldIncr = expiredIncr;
+    } else {
+        /* the newest that's old enough to purge */
+        ii = historyFind(&hist, oldest - 1);
+        if (ii < oldIncr)
+            oldIncr = ii;
+        else if (oldIncr && historyGet(&hist, oldIncr, NULL, NULL) != 0)
+            oldIncr = 0; /* already purged */
     }
 
     /* we can also remove any following deletions */
     for (ii = oldIncr + 1; ii <= curIncr; ii++) {
         BackupMetadata meta;
-        pseudo[2] = 'm';
-        sprintf(pseudoD, "/%llu.met", ii);
-        if (readMetadata(&meta, dirfd, pseudo, 1) == 0) {
+        if (historyGet(&hist, ii, &meta, NULL) == 0) {
             if (meta.type == MD_TYPE_NONEXIST) oldIncr = ii;
             else break;
         } else break;
@@ -243,52 +868,44 @@ void purge(long long oldest, int inDeadDir, int dirfd, char *name)
 
     /* maybe just say what we would have done */
     if (dryRun || verbose) {
-        fprintf(stderr, "Purge %s <= %llu%s\n", name, oldIncr, (oldIncr == curIncr) ? " (all)" : "");
+        report(out, "Purge %s <= %llu%s\n", name, oldIncr, (oldIncr == curIncr) ? " (all)" : "");
     }
 
     if (!dryRun) {
-        /* delete all the old increments */
-        for (ii = oldIncr; ii > 0; ii--) {
-            /* metadata */
-            pseudo[2] = 'm';
-            sprintf(pseudoD, "/%llu.met", ii);
-            unlinkat(dirfd, pseudo, 0);
-
-            /* and content */
-            pseudo[2] = 'c';
-            sprintf(pseudoD, "/%llu.dat", ii);
-            unlinkat(dirfd, pseudo, 0);
-            sprintf(pseudoD, "/%llu.bsp", ii);
-            unlinkat(dirfd, pseudo, 0);
-            sprintf(pseudoD, "/%llu.x3p", ii);
-            unlinkat(dirfd, pseudo, 0);
-        }
+        /* Delete the old increments' content, then their metadata, which
+         * marks them as present. What's already purged is usually a prefix,
+         * but an interrupted purge, or one by an older version (which went
+         * newest first), can leave gaps, so what's left is found from the
+         * store rather than by counting. */
+        pseudo[2] = 'c';
+        *pseudoD = 0;
+        purgeContent(dirfd, pseudo, oldIncr);
+        historyEach(&hist, oldIncr, dropIncrement, NULL);
     }
 
     /* recurse to subdirectories */
 tryRemoveSubdirs:
+    /* from the catalog, live directories have their own entries */
+    if (expiredIncr && curMeta.type == MD_TYPE_DIRECTORY) goto tryRemove;
     pseudo[2] = 'd';
     *pseudoD = 0;
     dfd = openat(dirfd, pseudo, O_RDONLY);
     if (dfd >= 0) {
-        purgeDir(oldest, inDeadDir || (curMeta.type != MD_TYPE_DIRECTORY), dfd);
+        inDeadDir = inDeadDir || (curMeta.type != MD_TYPE_DIRECTORY);
+        if (task && poolQueued(pool) < PURGE_MAX_QUEUED) {
+            /* another thread takes it from here, and removes us when done */
+            purgeSpawn(task, entry, inDeadDir, dfd);
+            goto done;
+        }
+        purgeDir(oldest, inDeadDir, dfd, out);
         close(dfd);
     }
 
     /* now we may have gotten rid of the file entirely */
 tryRemove:
-    if (!dryRun) {
-        for (i = 0; pseudos[i]; i++) {
-            pseudo[2] = pseudos[i];
-            if (unlinkat(dirfd, pseudo, AT_REMOVEDIR) != 0) break;
-        }
-        if (!pseudos[i]) {
-            /* completely removed this file, so remove the increment file as well */
-            pseudo[2] = 'i';
-            unlinkat(dirfd, pseudo, 0);
-        }
-    }
+    purgeRemove(&hist);
 
-    close(ifd);
+done:
+    historyClose(&hist);
     free(pseudo);
 }
@@ -20,27 +20,23 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "arg.h"
+#include "buffer.h"
+#include "chunk.h"
+#include "codec.h"
+#include "history.h"
 #include "metadata.h"
 
-#define SF(into, func, bad, err, args) do { \
-    (into) = func args; \
-    if ((into) == (bad)) { \
-        perror(err); \
-        exit(1); \
-    } \
-} while (0)
-
 #define REP(into, func, bad, err, args) do { \
     (into) = func args; \
     if ((into) == (bad)) { \
@@ -50,6 +46,23 @@
 
 static size_t direntLen;
 
+/* the backup's chunk store, if it has one */
+static int chunkFd = -1;
+
+/* files we've restored that were hard links, by the identity of their
+ * content in the backup, so the links can be made again */
+struct RestoredLink_ {
+    struct RestoredLink_ *next;
+    dev_t dev;
+    ino_t ino;
+    BackupMetadata meta;
+    char *path;
+};
+typedef struct RestoredLink_ RestoredLink;
+
+#define RESTORED_LINKS_SZ 1024
+static RestoredLink *restoredLinks[RESTORED_LINKS_SZ];
+
 /* usage statement */
 static void usage(void);
 
@@ -63,13 +76,14 @@ static void restoreDir(long long newest, int sourceDir, int targetDir);
 static void restore(long long newest, int sourceDir, int targetDir, char *name);
 
 /* restore the data from this backup */
-static int restoreData(int sourceDir, int targetDir, char *name, unsigned long long restIncr, unsigned long long curIncr);
+static int restoreData(History *h, int targetDir, char *name, unsigned long long restIncr);
 
-/* utility function to call bspatch, returning 0 if it succeeds */
-static int bspatch(const char *from, const char *to, const char *patch);
+/* if this file's content is shared with one we've already restored, link to
+ * it. Otherwise restore it, and remember it if it may be linked later. */
+static int restoreFile(History *h, int targetDir, char *name, BackupMetadata *meta, unsigned long long restIncr);
 
-/* utility function to call xdelta3 -d, returning 0 if it succeeds */
-static int xdelta3d(const char *from, const char *to, const char *patch);
+/* forget the restored hard links */
+static void freeRestoredLinks(void);
 
 int main(int argc, char **argv)
 {
@@ -138,11 +152,12 @@ int main(int argc, char **argv)
     }
 
     /* open the backup directory... */
-    SF(sourceFd, open, -1, backupDir, (backupDir, O_RDONLY));
+    SFE(sourceFd, open, -1, backupDir, (backupDir, O_RDONLY));
+    chunkFd = chunkStoreOpen(sourceFd, 0);
 
     /* and the target directory... */
     if (targetDir) {
-        SF(targetFd, open, -1, targetDir, (targetDir, O_RDONLY));
+        SFE(targetFd, open, -1, targetDir, (targetDir, O_RDONLY));
     } else {
         targetFd = -1;
     }
@@ -161,6 +176,8 @@ int main(int argc, char **argv)
         restoreDir(newest, sourceFd, targetFd);
     }
 
+    freeRestoredLinks();
+
     return 0;
 }
 
@@ -190,9 +207,9 @@ static void restoreSelected(long long newest, int sourceDir, int targetDir, char
         selection = NULL;
 
         /* descend into this directory */
-        SF(dir, malloc, NULL, "malloc", (strlen(part) + 4));
+        SFE(dir, malloc, NULL, "malloc", (strlen(part) + 4));
         sprintf(dir, "nid%s", part);
-        SF(newSourceDir, openat, -1, part, (sourceDir, dir, O_RDONLY));
+        SFE(newSourceDir, openat, -1, part, (sourceDir, dir, O_RDONLY));
         free(dir);
         close(sourceDir);
         sourceDir = newSourceDir;
@@ -211,9 +228,9 @@ static void restoreDir(long long newest, int sourceDir, int targetDir)
     DIR *dh;
     struct dirent *de, *der;
 
-    SF(de, malloc, NULL, "malloc", (direntLen));
-    SF(hdirfd, dup, -1, "dup", (sourceDir));
-    SF(dh, fdopendir, NULL, "fdopendir", (hdirfd));
+    SFE(de, malloc, NULL, "malloc", (direntLen));
+    SFE(hdirfd, dup, -1, "dup", (sourceDir));
+    SFE(dh, fdopendir, NULL, "fdopendir", (hdirfd));
 
     if (targetDir == -1)
         printf("<\n");
@@ -223,8 +240,8 @@ static void restoreDir(long long newest, int sourceDir, int targetDir)
         if (readdir_r(dh, de, &der) != 0) break;
         if (der == NULL) break;
 
-        /* looking for increment files */
-        if (strncmp(de->d_name, "nii", 3)) continue;
+        /* looking for histories */
+        if (!historyEntry(de->d_name)) continue;
 
         /* restore this */
         restore(newest, sourceDir, targetDir, de->d_name + 3);
@@ -240,42 +257,25 @@ static void restoreDir(long long newest, int sourceDir, int targetDir)
 /* restore a single file or directory */
 static void restore(long long newest, int sourceDir, int targetDir, char *name)
 {
-    char *pseudo, *pseudoD;
-    int ifd, tmpi, status;
-    char incrBuf[4*sizeof(unsigned long long)+1];
-    unsigned long long curIncr, oldIncr;
+    char *pseudo;
+    int tmpi, status;
+    unsigned long long oldIncr;
     BackupMetadata meta;
+    History hist;
 
-    /* make room for our pseudos: ni?<name>/<ull>.{old,new} */
-    SF(pseudo, malloc, NULL, "malloc", (strlen(name) + (4*sizeof(unsigned long long)) + 9));
-    pseudoD = pseudo + strlen(name) + 3;
-    sprintf(pseudo, "nii%s", name);
-
-    /* open and lock the increment file */
-    SF(ifd, openat, -1, name, (sourceDir, pseudo, O_RDONLY));
-    SF(tmpi, flock, -1, pseudo, (ifd, LOCK_SH));
-
-    /* read in the current increment */
-    incrBuf[read(ifd, incrBuf, sizeof(incrBuf))] = 0;
-    curIncr = atoll(incrBuf);
-    if (curIncr == 0) goto done;
-
-    /* now find the acceptable increment */
-    for (oldIncr = curIncr; oldIncr > 0; oldIncr--) {
-        struct stat sbuf;
-        pseudo[2] = 'm';
-        sprintf(pseudoD, "/%llu.met", oldIncr);
-        if (fstatat(sourceDir, pseudo, &sbuf, 0) == 0) {
-            if (sbuf.st_mtime <= newest)
-                break;
-        }
-    }
+    SFE(pseudo, malloc, NULL, "malloc", (strlen(name) + 4));
+    sprintf(pseudo, "nid%s", name);
 
-    /* maybe skip it */
+    /* open and lock the history */
+    SFE(tmpi, historyOpen, -1, name, (&hist, sourceDir, name, LOCK_SH, HISTORY_OPEN));
+    if (hist.cur == 0) goto done;
+
+    /* now find the acceptable increment, or maybe skip it */
+    oldIncr = historyFind(&hist, newest);
     if (oldIncr == 0) goto done;
 
     /* load in the metadata */
-    SF(tmpi, readMetadata, -1, pseudo, (&meta, sourceDir, pseudo, 1));
+    SFE(tmpi, historyGet, -1, name, (&hist, oldIncr, &meta, NULL));
 
     if (targetDir == -1)
         printf("%s\n", name);
@@ -285,8 +285,11 @@ static void restore(long long newest, int sourceDir, int targetDir, char *name)
     if (targetDir >= 0) {
         switch (meta.type) {
             case MD_TYPE_FILE:
+                status = restoreFile(&hist, targetDir, name, &meta, oldIncr);
+                break;
+
             case MD_TYPE_LINK:
-                status = restoreData(sourceDir, targetDir, name, oldIncr, curIncr);
+                status = restoreData(&hist, targetDir, name, oldIncr);
 
                 if (status == 0 && meta.type == MD_TYPE_LINK) {
                     /* convert the data into a link */
@@ -294,7 +297,7 @@ static void restore(long long newest, int sourceDir, int targetDir, char *name)
                     int lfd;
                     ssize_t rd;
 
-                    SF(linkTarget, malloc, NULL, "malloc", (meta.size + 1));
+                    SFE(linkTarget, malloc, NULL, "malloc", (meta.size + 1));
                     REP(lfd, openat, -1, name, (targetDir, name, O_RDONLY));
                     if (lfd != -1) {
                         REP(rd, read, -1, "read", (lfd, linkTarget, meta.size));
@@ -321,8 +324,6 @@ static void restore(long long newest, int sourceDir, int targetDir, char *name)
     /* if this was a directory, restore its content */
     if (status == 0 && meta.type == MD_TYPE_DIRECTORY) {
         int newSourceDir, newTargetDir;
-        pseudo[2] = 'd';
-        *pseudoD = 0;
         REP(newSourceDir, openat, -1, pseudo, (sourceDir, pseudo, O_RDONLY));
         if (targetDir >= 0)
             REP(newTargetDir, openat, -1, name, (targetDir, name, O_RDONLY));
@@ -352,26 +353,44 @@ static void restore(long long newest, int sourceDir, int targetDir, char *name)
 
 
 done:
-    close(ifd);
+    historyClose(&hist);
     free(pseudo);
 }
 
 /* restore the data from this backup */
-static int restoreData(int sourceDir, int targetDir, char *name, unsigned long long restIncr, unsigned long long curIncr)
+static int restoreData(History *h, int targetDir, char *name, unsigned long long restIncr)
 {
     char *pseudo, *pseudoD;
-    unsigned long long ii;
-    int tmpi, ifd = -1, ret = -1;
-
-    SF(pseudo, malloc, NULL, "malloc", (strlen(name) + (4*sizeof(unsigned long long)) + 9));
+    unsigned long long ii, curIncr = h->cur;
+    int sourceDir = h->dirfd, tmpi, ifd = -1, ret = -1, cur = 0, chunked = 0;
+    const unsigned char *data = NULL;
+    size_t dataSz = 0;
+    struct Buffer_char bufs[2];
+    unsigned char inlineBuf[HISTORY_INLINE_MAX];
+    ssize_t inlineLen;
+
+    /* small content is in the history itself */
+    inlineLen = historyInline(h, restIncr, inlineBuf);
+    if (inlineLen >= 0)
+        return writeSparse(inlineBuf, inlineLen, targetDir, name);
+
+    bufs[0].buf = bufs[1].buf = NULL;
+
+    SFE(pseudo, malloc, NULL, "malloc", (strlen(name) + (4*sizeof(unsigned long long)) + 9));
     pseudoD = pseudo + strlen(name) + 3;
     sprintf(pseudo, "nic%s", name);
 
-    /* find fully-defined content */
+    /* find fully-defined content, either whole or as chunks */
     for (ii = restIncr; ii <= curIncr; ii++) {
         sprintf(pseudoD, "/%llu.dat", ii);
         tmpi = faccessat(sourceDir, pseudo, R_OK, 0);
         if (tmpi == 0) break;
+        sprintf(pseudoD, "/%llu." CHUNK_LIST_EXT, ii);
+        tmpi = faccessat(sourceDir, pseudo, R_OK, 0);
+        if (tmpi == 0) {
+            chunked = 1;
+            break;
+        }
     }
 
     if (ii > curIncr) {
@@ -380,120 +399,211 @@ static int restoreData(int sourceDir, int targetDir, char *name, unsigned long l
         goto done;
     }
 
-    /* copy in this version */
+    if (chunked) {
+        if (chunkFd < 0) {
+            perror(CHUNK_DIR_NAME);
+            goto done;
+        }
+
+        if (ii == restIncr) {
+            /* nothing to patch, just reassemble this version */
+            if (chunkRestore(chunkFd, sourceDir, pseudo, targetDir, name) != 0) {
+                fprintf(stderr, "%s: failed to restore from chunks\n", pseudo);
+                goto done;
+            }
+            ret = 0;
+            goto done;
+        }
+
+        /* reassemble it in memory to patch */
+        INIT_BUFFER(bufs[0]);
+        INIT_BUFFER(bufs[1]);
+        if (chunkLoad(chunkFd, sourceDir, pseudo, &bufs[1]) != 0) {
+            fprintf(stderr, "%s: failed to restore from chunks\n", pseudo);
+            goto done;
+        }
+        data = (unsigned char *) bufs[1].buf;
+        dataSz = bufs[1].bufused;
+        goto patch;
+    }
+
     ifd = openat(sourceDir, pseudo, O_RDONLY);
     if (ifd < 0) {
         perror(pseudo);
         goto done;
     }
-    if (copySparse(ifd, targetDir, name) != 0) {
-        perror(name);
+
+    if (ii == restIncr) {
+        /* nothing to patch, just copy in this version */
+        if (copySparse(ifd, targetDir, name) != 0) {
+            perror(name);
+            goto done;
+        }
+        ret = 0;
         goto done;
     }
-    close(ifd);
-    ifd = -1;
 
-    /* then start patching */
-    ret = 0;
+    /* apply the whole chain of patches in memory, so the target is only
+     * written once */
+    data = codecMap(ifd, &dataSz);
+    if (data == NULL) {
+        perror(pseudo);
+        goto done;
+    }
+    INIT_BUFFER(bufs[0]);
+    INIT_BUFFER(bufs[1]);
+
+patch:
     for (ii--; ii >= restIncr; ii--) {
-        int fda, fdb, fdp;
-        char aBuf[15+4*sizeof(int)];
-        char bBuf[15+4*sizeof(int)];
-        char pBuf[15+4*sizeof(int)];
-
-        /* file a */
-        fda = openat(targetDir, name, O_RDWR);
-        if (fda >= 0) {
-            sprintf(aBuf, "/proc/self/fd/%d", fda);
-
-            /* file b */
-            fdb = openat(targetDir, name, O_RDWR);
-
-            if (fdb >= 0) {
-                int useBsdiff = 1;
-                sprintf(bBuf, "/proc/self/fd/%d", fdb);
-
-                /* and the patch, in bsdiff or xdelta3 format */
-                sprintf(pseudoD, "/%llu.bsp", ii);
-                fdp = openat(sourceDir, pseudo, O_RDONLY);
-                if (fdp < 0) {
-                    useBsdiff = 0;
-                    sprintf(pseudoD, "/%llu.x3p", ii);
-                    fdp = openat(sourceDir, pseudo, O_RDONLY);
-                }
+        const unsigned char *patch;
+        size_t patchSz;
+        int fdp = -1, ci;
+
+        /* find the patch, in whichever format it was written */
+        for (ci = 0; codecs[ci]; ci++) {
+            sprintf(pseudoD, "/%llu.%s", ii, codecs[ci]->ext);
+            fdp = openat(sourceDir, pseudo, O_RDONLY);
+            if (fdp >= 0) break;
+        }
+        if (fdp < 0) {
+            perror(pseudo);
+            goto done;
+        }
 
-                if (fdp >= 0) {
-                    sprintf(pBuf, "/proc/self/fd/%d", fdp);
+        patch = codecMap(fdp, &patchSz);
+        close(fdp);
+        if (patch == NULL) {
+            perror(pseudo);
+            goto done;
+        }
 
-                    if ((useBsdiff ? bspatch : xdelta3d)
-                        (aBuf, bBuf, pBuf) != 0) ret = -1;
+        /* decode into whichever buffer we're not reading from */
+        bufs[cur].bufused = 0;
+        tmpi = codecDecode(codecs[ci], data, dataSz, patch, patchSz, &bufs[cur]);
+        codecUnmap(patch, patchSz);
+        if (tmpi != 0) {
+            fprintf(stderr, "%s: failed to apply patch\n", pseudo);
+            goto done;
+        }
 
-                    close(fdp);
-                } else {
-                    perror(pseudo);
-                    ret = -1;
-                }
-                close(fdb);
-            } else {
-                perror(name);
-                ret = -1;
-            }
-            close(fda);
-        } else {
-            perror(name);
-            ret = -1;
+        if (ifd >= 0) {
+            /* done with the original */
+            codecUnmap(data, dataSz);
+            close(ifd);
+            ifd = -1;
         }
+        data = (unsigned char *) bufs[cur].buf;
+        dataSz = bufs[cur].bufused;
+        cur = !cur;
+    }
 
+    if (writeSparse(data, dataSz, targetDir, name) != 0) {
+        perror(name);
+        goto done;
     }
+    ret = 0;
 
 done:
-    if (ifd >= 0) close(ifd);
+    if (ifd >= 0) {
+        if (data) codecUnmap(data, dataSz);
+        close(ifd);
+    }
+    if (bufs[0].buf) FREE_BUFFER(bufs[0]);
+    if (bufs[1].buf) FREE_BUFFER(bufs[1]);
     free(pseudo);
     return ret;
 }
 
-/* utility function to call bspatch, returning 0 if it succeeds */
-static int bspatch(const char *from, const char *to, const char *patch)
+/* restore a file, or link it to one we've restored */
+static int restoreFile(History *h, int targetDir, char *name, BackupMetadata *meta, unsigned long long restIncr)
 {
-    int status;
-    pid_t pid = fork();
-    if (pid < 0) return -1;
-
-    if (pid == 0) {
-        /* child, call bspatch */
-        execlp("bspatch", "bspatch", from, to, patch, NULL);
-        perror("bspatch");
-        exit(1);
-        abort();
+    char *pseudo, *pseudoD, *path;
+    char fdPath[32];
+    struct stat sbuf;
+    RestoredLink *rl;
+    size_t bucket;
+    ssize_t rd;
+    int i, ret;
+
+    /* Only a file that had other links can be one. Content is also linked
+     * between the names of a rename, so that alone isn't enough, but backups
+     * from before linkIds only have that to go by. */
+    if (meta->linkId == 0)
+        return restoreData(h, targetDir, name, restIncr);
+
+    SFE(pseudo, malloc, NULL, "malloc", (strlen(name) + (4*sizeof(unsigned long long)) + 9));
+    pseudoD = pseudo + strlen(name) + 3;
+    sprintf(pseudo, "nic%s", name);
+
+    /* find this increment's content, in whatever form it has */
+    sprintf(pseudoD, "/%llu.dat", restIncr);
+    if (fstatat(h->dirfd, pseudo, &sbuf, 0) != 0) {
+        sprintf(pseudoD, "/%llu." CHUNK_LIST_EXT, restIncr);
+        if (fstatat(h->dirfd, pseudo, &sbuf, 0) != 0) {
+            sbuf.st_nlink = 0;
+            for (i = 0; codecs[i]; i++) {
+                sprintf(pseudoD, "/%llu.%s", restIncr, codecs[i]->ext);
+                if (fstatat(h->dirfd, pseudo, &sbuf, 0) == 0) break;
+            }
+        }
     }
+    free(pseudo);
+
+    /* only content linked between names can be a hard link */
+    if (sbuf.st_nlink < 2)
+        return restoreData(h, targetDir, name, restIncr);
+
+    bucket = (sbuf.st_dev ^ sbuf.st_ino) % RESTORED_LINKS_SZ;
+    for (rl = restoredLinks[bucket]; rl; rl = rl->next) {
+        if (rl->dev == sbuf.st_dev && rl->ino == sbuf.st_ino &&
+            rl->meta.linkId == meta->linkId &&
+            rl->meta.mode == meta->mode && rl->meta.uid == meta->uid &&
+            rl->meta.gid == meta->gid && rl->meta.size == meta->size &&
+            rl->meta.mtime == meta->mtime) {
+            /* same content, same file */
+            unlinkat(targetDir, name, 0);
+            if (linkat(AT_FDCWD, rl->path, targetDir, name, 0) == 0)
+                return 0;
+            break;
+        }
+    }
+
+    ret = restoreData(h, targetDir, name, restIncr);
+    if (ret != 0) return ret;
+
+    /* remember where we put it */
+    sprintf(fdPath, "/proc/self/fd/%d", targetDir);
+    SFE(path, malloc, NULL, "malloc", (PATH_MAX + strlen(name) + 2));
+    rd = readlink(fdPath, path, PATH_MAX);
+    if (rd <= 0) {
+        free(path);
+        return 0;
+    }
+    sprintf(path + rd, "/%s", name);
+
+    SFE(rl, malloc, NULL, "malloc", (sizeof(RestoredLink)));
+    rl->dev = sbuf.st_dev;
+    rl->ino = sbuf.st_ino;
+    rl->meta = *meta;
+    rl->path = path;
+    rl->next = restoredLinks[bucket];
+    restoredLinks[bucket] = rl;
 
-    /* wait for bspatch */
-    if (waitpid(pid, &status, 0) != pid)
-        return -1;
-    if (WEXITSTATUS(status) != 0)
-        return -1;
     return 0;
 }
 
-/* utility function to call xdelta3 -d, returning 0 if it succeeds */
-static int xdelta3d(const char *from, const char *to, const char *patch)
+/* forget the restored hard links */
+static void freeRestoredLinks(void)
 {
-    int status;
-    pid_t pid = fork();
-    if (pid < 0) return -1;
-
-    if (pid == 0) {
-        /* child, call xdelta3 */
-        execlp("xdelta3", "xdelta3", "-d", "-f", "-s", from, patch, to, NULL);
-        perror("xdelta3");
-        exit(1);
-        abort();
+    RestoredLink *rl, *next;
+    size_t i;
+
+    for (i = 0; i < RESTORED_LINKS_SZ; i++) {
+        for (rl = restoredLinks[i]; rl; rl = next) {
+            next = rl->next;
+            free(rl->path);
+            free(rl);
+        }
+        restoredLinks[i] = NULL;
     }
-
-    /* wait for xdelta3 */
-    if (waitpid(pid, &status, 0) != pid)
-        return -1;
-    if (WEXITSTATUS(status) != 0)
-        return -1;
-    return 0;
 }
@@ -16,46 +16,149 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _XOPEN_SOURCE 700 /* for lstat */
+#define _GNU_SOURCE /* for lstat and name_to_handle_at */
 
 #include <errno.h>
-#include <linux/fcntl.h>
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fanotify.h>
 #include <sys/inotify.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "buffer.h"
+#include "dircache.h"
 #include "exclude.h"
+#include "metadata.h"
 #include "nibackup.h"
 #include "notify.h"
-
-#define HASHTABLE_SZ 128
-
-/* inotify watches are stored in two hash tables (one for watch #, one for
- * path) and an LRU queue */
-struct InotifyWatch_ {
-    struct InotifyWatch_
-        *lruNext, *lruPrev,
-        *idNext, *idPrev,
-        *pathNext, *pathPrev;
-
-    int id;
+#include "rename.h"
+#include "watch.h"
+
+/* IN_MOVED_FROM events waiting for their IN_MOVED_TO. The pair is normally
+ * adjacent, so only a few are kept. */
+#define PENDING_MOVES 16
+struct PendingMove_ {
+    uint32_t cookie;
     char *path;
 };
-typedef struct InotifyWatch_ InotifyWatch;
+typedef struct PendingMove_ PendingMove;
+
+/* inotify watches (see watch.h) each have a heat, from the events in their
+ * directory, which halves every HEAT_HALF_LIFE seconds. When we're out of
+ * watches, the coldest of the EVICT_SAMPLE least recently used goes. */
+#define HEAT_HALF_LIFE 3600
+#define HEAT_WRITE 1 /* a file in it was written */
+#define HEAT_ENTRY 4 /* an entry was created, deleted or renamed, which only
+                      * inotify tells us about */
+#define EVICT_SAMPLE 8
+
+/* heat is saved this often (in seconds), so that after a restart the hottest
+ * directories are watched from the start. Records vary in length: the heat
+ * and the length of the path (relative to the source) as 32-bit, making up
+ * HEAT_HEADER_SIZE bytes, followed by the path. */
+#define HEAT_SAVE_INTERVAL 600
+#define HEAT_HEADER_SIZE 8
+
+/* Directories events were recently in. If a kernel queue overflows, these are
+ * rescanned, unless they're all so recent that others may have been pushed
+ * out, in which case everything is. */
+#define RECENT_DIRS 64
+#define OVERFLOW_WINDOW 10000 /* how recent, in milliseconds */
+#define OVERFLOW_INTERVAL 5000 /* least time between rescans, in milliseconds */
+struct RecentDir_ {
+    char *path;
+    long long when;
+};
+typedef struct RecentDir_ RecentDir;
+
+static pthread_mutex_t recentLock = PTHREAD_MUTEX_INITIALIZER;
+static RecentDir recentDirs[RECENT_DIRS];
+static size_t recentNext = 0;
+static long long nextRescan = 0; /* when the last rescan was due */
+
+/* overflows so far, of each kernel queue */
+#define OVERFLOW_FANOTIFY 0
+#define OVERFLOW_INOTIFY 1
+static unsigned long overflows[2];
+
+/* Events are read this much at a time. Without directory entry events, each
+ * comes with an open file, whose path is read into an arena, and the paths
+ * are then all queued, and their directories watched, at once: at most
+ * FANOTIFY_BATCH of them, or as many as fill the arena. */
+#define FANOTIFY_BUF_SIZE (256 * 1024)
+#define FANOTIFY_BATCH (FANOTIFY_BUF_SIZE / FAN_EVENT_METADATA_LEN)
+#define FANOTIFY_ARENA_SIZE (1024 * 1024)
+struct IngestBatch_ {
+    char *arena;
+    size_t arenaUsed;
+    char *files[FANOTIFY_BATCH];
+    size_t count;
+};
+typedef struct IngestBatch_ IngestBatch;
 
+/* only the watch tables are under this: nothing else is locked with it held */
 static pthread_mutex_t watchesLock;
 static int watchCount = 0;
-static InotifyWatch watchesLRUHead, watchesLRUTail;
-static InotifyWatch watchesTable[HASHTABLE_SZ];
+
+/* In fanotify directory entry mode, directories are reported by their file
+ * handle, which we can't open without privileges, so we remember each
+ * directory we've seen by its handle, as a name in its parent's entry, so a
+ * rename only moves one entry. Past DIR_HANDLES_MAX, the least recently used
+ * are forgotten, and an event in a forgotten directory starts a full sync to
+ * find it again. A full sync of so many directories forgets some again, so
+ * these are at most every FORGOTTEN_INTERVAL. */
+struct DirHandle_ {
+    struct DirHandle_ *next, *lruPrev, *lruNext;
+    struct DirHandle_ *parent; /* NULL for the source, named by its path */
+    char *name;
+    size_t children;
+    int hashed; /* not yet deleted (with children left) or forgotten */
+    int handleType;
+    unsigned int handleBytes;
+    unsigned char handle[];
+};
+typedef struct DirHandle_ DirHandle;
+
+/* a file handle with room for any filesystem's */
+union AnyHandle_ {
+    struct file_handle fh;
+    char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+};
+typedef union AnyHandle_ AnyHandle;
+
+#define DIR_HANDLES_MIN 1024
+#define DIR_HANDLES_MAX (256*1024)
+
+static pthread_mutex_t dirsLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t dirsSize = 0, dirsCount = 0;
+static DirHandle **dirs = NULL;
+static DirHandle *dirsOldest = NULL, *dirsNewest = NULL;
+static int dirsRescan = 0, dirsOverflowed = 0;
+
+#define FORGOTTEN_INTERVAL (10*60*1000) /* in milliseconds */
+static long long nextForgottenSync = 0; /* when the last was due */
+
+/* the handles of forgotten directories, as a Bloom filter, since events from
+ * the rest of the filesystem have unknown handles too */
+#define DIRS_FORGOTTEN_BITS (1024*1024)
+static unsigned char dirsForgotten[DIRS_FORGOTTEN_BITS / 8];
+static int anyForgotten = 0;
+
+static dev_t sourceDev;
+
+/* the events we want to hear about anywhere on the source's filesystem */
+#define FANOTIFY_FID_MODE (FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | \
+    FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_ONDIR)
 
 /* initialize the notification queue for this instance */
 void notifyInit(NiBackup *ni)
@@ -66,6 +169,32 @@ void notifyInit(NiBackup *ni)
     ffd = ni->fanotifFd;
     ifd = ni->inotifFd;
 
+    if (ffd < 0) {
+        /* Newer kernels can tell us about directory entries (creation,
+         * deletion and renaming) for the whole filesystem, which makes inotify
+         * unnecessary */
+        ffd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_CLOEXEC);
+        if (ffd >= 0) {
+            tmpi = fanotify_mark(
+                ffd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                FANOTIFY_FID_MODE | FAN_RENAME,
+                AT_FDCWD, ni->source);
+            if (tmpi < 0 && errno == EINVAL) {
+                /* no FAN_RENAME, so we get the two ends separately */
+                tmpi = fanotify_mark(
+                    ffd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FANOTIFY_FID_MODE | FAN_MOVED_FROM | FAN_MOVED_TO,
+                    AT_FDCWD, ni->source);
+            }
+            if (tmpi < 0) {
+                close(ffd);
+                ffd = -1;
+            } else {
+                ni->fanotifFid = 1;
+            }
+        }
+    }
+
     if (ffd < 0) {
         /* init fanotify */
         ffd = fanotify_init(
@@ -98,304 +227,804 @@ void notifyInit(NiBackup *ni)
         }
     }
 
-    /* then initialize the locks */
-    if (pthread_mutex_init(&ni->qlock, NULL) < 0) {
-        perror("pthread_mutex_init");
+    /* then initialize the queue and locks */
+    if (queueInit(&ni->queue, ni->waitAfterNotif, ni->maxWaitAfterNotif,
+            ni->queueBudget, ni->source) != 0) {
+        perror("queueInit");
         exit(1);
     }
-    if (sem_init(&ni->qsem, 0, 0) < 0) {
-        perror("sem_init");
+    pthread_mutex_init(&watchesLock, NULL);
+    if (watchInit(ni->source) != 0) {
+        perror("watchInit");
         exit(1);
     }
-    pthread_mutex_init(&watchesLock, NULL);
 
     /* and save our data */
-    ni->notifs = NULL;
     ni->fanotifFd = ffd;
     ni->inotifFd = ifd;
 }
 
-/* enqueue this event */
-static void enqueue(NiBackup *ni, char *file)
+/* the time, in milliseconds, by the queue's clock */
+static long long nowMs(void)
 {
-    NotifyQueue *last, *cur, *ev;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    /* make sure it's in the source */
-    if (strncmp(ni->source, file, ni->sourceLen) ||
-        file[ni->sourceLen] != '/') {
-        free(file);
-        return;
+/* remember the directory of a path with an event */
+static void recentDir(const char *file)
+{
+    const char *slash = strrchr(file, '/');
+    size_t len = slash ? slash - file : 0, i;
+    RecentDir *r = NULL;
+
+    pthread_mutex_lock(&recentLock);
+    for (i = 0; i < RECENT_DIRS; i++) {
+        r = &recentDirs[i];
+        if (r->path && !strncmp(r->path, file, len) && !r->path[len]) break;
     }
-
-    /* handle exclusions */
-    if (excluded(ni, file + ni->sourceLen + 1)) {
-        free(file);
-        return;
+    if (i == RECENT_DIRS) {
+        /* replace the oldest */
+        r = &recentDirs[recentNext];
+        recentNext = (recentNext + 1) % RECENT_DIRS;
+        free(r->path);
+        r->path = strndup(file, len);
     }
+    r->when = nowMs();
+    pthread_mutex_unlock(&recentLock);
+}
 
-    pthread_mutex_lock(&ni->qlock);
-
-    /* check that it isn't already present */
-    last = cur = ni->notifs;
-    while (cur) {
-        if (cur->file && !strcmp(cur->file, file)) {
-            pthread_mutex_unlock(&ni->qlock);
-            free(file);
-            return;
+/* A kernel queue overflowed, so we've missed events. Rescan where they
+ * probably were, soon but not too often, or everything if we can't tell. */
+static void overflowed(NiBackup *ni, int which)
+{
+    long long now = nowMs(), delay;
+    size_t i, rescans = 0;
+    int all = 1;
+    char *dir;
+
+    pthread_mutex_lock(&recentLock);
+    overflows[which]++;
+
+    /* join a rescan that's still pending, else run one interval after it */
+    if (nextRescan <= now) {
+        nextRescan += OVERFLOW_INTERVAL;
+        if (nextRescan < now) nextRescan = now;
+    }
+    delay = nextRescan - now;
+
+    for (i = 0; i < RECENT_DIRS; i++)
+        if (!recentDirs[i].path || recentDirs[i].when < now - OVERFLOW_WINDOW)
+            all = 0;
+
+    if (!all) {
+        for (i = 0; i < RECENT_DIRS; i++) {
+            if (!recentDirs[i].path || recentDirs[i].when < now - OVERFLOW_WINDOW)
+                continue;
+            if ((dir = strdup(recentDirs[i].path))) {
+                queueRescan(&ni->queue, dir, delay);
+                rescans++;
+            }
         }
-        last = cur;
-        cur = cur->next;
     }
+    if (!rescans) queueFullSync(&ni->queue);
 
-    /* create this event */
-    ev = malloc(sizeof(NotifyQueue));
-    if (ev == NULL) {
-        /* FIXME */
-        perror("malloc");
-        exit(1);
-    }
-    ev->next = NULL;
-    ev->file = file;
+    fprintf(stderr, "Notification queue overflow (fanotify %lu, inotify %lu so far): ",
+        overflows[OVERFLOW_FANOTIFY], overflows[OVERFLOW_INOTIFY]);
+    if (rescans)
+        fprintf(stderr, "rescanning %d recently active directories.\n", (int) rescans);
+    else
+        fprintf(stderr, "starting a full sync.\n");
 
-    /* and add it */
-    if (last == NULL) {
-        ni->notifs = ev;
-    } else {
-        last->next = ev;
-    }
+    pthread_mutex_unlock(&recentLock);
+}
 
-    /* notify */
-    pthread_mutex_unlock(&ni->qlock);
-    sem_post(&ni->qsem);
+/* is this path in the source, and not excluded? */
+static int wanted(NiBackup *ni, const char *file)
+{
+    return !strncmp(ni->source, file, ni->sourceLen) &&
+        file[ni->sourceLen] == '/' &&
+        !excluded(ni, file + ni->sourceLen + 1);
 }
 
-/* classic (Bernstein) hash */
-static unsigned long hash(unsigned char *str)
+/* enqueue this event */
+static void enqueue(NiBackup *ni, char *file)
 {
-    unsigned long hash = 5381;
-    int c;
+    if (!wanted(ni, file)) {
+        free(file);
+        return;
+    }
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) ^ c; /* hash * 33 ^ c */
+    recentDir(file);
+    queuePush(&ni->queue, file);
+}
 
-    return hash;
+/* a directory was deleted or renamed away, so it mustn't be used from the cache */
+static void dirGone(NiBackup *ni, const char *path)
+{
+    if (strncmp(ni->source, path, ni->sourceLen)) return;
+    if (path[ni->sourceLen] == '/')
+        dirCacheInvalidate(path + ni->sourceLen + 1);
+    else if (!path[ni->sourceLen])
+        dirCacheInvalidate("");
 }
 
-/* refresh an existing watch, if there is one */
-static InotifyWatch *refreshWatch(NiBackup *ni, char *path)
+/* a watch's heat, decayed to now */
+static unsigned long watchHeat(Watch *w)
 {
-    InotifyWatch *cur;
-    unsigned long pHash = hash((unsigned char *) path) % HASHTABLE_SZ;
+    unsigned long epoch = time(NULL) / HEAT_HALF_LIFE;
 
-    /* find the existing watch */
-    cur = &watchesTable[pHash];
-    while (cur) {
-        if (cur->path && !strcmp(cur->path, path)) break;
-        cur = cur->pathNext;
+    if (epoch != w->heatEpoch) {
+        w->heat = (epoch - w->heatEpoch >= sizeof(unsigned long) * 8) ?
+            0 : w->heat >> (epoch - w->heatEpoch);
+        w->heatEpoch = epoch;
     }
+    return w->heat;
+}
 
-    /* if we found it, refresh it */
-    if (cur) {
-        cur->lruPrev->lruNext = cur->lruNext;
-        cur->lruNext->lruPrev = cur->lruPrev;
-
-        cur->lruPrev = watchesLRUTail.lruPrev;
-        cur->lruPrev->lruNext = cur;
-
-        cur->lruNext = &watchesLRUTail;
+/* warm up a watch */
+static void heatWatch(Watch *w, unsigned long by)
+{
+    w->heat = watchHeat(w) + by;
+}
 
-        watchesLRUTail.lruPrev = cur;
+/* the watch to give up: the coldest of the least recently used few */
+static Watch *coldWatch(void)
+{
+    Watch *w, *ret = NULL;
+    unsigned long heat, coldest = 0;
+    int i;
+
+    for (i = 0, w = watchOldest(); i < EVICT_SAMPLE && w; i++, w = watchNewer(w)) {
+        heat = watchHeat(w);
+        if (!ret || heat < coldest) {
+            ret = w;
+            coldest = heat;
+        }
     }
 
-    watchesLRUHead.lruNext = &watchesLRUTail;
-    watchesLRUTail.lruPrev = &watchesLRUHead;
-
-    return cur;
+    return ret;
 }
 
 /* delete a watch */
-static void delWatch(NiBackup *ni, InotifyWatch *w)
+static void delWatch(NiBackup *ni, Watch *w)
 {
-    /* remove it from all the lists */
-    w->lruPrev->lruNext = w->lruNext;
-    w->lruNext->lruPrev = w->lruPrev;
-    w->idPrev->idNext = w->idNext;
-    if (w->idNext) w->idNext->idPrev = w->idPrev;
-    w->pathPrev->pathNext = w->pathNext;
-    if (w->pathNext) w->pathNext->pathPrev = w->pathPrev;
-
-    /* clear the watch */
     inotify_rm_watch(ni->inotifFd, w->id);
     watchCount--;
-
-    /* and free all the used memory */
-    free(w->path);
-    free(w);
+    watchDel(w);
 }
 
 /* create a new watch */
-static InotifyWatch *newWatch(NiBackup *ni, char *path)
+static Watch *newWatch(NiBackup *ni, const char *path)
 {
-    InotifyWatch *ret;
-    unsigned long hval;
-
-    /* make the structure */
-    ret = calloc(sizeof(InotifyWatch), 1);
-    if (ret == NULL) {
-        free(path);
-        return NULL;
-    }
+    Watch *ret, *old;
+    int id;
 
-    /* perhaps remove an old one */
+    /* perhaps remove a cold one */
     if (watchCount >= ni->maxInotifyWatches) {
-        if (watchesLRUHead.lruNext->path)
-            delWatch(ni, watchesLRUHead.lruNext);
+        if ((old = coldWatch()))
+            delWatch(ni, old);
     }
 
     /* now set up this one */
-    ret->path = path;
 #define INOTIFY_MODE (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
-    ret->id = inotify_add_watch(ni->inotifFd, path, INOTIFY_MODE);
-    if (ret->id < 0 && errno == ENOSPC) {
+    id = inotify_add_watch(ni->inotifFd, path, INOTIFY_MODE);
+    if (id < 0 && errno == ENOSPC) {
         /* just out of watches, try clearing one */
-        if (watchesLRUHead.lruNext->path)
-            delWatch(ni, watchesLRUHead.lruNext);
-        ret->id = inotify_add_watch(ni->inotifFd, path, INOTIFY_MODE);
+        if ((old = coldWatch()))
+            delWatch(ni, old);
+        id = inotify_add_watch(ni->inotifFd, path, INOTIFY_MODE);
     }
 #undef INOTIFY_MODE
-    if (ret->id < 0) {
-        free(path);
-        free(ret);
+    if (id < 0) return NULL;
+
+    /* the same directory by another path keeps its watch, and its count */
+    if (watchById(id)) return watchAdd(path, id);
+
+    ret = watchAdd(path, id);
+    if (ret == NULL) {
+        inotify_rm_watch(ni->inotifFd, id);
         return NULL;
     }
     watchCount++;
-
-    /* and add it to the tables */
-    ret->lruPrev = watchesLRUTail.lruPrev;
-    ret->lruPrev->lruNext = ret;
-    ret->lruNext = &watchesLRUTail;
-    watchesLRUTail.lruPrev = ret;
-
-    hval = ret->id % HASHTABLE_SZ;
-    ret->idNext = watchesTable[hval].idNext;
-    watchesTable[hval].idNext = ret;
-    ret->idPrev = &watchesTable[hval];
-    if (ret->idNext) ret->idNext->idPrev = ret;
-
-    hval = hash((unsigned char *) path) % HASHTABLE_SZ;
-    ret->pathNext = watchesTable[hval].pathNext;
-    watchesTable[hval].pathNext = ret;
-    ret->pathPrev = &watchesTable[hval];
-    if (ret->pathNext) ret->pathNext->pathPrev = ret;
+    ret->heatEpoch = time(NULL) / HEAT_HALF_LIFE;
 
     return ret;
 }
 
 /* add or refresh a watch for this directory */
-static void addWatch(NiBackup *ni, char *path)
+static void addWatch(NiBackup *ni, const char *path)
 {
+    Watch *w;
+
     /* make sure it's in the source */
     if (strncmp(ni->source, path, ni->sourceLen) ||
-        (path[ni->sourceLen] && path[ni->sourceLen] != '/')) {
-        free(path);
+        (path[ni->sourceLen] && path[ni->sourceLen] != '/'))
         return;
-    }
 
     /* refresh an existing watch */
-    if (refreshWatch(ni, path)) {
-        free(path);
+    if ((w = watchFind(path))) {
+        watchTouch(w);
+        heatWatch(w, HEAT_WRITE);
         return;
     }
 
     /* OK, make a new watch for this */
-    newWatch(ni, path);
+    if ((w = newWatch(ni, path)))
+        heatWatch(w, HEAT_WRITE);
+}
+
+/* Pair up the two halves of a rename, moving watches with a renamed
+ * directory. Returns the old path, which the caller frees, when path is the
+ * new one. */
+static char *inotifyMove(PendingMove *pending, struct inotify_event *ie, const char *path)
+{
+    char *ret;
+    int i;
+
+    if (ie->mask & IN_MOVED_FROM) {
+        /* wait for the other half */
+        i = ie->cookie % PENDING_MOVES;
+        free(pending[i].path);
+        pending[i].cookie = ie->cookie;
+        pending[i].path = strdup(path);
+        return NULL;
+    }
+
+    for (i = 0; i < PENDING_MOVES; i++)
+        if (pending[i].path && pending[i].cookie == ie->cookie) break;
+    if (i == PENDING_MOVES) return NULL; /* moved in from outside of what we watch */
+
+    if (ie->mask & IN_ISDIR)
+        watchMove(pending[i].path, path);
+
+    ret = pending[i].path;
+    pending[i].path = NULL;
+    return ret;
 }
 
-/* get a watch by its watch descriptor */
-static InotifyWatch *getWatchById(NiBackup *ni, int wd)
+/* hash a file handle */
+static size_t hashHandle(int type, unsigned int bytes, const unsigned char *handle)
 {
-    InotifyWatch *w;
-    unsigned long hval;
+    size_t hash = 5381 ^ type;
+    unsigned int i;
+
+    for (i = 0; i < bytes; i++)
+        hash = ((hash << 5) + hash) ^ handle[i];
 
-    hval = wd % HASHTABLE_SZ;
-    w = &watchesTable[hval];
-    while (w) {
-        if (w->path && w->id == wd) break;
-        w = w->idNext;
+    return hash;
+}
+
+/* find a directory by its handle */
+static DirHandle *dirHandleFind(int type, unsigned int bytes, const unsigned char *handle)
+{
+    DirHandle *d;
+    if (!dirsSize) return NULL;
+    for (d = dirs[hashHandle(type, bytes, handle) & (dirsSize - 1)]; d; d = d->next)
+        if (d->handleType == type && d->handleBytes == bytes &&
+            !memcmp(d->handle, handle, bytes))
+            return d;
+    return NULL;
+}
+
+/* grow the directory table if it's getting full. Returns 0 on success. */
+static int dirHandleGrow(void)
+{
+    DirHandle **buckets, *d, *next;
+    size_t size, i, b;
+
+    if (dirsCount < dirsSize) return 0;
+    size = dirsSize ? dirsSize * 2 : DIR_HANDLES_MIN;
+    buckets = calloc(size, sizeof(DirHandle *));
+    if (buckets == NULL) return dirsSize ? 0 : -1;
+
+    for (i = 0; i < dirsSize; i++) {
+        for (d = dirs[i]; d; d = next) {
+            next = d->next;
+            b = hashHandle(d->handleType, d->handleBytes, d->handle) & (size - 1);
+            d->next = buckets[b];
+            buckets[b] = d;
+        }
     }
+    free(dirs);
+    dirs = buckets;
+    dirsSize = size;
+    return 0;
+}
 
-    return w;
+/* a handle's bits in the forgotten filter */
+static void forgottenBits(size_t hash, size_t *a, size_t *b)
+{
+    *a = hash & (DIRS_FORGOTTEN_BITS - 1);
+    *b = ((hash >> 20) * 2654435761U) & (DIRS_FORGOTTEN_BITS - 1);
 }
 
-/* the fa-notification loop */
-static void *fanotifyLoop(void *nivp)
+/* take a directory out of the LRU list, if it's in it */
+static void dirHandleUnlink(DirHandle *d)
+{
+    if (!d->lruPrev && dirsOldest != d) return;
+    if (d->lruPrev) d->lruPrev->lruNext = d->lruNext;
+    else dirsOldest = d->lruNext;
+    if (d->lruNext) d->lruNext->lruPrev = d->lruPrev;
+    else dirsNewest = d->lruPrev;
+    d->lruPrev = d->lruNext = NULL;
+}
+
+/* make a directory, then everything above it, the most recently used, so a
+ * directory is never forgotten before what's under it */
+static void dirHandleTouch(DirHandle *d)
+{
+    for (; d; d = d->parent) {
+        if (!d->hashed || d == dirsNewest) continue;
+        dirHandleUnlink(d);
+        d->lruPrev = dirsNewest;
+        if (dirsNewest) dirsNewest->lruNext = d;
+        else dirsOldest = d;
+        dirsNewest = d;
+    }
+}
+
+/* free directories that are gone and have nothing left under them, from d up */
+static void dirHandlePrune(DirHandle *d)
+{
+    DirHandle *parent;
+
+    while (d && !d->hashed && !d->children) {
+        parent = d->parent;
+        free(d->name);
+        free(d);
+        if (parent) parent->children--;
+        d = parent;
+    }
+}
+
+/* forget a directory, though what's under it may still need its name */
+static void dirHandleForget(DirHandle *d)
+{
+    DirHandle **dp;
+
+    dp = &dirs[hashHandle(d->handleType, d->handleBytes, d->handle) & (dirsSize - 1)];
+    for (; *dp; dp = &(*dp)->next) {
+        if (*dp == d) {
+            *dp = d->next;
+            break;
+        }
+    }
+    dirHandleUnlink(d);
+    d->hashed = 0;
+    dirsCount--;
+    dirHandlePrune(d);
+}
+
+/* a directory's path, with /name appended if name isn't NULL, malloc'd */
+static char *dirHandlePath(DirHandle *d, const char *name)
+{
+    DirHandle *p;
+    size_t len = 0, nameLen = name ? strlen(name) + 1 : 0, partLen;
+    char *ret, *pos;
+
+    for (p = d; p; p = p->parent)
+        len += strlen(p->name) + (p->parent ? 1 : 0);
+
+    ret = malloc(len + nameLen + 1);
+    if (ret == NULL) return NULL;
+
+    /* fill it in from the end */
+    if (name) {
+        ret[len] = '/';
+        memcpy(ret + len + 1, name, nameLen);
+    } else {
+        ret[len] = 0;
+    }
+    pos = ret + len;
+    for (p = d; p; p = p->parent) {
+        partLen = strlen(p->name);
+        pos -= partLen;
+        memcpy(pos, p->name, partLen);
+        if (p->parent) *--pos = '/';
+    }
+
+    return ret;
+}
+
+/* Remember a directory (name under dirfd) by its handle, as leaf in the
+ * directory with the handle parentFh, or as the source if that's NULL. If we
+ * knew it elsewhere, it moves here with everything under it, and its old path
+ * is returned (malloc'd). */
+static char *dirHandleAdd(int dirfd, const char *name, int flags,
+    struct file_handle *parentFh, const char *leaf)
+{
+    AnyHandle h;
+    DirHandle *d, *parent = NULL, *p;
+    char *leafDup, *ret = NULL;
+    int mountId;
+    size_t b, fb;
+
+    h.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(dirfd, name, &h.fh, &mountId, flags) != 0) return NULL;
+    leafDup = strdup(leaf);
+    if (leafDup == NULL) return NULL;
+
+    pthread_mutex_lock(&dirsLock);
+
+    if (parentFh) {
+        parent = dirHandleFind(parentFh->handle_type, parentFh->handle_bytes,
+            parentFh->f_handle);
+        if (parent == NULL) goto done;
+    }
+
+    if ((d = dirHandleFind(h.fh.handle_type, h.fh.handle_bytes, h.fh.f_handle))) {
+        if (d->parent != parent || strcmp(d->name, leaf)) {
+            /* it can't really have moved under itself, so we're out of date */
+            for (p = parent; p; p = p->parent)
+                if (p == d) goto done;
+
+            ret = dirHandlePath(d, NULL);
+            free(d->name);
+            d->name = leafDup;
+            leafDup = NULL;
+            p = d->parent;
+            d->parent = parent;
+            if (parent) parent->children++;
+            if (p) {
+                p->children--;
+                dirHandlePrune(p);
+            }
+        }
+
+    } else {
+        /* make room, never forgetting where this is going */
+        if (parent) dirHandleTouch(parent);
+        while (dirsCount >= DIR_HANDLES_MAX) {
+            for (p = dirsOldest; p && (p->children || !p->parent || p == parent);
+                 p = p->lruNext);
+            if (p == NULL) goto done;
+            if (!dirsOverflowed) {
+                dirsOverflowed = 1;
+                fprintf(stderr, "More than %d directories to follow: forgetting the "
+                    "least recently used, and finding them again with a full sync "
+                    "at most every %d minutes.\n",
+                    DIR_HANDLES_MAX, FORGOTTEN_INTERVAL / 60000);
+            }
+            forgottenBits(hashHandle(p->handleType, p->handleBytes, p->handle), &b, &fb);
+            dirsForgotten[b / 8] |= 1 << (b % 8);
+            dirsForgotten[fb / 8] |= 1 << (fb % 8);
+            anyForgotten = 1;
+            dirHandleForget(p);
+        }
+
+        if (dirHandleGrow() != 0 ||
+            (d = calloc(1, sizeof(DirHandle) + h.fh.handle_bytes)) == NULL)
+            goto done;
+        d->name = leafDup;
+        leafDup = NULL;
+        d->parent = parent;
+        if (parent) parent->children++;
+        d->hashed = 1;
+        d->handleType = h.fh.handle_type;
+        d->handleBytes = h.fh.handle_bytes;
+        memcpy(d->handle, h.fh.f_handle, h.fh.handle_bytes);
+        b = hashHandle(d->handleType, d->handleBytes, d->handle) & (dirsSize - 1);
+        d->next = dirs[b];
+        dirs[b] = d;
+        dirsCount++;
+
+    }
+
+    dirHandleTouch(d);
+
+done:
+    pthread_mutex_unlock(&dirsLock);
+    free(leafDup);
+    return ret;
+}
+
+/* forget a deleted directory */
+static void dirHandleDel(struct file_handle *fh)
+{
+    DirHandle *d;
+
+    pthread_mutex_lock(&dirsLock);
+    d = dirHandleFind(fh->handle_type, fh->handle_bytes, fh->f_handle);
+    if (d) dirHandleForget(d);
+    pthread_mutex_unlock(&dirsLock);
+}
+
+/* the path an fanotify fid record refers to, malloc'd, or NULL if it's not in
+ * a directory we know */
+static char *fidPath(struct fanotify_event_info_fid *fid, int hasName)
+{
+    struct file_handle *fh = (struct file_handle *) fid->handle;
+    const char *name = hasName ? (char *) fh->f_handle + fh->handle_bytes : "";
+    DirHandle *d;
+    char *ret = NULL;
+    size_t a, b;
+
+    /* a directory's own events are named . */
+    if (!strcmp(name, ".")) name = "";
+
+    pthread_mutex_lock(&dirsLock);
+    d = dirHandleFind(fh->handle_type, fh->handle_bytes, fh->f_handle);
+    if (d) {
+        ret = dirHandlePath(d, name[0] ? name : NULL);
+        dirHandleTouch(d);
+    } else if (anyForgotten) {
+        /* if it may be one we forgot, it'll have to be found again */
+        forgottenBits(hashHandle(fh->handle_type, fh->handle_bytes, fh->f_handle), &a, &b);
+        if ((dirsForgotten[a / 8] & (1 << (a % 8))) &&
+            (dirsForgotten[b / 8] & (1 << (b % 8)))) {
+            memset(dirsForgotten, 0, sizeof(dirsForgotten));
+            anyForgotten = 0;
+            dirsRescan = 1;
+        }
+    }
+    pthread_mutex_unlock(&dirsLock);
+
+    return ret;
+}
+
+/* path was renamed from oldPath, as far as the backup is concerned */
+static void fidMove(NiBackup *ni, const char *path, const char *oldPath)
+{
+    if (!strncmp(ni->source, path, ni->sourceLen) && path[ni->sourceLen] == '/' &&
+        !strncmp(ni->source, oldPath, ni->sourceLen) && oldPath[ni->sourceLen] == '/')
+        renameHint(path + ni->sourceLen + 1, oldPath + ni->sourceLen + 1);
+}
+
+/* An event may have been in a directory we forgot, so find it again with a
+ * full sync, joining one that's pending, else one interval after the last */
+static void forgottenSync(NiBackup *ni)
+{
+    long long now = nowMs();
+
+    if (nextForgottenSync > now) return;
+    if (nextForgottenSync && nextForgottenSync + FORGOTTEN_INTERVAL > now)
+        nextForgottenSync += FORGOTTEN_INTERVAL;
+    else
+        nextForgottenSync = now;
+
+    if (nextForgottenSync == now)
+        fprintf(stderr, "Event in a forgotten directory: starting a full sync.\n");
+    else
+        fprintf(stderr, "Event in a forgotten directory: full sync in %d seconds.\n",
+            (int) ((nextForgottenSync - now) / 1000));
+    queueFullSyncAfter(&ni->queue, nextForgottenSync - now);
+}
+
+/* the fa-notification loop, in directory entry mode */
+static void *fanotifyFidLoop(void *nivp)
 {
     NiBackup *ni = (NiBackup *) nivp;
     int fd = ni->fanotifFd;
 
-    char buf[4096];
-    char pathBuf[1024];
+    char *buf;
     const struct fanotify_event_metadata *metadata;
+    struct fanotify_event_info_header *info;
+    struct fanotify_event_info_fid *fid, *newFid;
+    struct file_handle *fh;
+    char *path, *oldPath, *prev;
+    size_t off;
     ssize_t len;
 
-    while ((len = read(fd, buf, sizeof(buf))) != -1) {
+    buf = malloc(FANOTIFY_BUF_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    while ((len = read(fd, buf, FANOTIFY_BUF_SIZE)) != -1) {
         metadata = (struct fanotify_event_metadata *) buf;
         while (FAN_EVENT_OK(metadata, len)) {
-            /* FIXME: handle FAN_NOFD by forcing reset */
-            if (metadata->fd != FAN_NOFD && metadata->fd >= 0) {
-                struct stat lsb;
-                char *realPath, *dirPath;
-
-                sprintf(pathBuf, "/proc/self/fd/%d", metadata->fd);
-                if (lstat(pathBuf, &lsb) != -1) {
-                    realPath = malloc(4096); /* FIXME: Arbitrary, st_size seems wrong */
-                    /* FIXME */
-                    if (realPath) {
-                        ssize_t rllen = readlink(pathBuf, realPath, 4095);
-                        if (rllen > 0) {
-                            size_t len;
-
-                            /* got the real path */
-                            realPath[rllen] = 0;
-
-                            /* check for /proc's confusing " (deleted)" thing */
-                            len = strlen(realPath);
-                            if (len > 10 && !strcmp(realPath + len - 10, " (deleted)")) {
-                                /* get rid of it */
-                                len -= 10;
-                                realPath[len] = 0;
-                            }
-
-                            /* get just the directory component */
-                            dirPath = strdup(realPath);
-                            if (dirPath) {
-                                char *slash = strrchr(dirPath, '/');
-                                if (slash) *slash = 0;
-                            }
-
-                            /* enqueue the real path */
-                            enqueue(ni, realPath);
-
-                            /* and watch the directory */
-                            if (dirPath) {
-                                pthread_mutex_lock(&watchesLock);
-                                addWatch(ni, dirPath);
-                                pthread_mutex_unlock(&watchesLock);
-                            }
-                        } else {
-                            free(realPath);
+            path = oldPath = NULL;
+            newFid = NULL;
+
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                overflowed(ni, OVERFLOW_FANOTIFY);
+                metadata = FAN_EVENT_NEXT(metadata, len);
+                continue;
+            }
+
+            /* find the entry (and for renames, the old entry) */
+            for (off = metadata->metadata_len;
+                 off + sizeof(struct fanotify_event_info_header) <= metadata->event_len;
+                 off += info->len) {
+                info = (struct fanotify_event_info_header *) ((char *) metadata + off);
+                if (info->len == 0) break;
+                fid = (struct fanotify_event_info_fid *) info;
+
+                switch (info->info_type) {
+                    case FAN_EVENT_INFO_TYPE_DFID:
+                    case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                        if (metadata->mask & FAN_DELETE_SELF) {
+                            /* the deletion itself was reported to its parent */
+                            dirHandleDel((struct file_handle *) fid->handle);
+                            break;
                         }
-                    }
+                        /* fallthrough */
+                    case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                        if (!path) {
+                            path = fidPath(fid, info->info_type != FAN_EVENT_INFO_TYPE_DFID);
+                            newFid = fid;
+                        }
+                        break;
+
+                    case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                        if (!oldPath) oldPath = fidPath(fid, 1);
+                        break;
+                }
+            }
+
+            if (dirsRescan) {
+                dirsRescan = 0;
+                forgottenSync(ni);
+            }
+
+            if (path && newFid && newFid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID &&
+                (metadata->mask & FAN_ONDIR) &&
+                (metadata->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_RENAME))) {
+                /* a new directory, or one moved here, which we'll need to find
+                 * by its handle */
+                fh = (struct file_handle *) newFid->handle;
+                prev = dirHandleAdd(AT_FDCWD, path, 0, fh,
+                    (char *) fh->f_handle + fh->handle_bytes);
+                if (prev && !oldPath) {
+                    oldPath = prev;
+                    prev = NULL;
                 }
+                free(prev);
+            }
+
+            if (path && oldPath)
+                fidMove(ni, path, oldPath);
+
+            /* directories that have gone, or been replaced, can't be cached */
+            if (metadata->mask & FAN_ONDIR) {
+                if (oldPath)
+                    dirGone(ni, oldPath);
+                if (path && (metadata->mask & (FAN_DELETE | FAN_MOVED_FROM |
+                        FAN_MOVED_TO | FAN_RENAME)))
+                    dirGone(ni, path);
+            }
+
+            /* enqueue both ends */
+            if (oldPath) enqueue(ni, oldPath);
+            if (path) enqueue(ni, path);
+
+            metadata = FAN_EVENT_NEXT(metadata, len);
+        }
+    }
+
+    /* FIXME */
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+/* queue a batch of paths, and watch their directories */
+static void ingestFlush(NiBackup *ni, IngestBatch *batch)
+{
+    const char *prev = NULL;
+    size_t prevLen = 0, dirLen, kept = 0, i;
+    char *file, *slash;
+
+    /* each directory once, as they're usually together */
+    pthread_mutex_lock(&watchesLock);
+    for (i = 0; i < batch->count; i++) {
+        file = batch->files[i];
+        slash = strrchr(file, '/');
+        if (slash == NULL) continue;
+        dirLen = slash - file;
+        if (prev && dirLen == prevLen && !memcmp(prev, file, dirLen)) continue;
+        prev = file;
+        prevLen = dirLen;
+
+        *slash = 0;
+        addWatch(ni, file);
+        *slash = '/';
+    }
+    pthread_mutex_unlock(&watchesLock);
+
+    /* then the queue, which copies what it keeps */
+    prev = NULL;
+    for (i = 0; i < batch->count; i++) {
+        file = batch->files[i];
+        if (!wanted(ni, file)) continue;
+        batch->files[kept++] = file;
+
+        dirLen = strrchr(file, '/') - file;
+        if (prev && dirLen == prevLen && !memcmp(prev, file, dirLen)) continue;
+        prev = file;
+        prevLen = dirLen;
+        recentDir(file);
+    }
+    queuePushBatch(&ni->queue, batch->files, kept);
+
+    batch->arenaUsed = 0;
+    batch->count = 0;
+}
+
+/* the fa-notification loop */
+static void *fanotifyLoop(void *nivp)
+{
+    NiBackup *ni = (NiBackup *) nivp;
+    int fd = ni->fanotifFd;
+
+    char *buf;
+    size_t readSize = FANOTIFY_BUF_SIZE;
+    char fdName[16];
+    IngestBatch *batch;
+    const struct fanotify_event_metadata *metadata;
+    struct rlimit rl;
+    char *path;
+    ssize_t len, rllen;
+    int procFd;
+
+    buf = malloc(FANOTIFY_BUF_SIZE);
+    batch = malloc(sizeof(IngestBatch));
+    if (batch) batch->arena = malloc(FANOTIFY_ARENA_SIZE);
+    if (buf == NULL || batch == NULL || batch->arena == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    batch->arenaUsed = batch->count = 0;
+
+    /* the links to each event's file, without looking up /proc/self/fd each
+     * time */
+    procFd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procFd < 0) {
+        perror("/proc/self/fd");
+        return NULL;
+    }
 
+    /* each event read comes with an open file, so read no more than half
+     * of what we may have open */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        rl.rlim_cur / 2 < FANOTIFY_BATCH)
+        readSize = (rl.rlim_cur / 2) * FAN_EVENT_METADATA_LEN;
+
+    while ((len = read(fd, buf, readSize)) != -1) {
+        metadata = (struct fanotify_event_metadata *) buf;
+        while (FAN_EVENT_OK(metadata, len)) {
+            /* only an overflow comes without a file */
+            if (metadata->fd == FAN_NOFD || (metadata->mask & FAN_Q_OVERFLOW)) {
+                overflowed(ni, OVERFLOW_FANOTIFY);
+
+            } else if (metadata->fd >= 0) {
+                if (FANOTIFY_ARENA_SIZE - batch->arenaUsed < PATH_MAX)
+                    ingestFlush(ni, batch);
+
+                /* read the real path straight into the arena */
+                path = batch->arena + batch->arenaUsed;
+                sprintf(fdName, "%d", metadata->fd);
+                rllen = readlinkat(procFd, fdName, path, PATH_MAX - 1);
                 close(metadata->fd);
+
+                if (rllen > 0) {
+                    /* check for /proc's confusing " (deleted)" thing */
+                    if (rllen > 10 && !memcmp(path + rllen - 10, " (deleted)", 10))
+                        rllen -= 10;
+                    path[rllen] = 0;
+                    batch->arenaUsed += rllen + 1;
+                    batch->files[batch->count++] = path;
+                }
             }
 
             metadata = FAN_EVENT_NEXT(metadata, len);
         }
+
+        ingestFlush(ni, batch);
     }
 
     /* FIXME */
+    close(procFd);
+    free(batch->arena);
+    free(batch);
+    free(buf);
     close(fd);
     return NULL;
 }
@@ -410,41 +1039,65 @@ static void *inotifyLoop(void *nivp)
     ssize_t len;
     struct inotify_event *ie = NULL;
 
-    InotifyWatch *watch;
+    Watch *watch;
+    PendingMove pending[PENDING_MOVES];
+
+    memset(pending, 0, sizeof(pending));
 
     while ((len = read(fd, buf, sizeof(buf))) != -1) {
         char *cur = buf;
 
         /* so long as we still have an event... */
         while (len >= sizeof(struct inotify_event)) {
+            char *notifPath = NULL, *selfPath = NULL, *oldPath = NULL;
             ie = (struct inotify_event *) cur;
-            pthread_mutex_lock(&watchesLock);
 
-            /* find the associated watch */
-            if ((watch = getWatchById(ni, ie->wd))) {
-                char *notifPath;
+            if (ie->mask & IN_Q_OVERFLOW)
+                overflowed(ni, OVERFLOW_INOTIFY);
+
+            /* only the watches themselves are looked at under the lock */
+            pthread_mutex_lock(&watchesLock);
+            if ((watch = watchById(ie->wd))) {
+                heatWatch(watch, (ie->mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)) ?
+                    HEAT_ENTRY : HEAT_WRITE);
 
                 /* make the full path */
-                if (ie->len) {
-                    notifPath = malloc(strlen(watch->path) + strlen(ie->name) + 2);
-                    if (notifPath)
-                        sprintf(notifPath, "%s/%s", watch->path, ie->name);
-                } else {
-                    notifPath = strdup(watch->path);
-                }
+                notifPath = watchPath(watch, ie->len ? ie->name : NULL);
 
-                /* and enqueue it */
-                if (notifPath)
-                    enqueue(ni, notifPath);
+                /* renames let the new name reuse the old name's history, and
+                 * take the watches under a directory with it */
+                if (notifPath && (ie->mask & (IN_MOVED_FROM|IN_MOVED_TO)))
+                    oldPath = inotifyMove(pending, ie, notifPath);
 
                 /* as a special case, if the directory itself was removed or
                  * renamed, we need to kill the watch */
-                if (ie->mask & (IN_DELETE_SELF|IN_MOVE_SELF))
+                if (ie->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
+                    selfPath = watchPath(watch, NULL);
                     delWatch(ni, watch);
+                }
             }
-
             pthread_mutex_unlock(&watchesLock);
 
+            /* both ends of a rename need to be in the source */
+            if (oldPath &&
+                !strncmp(ni->source, notifPath, ni->sourceLen) && notifPath[ni->sourceLen] == '/' &&
+                !strncmp(ni->source, oldPath, ni->sourceLen) && oldPath[ni->sourceLen] == '/')
+                renameHint(notifPath + ni->sourceLen + 1, oldPath + ni->sourceLen + 1);
+            free(oldPath);
+
+            /* directories that have gone, or been replaced, can't be cached */
+            if (notifPath && (ie->mask & IN_ISDIR) &&
+                (ie->mask & (IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)))
+                dirGone(ni, notifPath);
+            if (selfPath) {
+                dirGone(ni, selfPath);
+                free(selfPath);
+            }
+
+            /* and enqueue it */
+            if (notifPath)
+                enqueue(ni, notifPath);
+
             cur += sizeof(struct inotify_event) + ie->len;
             len -= sizeof(struct inotify_event) + ie->len;
         }
@@ -453,9 +1106,159 @@ static void *inotifyLoop(void *nivp)
     return NULL;
 }
 
+/* order saved heats hottest first */
+static int cmpHeat(const void *l, const void *r)
+{
+    const unsigned char *a = *(const unsigned char *const *) l,
+                        *b = *(const unsigned char *const *) r;
+    unsigned long ah = getLE(a, 4), bh = getLE(b, 4);
+    return (ah < bh) - (ah > bh);
+}
+
+/* watch the directories that were hottest when we last ran */
+static void loadHeat(NiBackup *ni)
+{
+    struct Buffer_char buf;
+    unsigned char **recs = NULL, *rec;
+    size_t count = 0, off, len, i;
+    Watch *w;
+    char *path;
+    FILE *fh;
+    int fd;
+
+    fd = openat(ni->destFd, NOTIFY_HEAT_NAME, O_RDONLY);
+    if (fd < 0) return;
+    fh = fdopen(fd, "rb");
+    if (fh == NULL) {
+        close(fd);
+        return;
+    }
+    INIT_BUFFER(buf);
+    READ_FILE_BUFFER(buf, fh);
+    fclose(fh);
+
+    /* find the records */
+    for (off = 0; off + HEAT_HEADER_SIZE <= buf.bufused; off += HEAT_HEADER_SIZE + len) {
+        rec = (unsigned char *) buf.buf + off;
+        len = getLE(rec + 4, 4);
+        if (off + HEAT_HEADER_SIZE + len > buf.bufused) break;
+        if (count % 1024 == 0) {
+            unsigned char **nrecs = realloc(recs, (count + 1024) * sizeof(unsigned char *));
+            if (nrecs == NULL) break;
+            recs = nrecs;
+        }
+        recs[count++] = rec;
+    }
+    qsort(recs, count, sizeof(unsigned char *), cmpHeat);
+    if (count > (size_t) ni->maxInotifyWatches) count = ni->maxInotifyWatches;
+
+    /* and watch them, coldest first, so that they're the first to go */
+    pthread_mutex_lock(&watchesLock);
+    for (i = count; i-- > 0;) {
+        rec = recs[i];
+        len = getLE(rec + 4, 4);
+        path = malloc(ni->sourceLen + len + 2);
+        if (path == NULL) continue;
+        memcpy(path, ni->source, ni->sourceLen);
+        path[ni->sourceLen] = '/';
+        memcpy(path + ni->sourceLen + 1, rec + HEAT_HEADER_SIZE, len);
+        path[ni->sourceLen + 1 + len] = 0;
+        if (!len) path[ni->sourceLen] = 0;
+        if (!watchFind(path) && (w = newWatch(ni, path)))
+            w->heat = getLE(rec, 4);
+        free(path);
+    }
+    pthread_mutex_unlock(&watchesLock);
+
+    free(recs);
+    FREE_BUFFER(buf);
+}
+
+/* save each watched directory's heat, if it's been a while */
+void notifySaveHeat(NiBackup *ni)
+{
+    static time_t lastSave = 0;
+    time_t now = time(NULL);
+    struct Buffer_char buf;
+    unsigned char rec[HEAT_HEADER_SIZE];
+    unsigned long heat;
+    Watch *w;
+    char *path;
+    const char *rel;
+    size_t len;
+    int fd;
+
+    if (ni->fanotifFid || now - lastSave < HEAT_SAVE_INTERVAL) return;
+    lastSave = now;
+
+    INIT_BUFFER(buf);
+    pthread_mutex_lock(&watchesLock);
+    for (w = watchOldest(); w; w = watchNewer(w)) {
+        heat = watchHeat(w);
+        if (!heat || (path = watchPath(w, NULL)) == NULL) continue;
+        rel = path + ni->sourceLen;
+        if (*rel == '/') rel++;
+        len = strlen(rel);
+        putLE(rec, (heat > 0xFFFFFFFFUL) ? 0xFFFFFFFFUL : heat, 4);
+        putLE(rec + 4, len, 4);
+        WRITE_BUFFER(buf, (char *) rec, HEAT_HEADER_SIZE);
+        WRITE_BUFFER(buf, rel, len);
+        free(path);
+    }
+    pthread_mutex_unlock(&watchesLock);
+
+    /* replace the old file all at once */
+    fd = openat(ni->destFd, NOTIFY_HEAT_NAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(NOTIFY_HEAT_NAME);
+    } else if (write(fd, buf.buf, buf.bufused) != (ssize_t) buf.bufused) {
+        perror(NOTIFY_HEAT_NAME);
+        close(fd);
+        unlinkat(ni->destFd, NOTIFY_HEAT_NAME ".tmp", 0);
+    } else {
+        close(fd);
+        if (renameat(ni->destFd, NOTIFY_HEAT_NAME ".tmp", ni->destFd, NOTIFY_HEAT_NAME) != 0)
+            perror(NOTIFY_HEAT_NAME);
+    }
+    FREE_BUFFER(buf);
+}
+
 /* begin the notification threads */
 void notifyThread(NiBackup *ni)
 {
+    struct stat sbuf;
+
+    if (ni->fanotifFid) {
+        /* directory entry events need no inotify, just the source's handle */
+        if (stat(ni->source, &sbuf) == 0) {
+            sourceDev = sbuf.st_dev;
+            dirHandleAdd(AT_FDCWD, ni->source, 0, NULL, ni->source);
+        }
+        pthread_create(&ni->fanotifTh, NULL, fanotifyFidLoop, ni);
+        return;
+    }
+
+    /* rather than waiting for writes to find directories to watch, start
+     * with the ones that were hottest last time */
+    loadHeat(ni);
+
     pthread_create(&ni->fanotifTh, NULL, fanotifyLoop, ni);
     pthread_create(&ni->inotifTh, NULL, inotifyLoop, ni);
 }
+
+/* a directory has been seen */
+void notifyDirectory(NiBackup *ni, int fd, dev_t dev, const char *path)
+{
+    AnyHandle parent;
+    const char *leaf;
+    int mountId;
+
+    if (!ni->fanotifFid || dev != sourceDev || !path[0]) return;
+
+    /* it's in its parent, which we've seen first */
+    parent.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(fd, "..", &parent.fh, &mountId, 0) != 0) return;
+    leaf = strrchr(path, '/');
+    leaf = leaf ? leaf + 1 : path;
+    free(dirHandleAdd(fd, "", AT_EMPTY_PATH, &parent.fh, leaf));
+}
@@ -1,14 +1,12 @@
 #ifndef NOTIFY_H
 #define NOTIFY_H
 
+#include <sys/types.h>
+
 struct NiBackup_;
 
-/* a notification queue */
-struct NotifyQueue_ {
-    struct NotifyQueue_ *next;
-    char *file;
-};
-typedef struct NotifyQueue_ NotifyQueue;
+/* the directories that had the most events, in the backup's root */
+#define NOTIFY_HEAT_NAME "heat"
 
 /* initialize the notification queue for this instance */
 void notifyInit(struct NiBackup_ *ni);
@@ -16,4 +14,11 @@ void notifyInit(struct NiBackup_ *ni);
 /* start the notification thread(s) */
 void notifyThread(struct NiBackup_ *ni);
 
+/* a directory (path relative to the source, open as fd, on device dev) has
+ * been seen, so its notifications can be found */
+void notifyDirectory(struct NiBackup_ *ni, int fd, dev_t dev, const char *path);
+
+/* save which directories have had the most events, if it's been a while */
+void notifySaveHeat(struct NiBackup_ *ni);
+
 #endif
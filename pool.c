@@ -0,0 +1,299 @@
+/*
+ * pool.c: Work-stealing thread pool
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_DEQUE_DEFAULT_SIZE 64
+
+struct PoolItem_ {
+    PoolTask task;
+    void *arg;
+};
+typedef struct PoolItem_ PoolItem;
+
+/* Each worker has its own deque. The owner pushes and pops at the tail, so it
+ * works depth-first on what it just found, and thieves take from the head,
+ * which tends to be the biggest remaining piece of work. */
+struct PoolWorker_ {
+    Pool *pool;
+    int index;
+    pthread_t th;
+
+    pthread_mutex_t lock;
+    size_t head, count, sz;
+    PoolItem *items;
+};
+typedef struct PoolWorker_ PoolWorker;
+
+struct Pool_ {
+    int threads;
+    PoolWorker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle, room;
+    int queued, active, stop;
+    unsigned int next;
+};
+
+/* the worker (if any) running on this thread */
+static __thread PoolWorker *curWorker = NULL;
+
+/* push onto the tail of a worker's deque */
+static int dequePush(PoolWorker *w, PoolItem *item)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->sz) {
+        /* expand, unwrapping as we go */
+        size_t i, nsz = w->sz * 2;
+        PoolItem *nitems = malloc(nsz * sizeof(PoolItem));
+        if (nitems == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+        for (i = 0; i < w->count; i++)
+            nitems[i] = w->items[(w->head + i) % w->sz];
+        free(w->items);
+        w->items = nitems;
+        w->head = 0;
+        w->sz = nsz;
+    }
+    w->items[(w->head + w->count) % w->sz] = *item;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/* pop from the tail (owner) or the head (thief) of a worker's deque */
+static int dequePop(PoolWorker *w, PoolItem *item, int steal)
+{
+    int ret = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count) {
+        if (steal) {
+            *item = w->items[w->head];
+            w->head = (w->head + 1) % w->sz;
+        } else {
+            *item = w->items[(w->head + w->count - 1) % w->sz];
+        }
+        w->count--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* take a task to run, from our own deque or anybody else's */
+static int poolTake(PoolWorker *w, PoolItem *item)
+{
+    Pool *pool = w->pool;
+    int i, found;
+
+    found = dequePop(w, item, 0);
+    for (i = 1; !found && i < pool->threads; i++)
+        found = dequePop(&pool->workers[(w->index + i) % pool->threads], item, 1);
+
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pool->active++;
+        pthread_cond_broadcast(&pool->room);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return found;
+}
+
+/* a worker thread */
+static void *poolWorker(void *wvp)
+{
+    PoolWorker *w = (PoolWorker *) wvp;
+    Pool *pool = w->pool;
+    PoolItem item;
+
+    curWorker = w;
+
+    while (1) {
+        if (poolTake(w, &item)) {
+            item.task(pool, w->index, item.arg);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->active--;
+            if (pool->queued == 0 && pool->active == 0)
+                pthread_cond_broadcast(&pool->idle);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        /* nothing to do, wait for something */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->queued == 0 && pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* create a work-stealing pool */
+Pool *poolCreate(int threads)
+{
+    Pool *pool;
+    int i;
+
+    if (threads < 1) threads = 1;
+
+    pool = calloc(1, sizeof(Pool));
+    if (pool == NULL) return NULL;
+    pool->threads = threads;
+    pool->workers = calloc(threads, sizeof(PoolWorker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_cond_init(&pool->room, NULL);
+
+    for (i = 0; i < threads; i++) {
+        PoolWorker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        pthread_mutex_init(&w->lock, NULL);
+        w->sz = POOL_DEQUE_DEFAULT_SIZE;
+        w->items = malloc(w->sz * sizeof(PoolItem));
+        if (w->items == NULL) goto fail;
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i].th, NULL, poolWorker, &pool->workers[i]) != 0) {
+            /* stop the ones we did create */
+            pthread_mutex_lock(&pool->lock);
+            pool->stop = 1;
+            pthread_cond_broadcast(&pool->work);
+            pthread_mutex_unlock(&pool->lock);
+            while (--i >= 0)
+                pthread_join(pool->workers[i].th, NULL);
+            goto fail;
+        }
+    }
+
+    return pool;
+
+fail:
+    for (i = 0; i < threads; i++)
+        free(pool->workers[i].items);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+}
+
+/* submit a task */
+int poolSubmit(Pool *pool, PoolTask task, void *arg)
+{
+    PoolWorker *w;
+    PoolItem item;
+
+    item.task = task;
+    item.arg = arg;
+
+    if (curWorker && curWorker->pool == pool) {
+        w = curWorker;
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        w = &pool->workers[pool->next++ % pool->threads];
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (dequePush(w, &item) != 0)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* submit a task, waiting for room in the queue first */
+int poolSubmitBounded(Pool *pool, PoolTask task, void *arg, int maxQueued)
+{
+    /* a worker waiting on itself would never wake up */
+    if (!curWorker || curWorker->pool != pool) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued >= maxQueued)
+            pthread_cond_wait(&pool->room, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return poolSubmit(pool, task, arg);
+}
+
+/* number of tasks waiting to run */
+int poolQueued(Pool *pool)
+{
+    int ret;
+    pthread_mutex_lock(&pool->lock);
+    ret = pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/* wait for every task to finish */
+void poolWait(Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued || pool->active)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* stop and free the pool */
+void poolDestroy(Pool *pool)
+{
+    int i;
+
+    poolWait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threads; i++) {
+        pthread_join(pool->workers[i].th, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].items);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->room);
+    free(pool->workers);
+    free(pool);
+}
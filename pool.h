@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+struct Pool_;
+typedef struct Pool_ Pool;
+
+/* a task, run with the index of the worker running it */
+typedef void (*PoolTask)(Pool *pool, int worker, void *arg);
+
+/* create a work-stealing pool with this many threads */
+Pool *poolCreate(int threads);
+
+/* Submit a task. Tasks submitted from a worker go to that worker's own queue,
+ * and other workers steal them when idle. Returns 0 on success. */
+int poolSubmit(Pool *pool, PoolTask task, void *arg);
+
+/* Submit a task, but first wait until fewer than maxQueued tasks are waiting.
+ * Workers submitting to their own pool don't wait. */
+int poolSubmitBounded(Pool *pool, PoolTask task, void *arg, int maxQueued);
+
+/* number of tasks waiting to run */
+int poolQueued(Pool *pool);
+
+/* wait for every task to finish. Must not be called from a worker. */
+void poolWait(Pool *pool);
+
+/* wait for every task, then stop and free the pool */
+void poolDestroy(Pool *pool);
+
+#endif
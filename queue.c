@@ -0,0 +1,531 @@
+/*
+ * queue.c: Deduplicating queue of paths to back up
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define QUEUE_TABLE_MIN 256
+
+/* what an entry counts against the budget */
+#define ENTRY_BYTES(e) (sizeof(QueueEntry) + strlen((e)->file) + 1)
+
+/* an entry and the length of the directory it'd collapse into, for sorting */
+struct CollapseItem_ {
+    QueueEntry *e;
+    size_t keyLen;
+};
+typedef struct CollapseItem_ CollapseItem;
+
+/* classic (Bernstein) hash */
+static size_t hashPath(const char *str, size_t len)
+{
+    size_t hash = 5381;
+
+    while (len--)
+        hash = ((hash << 5) + hash) ^ (unsigned char) *str++; /* hash * 33 ^ c */
+
+    return hash;
+}
+
+/* the time, in milliseconds, by a clock that doesn't jump */
+static long long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* grow the table and heap if they're getting full. Returns 0 on success. */
+static int queueGrow(NotifyQueue *queue)
+{
+    QueueEntry **buckets, **heap, *e;
+    size_t size, b, i;
+
+    if (queue->count < queue->size) return 0;
+    size = queue->size ? queue->size * 2 : QUEUE_TABLE_MIN;
+    buckets = calloc(size, sizeof(QueueEntry *));
+    if (buckets == NULL) return -1;
+    heap = realloc(queue->heap, size * sizeof(QueueEntry *));
+    if (heap == NULL) {
+        free(buckets);
+        return -1;
+    }
+
+    /* everything in the table is in the heap, so rebuild from that */
+    for (i = 0; i < queue->count; i++) {
+        e = heap[i];
+        b = e->hash & (size - 1);
+        e->hashNext = buckets[b];
+        buckets[b] = e;
+    }
+    free(queue->buckets);
+    queue->buckets = buckets;
+    queue->heap = heap;
+    queue->size = size;
+    return 0;
+}
+
+/* put the entry at i in its place in the heap, moving up or down */
+static void heapFix(NotifyQueue *queue, size_t i)
+{
+    QueueEntry **heap = queue->heap, *e = heap[i];
+    size_t parent, child;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap[parent]->deadline <= e->deadline) break;
+        heap[i] = heap[parent];
+        heap[i]->heapIdx = i;
+        i = parent;
+    }
+
+    while ((child = i * 2 + 1) < queue->count) {
+        if (child + 1 < queue->count && heap[child + 1]->deadline < heap[child]->deadline)
+            child++;
+        if (e->deadline <= heap[child]->deadline) break;
+        heap[i] = heap[child];
+        heap[i]->heapIdx = i;
+        i = child;
+    }
+
+    heap[i] = e;
+    e->heapIdx = i;
+}
+
+/* find the entry for the first len bytes of file */
+static QueueEntry *queueFind(NotifyQueue *queue, const char *file, size_t len, int rescan)
+{
+    QueueEntry *e;
+    size_t hash = hashPath(file, len);
+
+    if (!queue->size) return NULL;
+    for (e = queue->buckets[hash & (queue->size - 1)]; e; e = e->hashNext) {
+        if (e->hash == hash && e->rescan == rescan &&
+            !strncmp(e->file, file, len) && !e->file[len])
+            return e;
+    }
+    return NULL;
+}
+
+/* an entry couldn't be added, so leave what it was for to a full sync */
+static void queueLost(NotifyQueue *queue)
+{
+    if (!queue->fullSync)
+        fprintf(stderr, "Out of memory queueing a path: starting a full sync.\n");
+    queue->fullSync = 1;
+    pthread_cond_signal(&queue->cond);
+}
+
+/* Add an entry for a (malloc'd) path, which the queue takes if it succeeds.
+ * Returns NULL if it can't allocate, leaving the path to the caller. */
+static QueueEntry *queueAdd(NotifyQueue *queue, char *file, int rescan, long long first)
+{
+    QueueEntry *e;
+    size_t b;
+
+    if (queueGrow(queue) != 0 || (e = malloc(sizeof(QueueEntry))) == NULL)
+        return NULL;
+    e->next = NULL;
+    e->hash = hashPath(file, strlen(file));
+    e->first = first;
+    e->deadline = first + queue->quiet;
+    e->rescan = rescan;
+    e->file = file;
+
+    b = e->hash & (queue->size - 1);
+    e->hashNext = queue->buckets[b];
+    queue->buckets[b] = e;
+    queue->heap[queue->count] = e;
+    queue->count++;
+    heapFix(queue, queue->count - 1);
+
+    queue->bytes += ENTRY_BYTES(e);
+    if (rescan) queue->rescans++;
+    return e;
+}
+
+/* take an entry out of the table and heap (but don't free it) */
+static void queueRemove(NotifyQueue *queue, QueueEntry *e)
+{
+    QueueEntry **ep;
+    size_t i = e->heapIdx;
+
+    queue->count--;
+    if (i < queue->count) {
+        queue->heap[i] = queue->heap[queue->count];
+        heapFix(queue, i);
+    }
+
+    for (ep = &queue->buckets[e->hash & (queue->size - 1)]; *ep != e; ep = &(*ep)->hashNext);
+    *ep = e->hashNext;
+
+    queue->bytes -= ENTRY_BYTES(e);
+    if (e->rescan) queue->rescans--;
+}
+
+/* another event for an entry, so put it off */
+static void queuePutOff(NotifyQueue *queue, QueueEntry *e, long long now)
+{
+    e->deadline = now + queue->quiet;
+    if (e->deadline > e->first + queue->maxDelay)
+        e->deadline = e->first + queue->maxDelay;
+    heapFix(queue, e->heapIdx);
+}
+
+/* the queued rescan that covers this path, if any: one of it (unless strict)
+ * or a directory above it */
+static QueueEntry *queueRescanOf(NotifyQueue *queue, const char *file, int strict)
+{
+    QueueEntry *e;
+    size_t len = strlen(file);
+
+    if (!queue->rescans) return NULL;
+    if (strict) goto up;
+    while (1) {
+        if ((e = queueFind(queue, file, len, 1))) return e;
+up:
+        if (len <= queue->rootLen) return NULL;
+        while (len > queue->rootLen && file[--len] != '/');
+    }
+}
+
+/* the length of the directory strip levels above file, but not above the root */
+static size_t collapseKey(NotifyQueue *queue, const char *file, size_t strip)
+{
+    size_t len = strlen(file);
+
+    while (strip-- && len > queue->rootLen)
+        while (len > queue->rootLen && file[--len] != '/');
+    return len;
+}
+
+/* order collapse items by their directory */
+static int cmpCollapse(const void *l, const void *r)
+{
+    const CollapseItem *a = (const CollapseItem *) l, *b = (const CollapseItem *) r;
+    int c;
+
+    c = memcmp(a->e->file, b->e->file, (a->keyLen < b->keyLen) ? a->keyLen : b->keyLen);
+    if (c) return c;
+    return (a->keyLen > b->keyLen) - (a->keyLen < b->keyLen);
+}
+
+/* Collapse entries sharing a directory into a rescan of it, going further up
+ * each time, until the queue is within half its budget */
+static void queueCollapse(NotifyQueue *queue, long long now)
+{
+    CollapseItem *items;
+    QueueEntry *e, *r;
+    size_t strip, n, i, j, k;
+    char *file;
+
+    for (strip = 1; queue->bytes > queue->budget / 2 && queue->count > 1; strip++) {
+        n = queue->count;
+        items = malloc(n * sizeof(CollapseItem));
+        if (items == NULL) return;
+        for (i = 0; i < n; i++) {
+            items[i].e = queue->heap[i];
+            items[i].keyLen = collapseKey(queue, items[i].e->file, strip);
+        }
+        qsort(items, n, sizeof(CollapseItem), cmpCollapse);
+
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && !cmpCollapse(&items[i], &items[j]); j++);
+            if (j - i < 2) continue;
+
+            /* replace the lot with a rescan of their directory */
+            r = queueFind(queue, items[i].e->file, items[i].keyLen, 1);
+            if (r == NULL) {
+                file = malloc(items[i].keyLen + 1);
+                if (file == NULL) continue;
+                memcpy(file, items[i].e->file, items[i].keyLen);
+                file[items[i].keyLen] = 0;
+                r = queueAdd(queue, file, 1, now);
+                if (r == NULL) {
+                    free(file);
+                    continue;
+                }
+            }
+            for (k = i; k < j; k++) {
+                e = items[k].e;
+                if (e == r) continue;
+                if (e->first < r->first) r->first = e->first;
+                queueRemove(queue, e);
+                free(e->file);
+                free(e);
+                items[k].e = NULL;
+            }
+            queuePutOff(queue, r, now);
+        }
+
+        /* anything deeper under a new rescan is covered by it */
+        for (i = 0; i < n; i++) {
+            e = items[i].e;
+            if (e && queueRescanOf(queue, e->file, e->rescan)) {
+                queueRemove(queue, e);
+                free(e->file);
+                free(e);
+            }
+        }
+        free(items);
+    }
+}
+
+/* a delayed full sync that's come due is wanted now */
+static void queueFullSyncDue(NotifyQueue *queue, long long now)
+{
+    if (queue->fullSyncAt && queue->fullSyncAt <= now) {
+        queue->fullSync = 1;
+        queue->fullSyncAt = 0;
+    }
+}
+
+int queueInit(NotifyQueue *queue, int quiet, int maxDelay, size_t budget, const char *root)
+{
+    pthread_condattr_t attr;
+
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) return -1;
+    if (pthread_condattr_init(&attr) != 0) return -1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&queue->cond, &attr) != 0) return -1;
+    pthread_condattr_destroy(&attr);
+    queue->buckets = queue->heap = NULL;
+    queue->size = queue->count = queue->rescans = 0;
+    queue->bytes = 0;
+    queue->budget = budget;
+    queue->root = root;
+    queue->rootLen = strlen(root);
+    queue->quiet = quiet * 1000LL;
+    queue->maxDelay = maxDelay * 1000LL;
+    if (queue->maxDelay < queue->quiet) queue->maxDelay = queue->quiet;
+    queue->fullSyncAt = 0;
+    queue->fullSync = queue->fullSyncRunning = 0;
+    return 0;
+}
+
+/* Queue a path with the lock held. If copy is set, the path is the caller's,
+ * and is copied if it's kept; otherwise the queue takes it. */
+static int queuePushLocked(NotifyQueue *queue, char *file, int copy, long long now)
+{
+    QueueEntry *e;
+
+    /* if it's already present, or will be rescanned, put it off */
+    e = queueFind(queue, file, strlen(file), 0);
+    if (e == NULL) e = queueRescanOf(queue, file, 0);
+    if (e) {
+        queuePutOff(queue, e, now);
+        if (!copy) free(file);
+        return 0;
+    }
+
+    /* otherwise, add it */
+    if (copy && (file = strdup(file)) == NULL) {
+        queueLost(queue);
+        return 0;
+    }
+    if (queueAdd(queue, file, 0, now) == NULL) {
+        free(file);
+        queueLost(queue);
+        return 0;
+    }
+    if (queue->budget && queue->bytes > queue->budget)
+        queueCollapse(queue, now);
+    return 1;
+}
+
+int queuePush(NotifyQueue *queue, char *file)
+{
+    long long now = nowMs(), firstDue;
+    int ret;
+
+    pthread_mutex_lock(&queue->lock);
+    firstDue = queue->count ? queue->heap[0]->deadline : LLONG_MAX;
+
+    ret = queuePushLocked(queue, file, 0, now);
+
+    /* only wake the dispatcher if something is now due sooner */
+    if (queue->count && queue->heap[0]->deadline < firstDue)
+        pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+size_t queuePushBatch(NotifyQueue *queue, char **files, size_t count)
+{
+    long long now = nowMs(), firstDue;
+    size_t ret = 0, i;
+
+    if (!count) return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    firstDue = queue->count ? queue->heap[0]->deadline : LLONG_MAX;
+
+    for (i = 0; i < count; i++)
+        ret += queuePushLocked(queue, files[i], 1, now);
+
+    if (queue->count && queue->heap[0]->deadline < firstDue)
+        pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+void queueFullSync(NotifyQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->fullSync = 1;
+    queue->fullSyncAt = 0;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queueFullSyncAfter(NotifyQueue *queue, long long delay)
+{
+    long long due = nowMs() + delay;
+
+    if (delay <= 0) {
+        queueFullSync(queue);
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->fullSync && (!queue->fullSyncAt || due < queue->fullSyncAt)) {
+        queue->fullSyncAt = due;
+        pthread_cond_signal(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queueFullSyncDone(NotifyQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->fullSyncRunning = 0;
+    if (queue->fullSync)
+        pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queueRescan(NotifyQueue *queue, char *dir, int delay)
+{
+    QueueEntry *r, *e, *next;
+    long long now = nowMs(), due = now + delay;
+    size_t len = strlen(dir), b;
+
+    pthread_mutex_lock(&queue->lock);
+
+    r = queueRescanOf(queue, dir, 0);
+    if (r) {
+        free(dir);
+
+    } else {
+        r = queueAdd(queue, dir, 1, now);
+        if (r == NULL) {
+            free(dir);
+            queueLost(queue);
+            goto done;
+        }
+
+        /* anything under it is covered */
+        for (b = 0; b < queue->size; b++) {
+            for (e = queue->buckets[b]; e; e = next) {
+                next = e->hashNext;
+                if (e == r || strncmp(e->file, r->file, len)) continue;
+                if (e->file[len] == '/' || (!e->file[len] && !e->rescan)) {
+                    queueRemove(queue, e);
+                    free(e->file);
+                    free(e);
+                }
+            }
+        }
+    }
+
+    /* it's due no later than asked, and nothing puts it off past then */
+    if (r->first > due - queue->maxDelay)
+        r->first = due - queue->maxDelay;
+    if (r->deadline > due) {
+        r->deadline = due;
+        heapFix(queue, r->heapIdx);
+    }
+
+    if (queue->heap[0] == r)
+        pthread_cond_signal(&queue->cond);
+
+done:
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queueWait(NotifyQueue *queue)
+{
+    struct timespec ts;
+    long long deadline, now;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        now = nowMs();
+        queueFullSyncDue(queue, now);
+        if (queue->fullSync && !queue->fullSyncRunning) break;
+
+        deadline = queue->count ? queue->heap[0]->deadline : LLONG_MAX;
+        if (queue->fullSyncAt && queue->fullSyncAt < deadline)
+            deadline = queue->fullSyncAt;
+        if (deadline == LLONG_MAX) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+            continue;
+        }
+
+        if (deadline <= now) break;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+        pthread_cond_timedwait(&queue->cond, &queue->lock, &ts);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+QueueEntry *queueDrain(NotifyQueue *queue, int *fullSync)
+{
+    QueueEntry *ret = NULL, **tail = &ret, *e;
+    long long now = nowMs();
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count && queue->heap[0]->deadline <= now) {
+        e = queue->heap[0];
+        queueRemove(queue, e);
+
+        e->next = NULL;
+        *tail = e;
+        tail = &e->next;
+    }
+
+    /* only one full sync at a time, so later requests wait for it */
+    queueFullSyncDue(queue, now);
+    *fullSync = queue->fullSync && !queue->fullSyncRunning;
+    if (*fullSync) {
+        queue->fullSync = 0;
+        queue->fullSyncRunning = 1;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* a path waiting to be backed up, or a directory to be synced recursively */
+struct QueueEntry_ {
+    struct QueueEntry_ *next, *hashNext;
+    size_t hash, heapIdx;
+    long long first, deadline; /* monotonic milliseconds */
+    int rescan;
+    char *file;
+};
+typedef struct QueueEntry_ QueueEntry;
+
+/* The paths waiting to be backed up, each only once, ordered by when they
+ * should be: once they've been quiet for a while, but not too long after they
+ * first arrived. Also whether a full sync is wanted.
+ *
+ * If the entries take more than budget bytes, paths in the same directory are
+ * collapsed into a rescan of that directory, and then of its parent, and so
+ * on, until they take no more than half of it. Paths under a queued rescan
+ * aren't queued themselves. */
+struct NotifyQueue_ {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QueueEntry **buckets, **heap;
+    size_t size, count, rescans;
+    size_t bytes, budget;
+    const char *root; /* rescans never go above this */
+    size_t rootLen;
+    long long quiet, maxDelay;
+    long long fullSyncAt; /* when a delayed full sync is due, or 0 */
+    int fullSync, fullSyncRunning;
+};
+typedef struct NotifyQueue_ NotifyQueue;
+
+/* initialize a queue, with paths due quiet seconds after their last event, or
+ * maxDelay seconds after their first, whichever is sooner, and entries under
+ * root taking no more than budget bytes (0 for no limit) */
+int queueInit(NotifyQueue *queue, int quiet, int maxDelay, size_t budget, const char *root);
+
+/* queue a (malloc'd) path, which the queue takes. Returns 1 if it was queued,
+ * 0 if it was already there (and so has been put off) or there was no memory
+ * to queue it (and so a full sync is wanted instead). */
+int queuePush(NotifyQueue *queue, char *file);
+
+/* queue count paths at once, copying those that weren't already there, which
+ * are all it keeps. Returns how many were queued. */
+size_t queuePushBatch(NotifyQueue *queue, char **files, size_t count);
+
+/* ask for a full sync */
+void queueFullSync(NotifyQueue *queue);
+
+/* ask for a full sync delay milliseconds from now, unless one's due sooner */
+void queueFullSyncAfter(NotifyQueue *queue, long long delay);
+
+/* a full sync has finished, so another may start */
+void queueFullSyncDone(NotifyQueue *queue);
+
+/* Queue a (malloc'd) directory, which the queue takes, to be synced
+ * recursively delay milliseconds from now, ahead of anything that would
+ * otherwise put it off. */
+void queueRescan(NotifyQueue *queue, char *dir, int delay);
+
+/* wait until a path is due, or a full sync is wanted and none is running */
+void queueWait(NotifyQueue *queue);
+
+/* take every path that's due out of the queue, as a list in the order they
+ * came due, with rescan set on directories to sync recursively. The caller
+ * frees the entries and their paths. Sets fullSync if the caller should start
+ * a full sync, and call queueFullSyncDone when it's done. */
+QueueEntry *queueDrain(NotifyQueue *queue, int *fullSync);
+
+#endif
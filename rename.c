@@ -0,0 +1,365 @@
+/*
+ * rename.c: Tracking of renamed paths, so their history can be reused
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rename.h"
+
+/* a rename seen by notification, or found from an identity */
+struct RenameHint_ {
+    struct RenameHint_ *next;
+    char *path, *oldPath;
+    unsigned long gen;
+};
+typedef struct RenameHint_ RenameHint;
+
+/* a path known by its identity */
+struct RenameId_ {
+    struct RenameId_ *next;
+    dev_t dev;
+    ino_t ino;
+    mode_t type;
+    off_t size;
+    struct timespec mtime;
+    char *path;
+};
+typedef struct RenameId_ RenameId;
+
+/* hash tables of each, which grow to keep about one entry per bucket */
+struct HintTable_ {
+    size_t size, count;
+    RenameHint **buckets;
+};
+typedef struct HintTable_ HintTable;
+
+struct IdTable_ {
+    size_t size, count;
+    RenameId **buckets;
+};
+typedef struct IdTable_ IdTable;
+
+#define RENAME_TABLE_MIN 64
+
+static pthread_mutex_t renameLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long generation = 0;
+static HintTable hints;
+
+/* identities seen since the last full sync ended, and during that sync. If
+ * the current generation fills up, the older one is forgotten early. */
+static IdTable ids[2];
+static int curIds = 0;
+
+/* classic (Bernstein) hash */
+static size_t hashPath(const char *str)
+{
+    size_t hash = 5381;
+    int c;
+
+    while ((c = (unsigned char) *str++))
+        hash = ((hash << 5) + hash) ^ c; /* hash * 33 ^ c */
+
+    return hash;
+}
+
+static size_t hashId(dev_t dev, ino_t ino)
+{
+    unsigned long long h = ((unsigned long long) dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+/* find a hint by its (new) path */
+static RenameHint *hintFind(const char *path)
+{
+    RenameHint *h;
+    if (!hints.size) return NULL;
+    for (h = hints.buckets[hashPath(path) & (hints.size - 1)]; h; h = h->next)
+        if (!strcmp(h->path, path)) return h;
+    return NULL;
+}
+
+/* grow a table if it's getting full. Returns 0 on success. */
+static int hintGrow(void)
+{
+    RenameHint **buckets, *h, *next;
+    size_t size, i, b;
+
+    if (hints.count < hints.size) return 0;
+    size = hints.size ? hints.size * 2 : RENAME_TABLE_MIN;
+    buckets = calloc(size, sizeof(RenameHint *));
+    if (buckets == NULL) return hints.size ? 0 : -1;
+
+    for (i = 0; i < hints.size; i++) {
+        for (h = hints.buckets[i]; h; h = next) {
+            next = h->next;
+            b = hashPath(h->path) & (size - 1);
+            h->next = buckets[b];
+            buckets[b] = h;
+        }
+    }
+    free(hints.buckets);
+    hints.buckets = buckets;
+    hints.size = size;
+    return 0;
+}
+
+static int idGrow(IdTable *table)
+{
+    RenameId **buckets, *id, *next;
+    size_t size, i, b;
+
+    if (table->count < table->size) return 0;
+    size = table->size ? table->size * 2 : RENAME_TABLE_MIN;
+    buckets = calloc(size, sizeof(RenameId *));
+    if (buckets == NULL) return table->size ? 0 : -1;
+
+    for (i = 0; i < table->size; i++) {
+        for (id = table->buckets[i]; id; id = next) {
+            next = id->next;
+            b = hashId(id->dev, id->ino) & (size - 1);
+            id->next = buckets[b];
+            buckets[b] = id;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+    return 0;
+}
+
+/* find an identity */
+static RenameId *idFind(IdTable *table, dev_t dev, ino_t ino)
+{
+    RenameId *id;
+    if (!table->size) return NULL;
+    for (id = table->buckets[hashId(dev, ino) & (table->size - 1)]; id; id = id->next)
+        if (id->dev == dev && id->ino == ino) return id;
+    return NULL;
+}
+
+/* is this identity still the file st describes? */
+static int idMatch(RenameId *id, const struct stat *st)
+{
+    if (id->type != (st->st_mode & S_IFMT)) return 0;
+    if (S_ISDIR(st->st_mode)) return 1;
+    return id->size == st->st_size &&
+           id->mtime.tv_sec == st->st_mtim.tv_sec &&
+           id->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void idSet(RenameId *id, const struct stat *st)
+{
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->type = st->st_mode & S_IFMT;
+    id->size = st->st_size;
+    id->mtime = st->st_mtim;
+}
+
+/* forget the older generation of identities, and start a new one */
+static void idRotate(void)
+{
+    RenameId *id, *next;
+    IdTable *old;
+    size_t i;
+
+    curIds = !curIds;
+    old = &ids[curIds];
+    for (i = 0; i < old->size; i++) {
+        for (id = old->buckets[i]; id; id = next) {
+            next = id->next;
+            free(id->path);
+            free(id);
+        }
+    }
+    free(old->buckets);
+    old->buckets = NULL;
+    old->size = old->count = 0;
+}
+
+/* path was renamed from oldPath */
+void renameHint(const char *path, const char *oldPath)
+{
+    RenameHint *h;
+    char *oldDup;
+    size_t b;
+
+    if (!strcmp(path, oldPath)) return;
+    oldDup = strdup(oldPath);
+    if (oldDup == NULL) return;
+
+    pthread_mutex_lock(&renameLock);
+
+    if ((h = hintFind(path))) {
+        /* renamed again, so the latest is what matters */
+        free(h->oldPath);
+        h->oldPath = oldDup;
+        h->gen = generation;
+
+    } else if (hintGrow() == 0 && (h = malloc(sizeof(RenameHint)))) {
+        h->path = strdup(path);
+        if (h->path == NULL) {
+            free(h);
+            free(oldDup);
+        } else {
+            h->oldPath = oldDup;
+            h->gen = generation;
+            b = hashPath(path) & (hints.size - 1);
+            h->next = hints.buckets[b];
+            hints.buckets[b] = h;
+            hints.count++;
+        }
+
+    } else {
+        free(oldDup);
+
+    }
+
+    pthread_mutex_unlock(&renameLock);
+}
+
+/* path is the file st describes */
+void renameSeen(const struct stat *st, const char *path)
+{
+    IdTable *table;
+    RenameId *id;
+    char *pathDup;
+    size_t b;
+
+    pthread_mutex_lock(&renameLock);
+    table = &ids[curIds];
+
+    if ((id = idFind(table, st->st_dev, st->st_ino))) {
+        idSet(id, st);
+        if (strcmp(id->path, path) && (pathDup = strdup(path))) {
+            free(id->path);
+            id->path = pathDup;
+        }
+
+    } else {
+        if (table->count >= RENAME_MAX_IDS) {
+            idRotate();
+            table = &ids[curIds];
+        }
+        if (idGrow(table) != 0 || (id = malloc(sizeof(RenameId))) == NULL)
+            goto done;
+        id->path = strdup(path);
+        if (id->path == NULL) {
+            free(id);
+        } else {
+            idSet(id, st);
+            b = hashId(id->dev, id->ino) & (table->size - 1);
+            id->next = table->buckets[b];
+            table->buckets[b] = id;
+            table->count++;
+        }
+
+    }
+
+done:
+    pthread_mutex_unlock(&renameLock);
+}
+
+/* find where path may have been renamed from, or another link to it */
+char *renameSource(const char *path, const struct stat *st, int renamed)
+{
+    RenameHint *h;
+    RenameId *id;
+    char *prefix, *slash, *ret = NULL;
+    size_t len;
+    int i;
+
+    prefix = strdup(path);
+    if (prefix == NULL) return NULL;
+    len = strlen(prefix);
+
+    pthread_mutex_lock(&renameLock);
+
+    /* a hint for this path, or for its closest renamed ancestor */
+    while (renamed) {
+        if ((h = hintFind(prefix))) {
+            ret = malloc(strlen(h->oldPath) + strlen(path + len) + 1);
+            if (ret) sprintf(ret, "%s%s", h->oldPath, path + len);
+            break;
+        }
+        slash = strrchr(prefix, '/');
+        if (!slash) break;
+        *slash = 0;
+        len = slash - prefix;
+    }
+
+    /* or something else we've seen with the same identity */
+    if (!ret && st->st_ino) {
+        for (i = 0; i < 2; i++) {
+            id = idFind(&ids[(curIds + i) % 2], st->st_dev, st->st_ino);
+            if (id) {
+                if (strcmp(id->path, path) && idMatch(id, st))
+                    ret = strdup(id->path);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&renameLock);
+
+    free(prefix);
+    return ret;
+}
+
+/* a full sync is starting */
+unsigned long renameSyncStart(void)
+{
+    unsigned long gen;
+    pthread_mutex_lock(&renameLock);
+    gen = generation++;
+    pthread_mutex_unlock(&renameLock);
+    return gen;
+}
+
+/* a full sync is done */
+void renameSyncEnd(unsigned long gen)
+{
+    RenameHint **hp, *h;
+    size_t i;
+
+    pthread_mutex_lock(&renameLock);
+
+    /* forget the hints it covered */
+    for (i = 0; i < hints.size; i++) {
+        for (hp = &hints.buckets[i]; (h = *hp);) {
+            if ((long) (h->gen - gen) <= 0) {
+                *hp = h->next;
+                free(h->path);
+                free(h->oldPath);
+                free(h);
+                hints.count--;
+            } else {
+                hp = &h->next;
+            }
+        }
+    }
+
+    /* and the identities from before it */
+    idRotate();
+
+    pthread_mutex_unlock(&renameLock);
+}
@@ -0,0 +1,33 @@
+#ifndef RENAME_H
+#define RENAME_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* only files at least this big are worth remembering by identity */
+#define RENAME_MIN_SIZE (64*1024)
+
+/* at most this many identities are remembered per full sync */
+#define RENAME_MAX_IDS 32768
+
+/* path (relative to the source) was renamed from oldPath */
+void renameHint(const char *path, const char *oldPath);
+
+/* path (relative to the source) is the file st describes */
+void renameSeen(const struct stat *st, const char *path);
+
+/* Find where path may have been renamed from if it has no history, or if it
+ * has (renamed is 0), another link to it. A file found only by its identity
+ * must still have the same size and mtime, to the nanosecond, so a reused
+ * inode isn't mistaken for it. Returns a malloc'd path relative to the
+ * source, or NULL. */
+char *renameSource(const char *path, const struct stat *st, int renamed);
+
+/* a full sync is starting. Returns its generation. */
+unsigned long renameSyncStart(void);
+
+/* A full sync is done, so every rename hinted before it started has been
+ * dealt with, and identities from before it are stale. */
+void renameSyncEnd(unsigned long gen);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+struct Sha256_ {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t bufUsed;
+};
+typedef struct Sha256_ Sha256;
+
+void sha256Init(Sha256 *ctx);
+void sha256Update(Sha256 *ctx, const unsigned char *data, size_t len);
+void sha256Final(Sha256 *ctx, unsigned char out[SHA256_SIZE]);
+
+/* hash a whole buffer */
+void sha256(const unsigned char *data, size_t len, unsigned char out[SHA256_SIZE]);
+
+#endif
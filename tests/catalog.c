@@ -0,0 +1,146 @@
+/*
+ * catalog.c: Round-trip tests of the catalog
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../catalog.h"
+#include "../helpers.h"
+#include "../metadata.h"
+#include "test.h"
+
+/* the records every test starts from. The last is written after the clock
+ * stepped back. */
+#define REC(p, i, t, s, ty, c) \
+    {.path = p, .incr = i, .time = t, .size = s, .type = ty, .codec = c}
+static CatalogRecord records[] = {
+    REC("a/x", 1, 100, 10, MD_TYPE_FILE, CATALOG_CODEC_NONE),
+    REC("ab", 1, 200, 20, MD_TYPE_FILE, CATALOG_CODEC_NONE),
+    REC("a", 1, 300, 0, MD_TYPE_DIRECTORY, CATALOG_CODEC_NONE),
+    REC("a/x", 2, 400, 11, MD_TYPE_FILE, CATALOG_CODEC_BSDIFF),
+    REC("a/x", 3, 150, 12, MD_TYPE_FILE, CATALOG_CODEC_CHUNKS)
+};
+#define RECORDS (sizeof(records) / sizeof(records[0]))
+
+/* what a scan saw */
+struct Seen_ {
+    int count, stopAt;
+    CatalogRecord recs[RECORDS];
+    char paths[RECORDS][8];
+};
+typedef struct Seen_ Seen;
+
+static int see(CatalogRecord *rec, void *arg)
+{
+    Seen *seen = arg;
+    int i = seen->count++;
+
+    seen->recs[i] = *rec;
+    strcpy(seen->paths[i], rec->path);
+    seen->recs[i].path = seen->paths[i];
+    return seen->count == seen->stopAt;
+}
+
+static int same(CatalogRecord *l, CatalogRecord *r)
+{
+    return !strcmp(l->path, r->path) && l->incr == r->incr &&
+        l->time == r->time && l->size == r->size && l->type == r->type &&
+        l->codec == r->codec;
+}
+
+static int scan(int dirfd, long long offset, long long from, long long to,
+    const char *prefix, int stopAt, Seen *seen, long long *until)
+{
+    memset(seen, 0, sizeof(Seen));
+    seen->stopAt = stopAt;
+    return catalogScan(dirfd, offset, from, to, prefix, see, seen, until);
+}
+
+int main()
+{
+    int dirfd, fd;
+    size_t i;
+    long long until, end;
+    CatalogReader rd;
+    CatalogRecord rec;
+    Seen seen;
+
+    dirfd = testDir();
+    SF(fd, catalogOpen, -1, (dirfd));
+    for (i = 0; i < RECORDS; i++)
+        CHECK(catalogAppend(fd, &records[i]) == 0);
+    end = lseek(fd, 0, SEEK_END);
+
+    /* everything comes back as written, in order */
+    CHECK(catalogReaderOpen(&rd, dirfd, 0) == 0);
+    for (i = 0; i < RECORDS; i++) {
+        CHECK(catalogRead(&rd, &rec) == 1);
+        CHECK(same(&rec, &records[i]));
+        if (i == 0) CHECK(rec.offset == 0);
+        if (i == RECORDS - 1) CHECK(rec.next == end);
+    }
+    CHECK(catalogRead(&rd, &rec) == 0);
+    catalogReaderClose(&rd);
+
+    /* a prefix is a whole path component */
+    CHECK(scan(dirfd, 0, 0, 1000, "a", 0, &seen, NULL) == 0);
+    CHECK(seen.count == 4);
+    for (i = 0; i < 4; i++)
+        CHECK(strcmp(seen.recs[i].path, "ab"));
+
+    /* a time window sees the record from after the clock went back, and
+     * until is the first record it had to leave */
+    CHECK(scan(dirfd, 0, 100, 300, NULL, 0, &seen, &until) == 0);
+    CHECK(seen.count == 3);
+    CHECK(same(&seen.recs[0], &records[0]));
+    CHECK(same(&seen.recs[1], &records[1]));
+    CHECK(same(&seen.recs[2], &records[4]));
+    CHECK(catalogReaderOpen(&rd, dirfd, until) == 0);
+    CHECK(catalogRead(&rd, &rec) == 1);
+    CHECK(same(&rec, &records[2]));
+    catalogReaderClose(&rd);
+
+    /* from is inclusive */
+    CHECK(scan(dirfd, 0, 300, 1000, NULL, 0, &seen, &until) == 0);
+    CHECK(seen.count == 2);
+    CHECK(until == end);
+
+    /* a scan stopped by its callback resumes after the last record seen */
+    CHECK(scan(dirfd, 0, 0, 1000, NULL, 2, &seen, &until) == 0);
+    CHECK(seen.count == 2);
+    CHECK(until == seen.recs[1].next);
+    CHECK(scan(dirfd, until, 0, 1000, NULL, 0, &seen, NULL) == 0);
+    CHECK(seen.count == RECORDS - 2);
+    CHECK(same(&seen.recs[0], &records[2]));
+
+    /* a torn record doesn't hide the ones after it */
+    CHECK(write(fd, "ACIN\1\2\3", 7) == 7);
+    CHECK(catalogAppend(fd, &records[0]) == 0);
+    CHECK(scan(dirfd, end, 0, 1000, NULL, 0, &seen, &until) == 0);
+    CHECK(seen.count == 1);
+    CHECK(same(&seen.recs[0], &records[0]));
+    CHECK(until == lseek(fd, 0, SEEK_END));
+
+    close(fd);
+    close(dirfd);
+    return testResult("catalog");
+}
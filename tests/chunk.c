@@ -0,0 +1,163 @@
+/*
+ * chunk.c: Round-trip tests of the chunk store
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../buffer.h"
+#include "../chunk.h"
+#include "test.h"
+
+#define FILE_SIZE (1024*1024)
+#define MAX_CHUNKS (FILE_SIZE / CHUNK_MIN_SIZE + 2)
+
+/* a chunk list, as read back */
+struct ChunkList_ {
+    int count;
+    Chunk chunks[MAX_CHUNKS];
+};
+typedef struct ChunkList_ ChunkList;
+
+static int listCb(Chunk *chunk, void *arg)
+{
+    ChunkList *list = arg;
+    if (list->count >= MAX_CHUNKS) return 1;
+    list->chunks[list->count++] = *chunk;
+    return 0;
+}
+
+/* store content, check it comes back both ways, and return its chunk list */
+static void roundTrip(int dirfd, int storeFd, const unsigned char *buf, size_t len,
+    ChunkList *list)
+{
+    struct Buffer_char out;
+    struct stat sbuf;
+    unsigned char *back;
+    size_t total = 0;
+    int fd, i;
+
+    SF(fd, openat, -1, (dirfd, "in", O_RDWR | O_CREAT | O_TRUNC, 0600));
+    CHECK(write(fd, buf, len) == len);
+    CHECK(chunkStoreFile(storeFd, fd, dirfd, "in.chl") == 0);
+    close(fd);
+
+    /* every chunk but the last is in bounds, and they add up */
+    list->count = 0;
+    CHECK(chunkListRead(dirfd, "in.chl", listCb, list) == 0);
+    for (i = 0; i < list->count; i++) {
+        CHECK(list->chunks[i].size <= CHUNK_MAX_SIZE);
+        if (i < list->count - 1) CHECK(list->chunks[i].size >= CHUNK_MIN_SIZE);
+        total += list->chunks[i].size;
+    }
+    CHECK(total == len);
+
+    INIT_BUFFER(out);
+    CHECK(chunkLoad(storeFd, dirfd, "in.chl", &out) == 0);
+    CHECK(out.bufused == len && !memcmp(out.buf, buf, len));
+    FREE_BUFFER(out);
+
+    CHECK(chunkRestore(storeFd, dirfd, "in.chl", dirfd, "out") == 0);
+    SF(fd, openat, -1, (dirfd, "out", O_RDONLY));
+    CHECK(fstat(fd, &sbuf) == 0 && sbuf.st_size == len);
+    SF(back, malloc, NULL, (len + 1));
+    CHECK(read(fd, back, len + 1) == len && !memcmp(back, buf, len));
+    free(back);
+    close(fd);
+}
+
+/* how many of b's chunks are also in a */
+static int shared(ChunkList *a, ChunkList *b)
+{
+    int i, j, ret = 0;
+
+    for (i = 0; i < b->count; i++) {
+        for (j = 0; j < a->count; j++) {
+            if (!memcmp(a->chunks[j].hash, b->chunks[i].hash, SHA256_SIZE)) {
+                ret++;
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+int main()
+{
+    static ChunkList first, second;
+    unsigned char *buf, *edited;
+    char name[CHUNK_NAME_SIZE];
+    struct Buffer_char out;
+    int dirfd, storeFd, fd;
+
+    dirfd = testDir();
+    CHECK(chunkStoreOpen(dirfd, 0) == -1);
+    SF(storeFd, chunkStoreOpen, -1, (dirfd, 1));
+    SF(buf, malloc, NULL, (FILE_SIZE));
+    SF(edited, malloc, NULL, (FILE_SIZE + 100));
+    testNoise(buf, FILE_SIZE, 2);
+
+    roundTrip(dirfd, storeFd, buf, 0, &first);
+    CHECK(first.count == 0);
+    roundTrip(dirfd, storeFd, buf, 100, &first);
+    CHECK(first.count == 1);
+
+    roundTrip(dirfd, storeFd, buf, FILE_SIZE, &first);
+    CHECK(first.count > FILE_SIZE / CHUNK_MAX_SIZE);
+
+    /* an insertion only changes the chunks around it */
+    memcpy(edited, buf, FILE_SIZE / 2);
+    testNoise(edited + FILE_SIZE / 2, 100, 3);
+    memcpy(edited + FILE_SIZE / 2 + 100, buf + FILE_SIZE / 2, FILE_SIZE / 2);
+    roundTrip(dirfd, storeFd, edited, FILE_SIZE + 100, &second);
+    CHECK(shared(&first, &second) >= second.count - 2);
+
+    /* zeroes come back, from holes */
+    memset(edited + 100000, 0, 300000);
+    roundTrip(dirfd, storeFd, edited, FILE_SIZE + 100, &second);
+
+    /* storing over a list doesn't write through a link to it */
+    CHECK(linkat(dirfd, "in.chl", dirfd, "linked.chl", 0) == 0);
+    roundTrip(dirfd, storeFd, buf, FILE_SIZE, &first);
+    second.count = 0;
+    CHECK(chunkListRead(dirfd, "linked.chl", listCb, &second) == 0);
+    CHECK(shared(&first, &second) < second.count);
+    roundTrip(dirfd, storeFd, edited, FILE_SIZE + 100, &second);
+
+    /* a damaged chunk is noticed */
+    fprintf(stderr, "damaged chunk (complaints of a corrupt chunk are expected):\n");
+    chunkName(second.chunks[0].hash, name);
+    SF(fd, openat, -1, (storeFd, name, O_WRONLY));
+    CHECK(write(fd, "damage", 6) == 6);
+    close(fd);
+    INIT_BUFFER(out);
+    CHECK(chunkLoad(storeFd, dirfd, "in.chl", &out) != 0);
+    FREE_BUFFER(out);
+    CHECK(chunkRestore(storeFd, dirfd, "in.chl", dirfd, "out") != 0);
+
+    free(buf);
+    free(edited);
+    close(storeFd);
+    close(dirfd);
+    return testResult("chunk");
+}
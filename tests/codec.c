@@ -0,0 +1,153 @@
+/*
+ * codec.c: Round-trip tests of the delta codecs
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../buffer.h"
+#include "../codec.h"
+#include "test.h"
+
+/* bigger than one vcdiff window */
+#define BIG_SIZE ((1<<23) + (1<<20))
+
+/* make a patch from from to to and check it gives back to. Returns the
+ * patch's size. */
+static size_t roundTrip(const Codec *codec, const unsigned char *from, size_t fromSz,
+    const unsigned char *to, size_t toSz)
+{
+    struct Buffer_char patch, out;
+    size_t ret;
+
+    INIT_BUFFER(patch);
+    INIT_BUFFER(out);
+
+    CHECK(codec->encode(from, fromSz, to, toSz, &patch) == 0);
+    CHECK(codecDecode(codec, from, fromSz, (unsigned char *) patch.buf,
+        patch.bufused, &out) == 0);
+    CHECK(out.bufused == toSz);
+    CHECK(out.bufused == toSz && !memcmp(out.buf, to, toSz));
+
+    /* a patch cut short is an error, not a crash or a wrong answer */
+    if (patch.bufused > 1) {
+        out.bufused = 0;
+        CHECK(codec->decode(from, fromSz, (unsigned char *) patch.buf,
+            patch.bufused / 2, &out) != 0);
+    }
+
+    ret = patch.bufused;
+    FREE_BUFFER(patch);
+    FREE_BUFFER(out);
+    return ret;
+}
+
+/* write a buffer to a new file */
+static int makeFile(int dirfd, const char *name, const unsigned char *buf, size_t len)
+{
+    int fd;
+
+    SF(fd, openat, -1, (dirfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600));
+    CHECK(write(fd, buf, len) == len);
+    return fd;
+}
+
+/* the same through files, patching from in place as restore does */
+static void roundTripFd(const Codec *codec, int dirfd, const unsigned char *from,
+    size_t fromSz, const unsigned char *to, size_t toSz)
+{
+    int fromFd, toFd, patchFd;
+    unsigned char *out;
+
+    fromFd = makeFile(dirfd, "from", from, fromSz);
+    toFd = makeFile(dirfd, "to", to, toSz);
+    patchFd = makeFile(dirfd, "patch", NULL, 0);
+
+    CHECK(codecEncodeFd(codec, fromFd, toFd, patchFd) == 0);
+    CHECK(codecDecodeFd(codec, fromFd, patchFd, fromFd) == 0);
+
+    out = malloc(toSz + 1);
+    CHECK(out != NULL);
+    if (out) {
+        CHECK(pread(fromFd, out, toSz + 1, 0) == toSz);
+        CHECK(!memcmp(out, to, toSz));
+        free(out);
+    }
+
+    close(fromFd);
+    close(toFd);
+    close(patchFd);
+}
+
+int main()
+{
+    const Codec *const *cp;
+    const Codec *codec;
+    unsigned char *from, *to;
+    size_t toSz, patchSz;
+    int dirfd;
+
+    dirfd = testDir();
+    SF(from, malloc, NULL, (BIG_SIZE));
+    SF(to, malloc, NULL, (BIG_SIZE + 4096));
+    testNoise(from, BIG_SIZE, 1);
+
+    /* an edited copy: a change, an insertion, a deletion and a run */
+    memcpy(to, from, 100000);
+    to[5000] ^= 0xFF;
+    memcpy(to + 100000, "inserted", 8);
+    memcpy(to + 100008, from + 100000, 100000);
+    memmove(to + 150000, to + 160000, 50008);
+    toSz = 190008;
+    memset(to + 20000, 0, 4096);
+
+    for (cp = codecs; (codec = *cp); cp++) {
+        fprintf(stderr, "%s (complaints of corrupt patches are expected):\n",
+            codec->name);
+
+        CHECK(codecByExt(codec->ext) == codec);
+
+        roundTrip(codec, from, 0, to, 0);
+        roundTrip(codec, from, 0, to, 1000);
+        roundTrip(codec, from, 1000, to, 0);
+        patchSz = roundTrip(codec, from, 200000, from, 200000);
+        CHECK(patchSz < 2000);
+        patchSz = roundTrip(codec, from, 200000, to, toSz);
+        CHECK(patchSz < 20000);
+        roundTrip(codec, from, 200000, from + 1, 100000);
+
+        roundTripFd(codec, dirfd, from, 200000, to, toSz);
+        roundTripFd(codec, dirfd, from, 200000, from, 1000);
+    }
+
+    /* more than a window, with a block moved to the end and more after it */
+    memcpy(to, from, BIG_SIZE);
+    memcpy(to + BIG_SIZE - 190008, to, 190008);
+    memcpy(to + BIG_SIZE, "appended", 8);
+    patchSz = roundTrip(&codecVcdiff, from, BIG_SIZE, to, BIG_SIZE + 8);
+    CHECK(patchSz < 50000);
+
+    free(from);
+    free(to);
+    close(dirfd);
+    return testResult("codec");
+}
@@ -0,0 +1,219 @@
+/*
+ * history.c: Round-trip tests of histories, packed and not
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../history.h"
+#include "test.h"
+
+#define INCRS 5
+
+/* the metadata of each test increment */
+static void incrMetadata(BackupMetadata *meta, unsigned long long incr)
+{
+    memset(meta, 0, sizeof(BackupMetadata));
+    meta->type = (incr == 3) ? MD_TYPE_NONEXIST : MD_TYPE_FILE;
+    meta->mode = S_IFREG | 0644;
+    meta->uid = 1000;
+    meta->gid = 1000 + incr;
+    meta->size = incr * 1000;
+    meta->mtime = incr * 100;
+    meta->ctime = incr * 100 + 1;
+    meta->linkId = (incr == 4) ? 0x1234 : 0;
+}
+
+/* set an increment's time in the index, so searches have something to find */
+static void setTime(History *h, unsigned long long incr, long long time)
+{
+    unsigned char buf[8];
+    off_t off = h->packed ?
+        incr * HISTORY_RECORD_SIZE + MD_RECORD_SIZE :
+        HISTORY_COUNTER_SIZE + (incr - 1) * 8;
+
+    putLE(buf, time, 8);
+    CHECK(pwrite(h->fd, buf, 8, off) == 8);
+}
+
+/* the increments historyEach saw */
+struct Seen_ {
+    int count;
+    unsigned long long incrs[INCRS];
+};
+typedef struct Seen_ Seen;
+
+static int see(History *h, unsigned long long incr, void *arg)
+{
+    Seen *seen = arg;
+    if (seen->count < INCRS) seen->incrs[seen->count] = incr;
+    seen->count++;
+    return 0;
+}
+
+static void roundTrip(int dirfd, int how)
+{
+    History h;
+    BackupMetadata meta, back;
+    unsigned char content[HISTORY_INLINE_MAX + 1], inlined[HISTORY_INLINE_MAX];
+    unsigned long long incr;
+    long long t, last = 0;
+    int packed = (how == HISTORY_CREATE_PACKED);
+    Seen seen;
+
+    CHECK(historyOpen(&h, dirfd, "file", LOCK_EX, HISTORY_OPEN) == -1 &&
+        errno == ENOENT);
+
+    CHECK(historyOpen(&h, dirfd, "file", LOCK_EX, how) == 0);
+    CHECK(h.packed == packed);
+    CHECK(h.cur == 0);
+    CHECK(historyFind(&h, 1LL << 40) == 0);
+    for (incr = 1; incr <= INCRS; incr++) {
+        incrMetadata(&meta, incr);
+        CHECK(historyPut(&h, incr, &meta, NULL, 0) == 0);
+        CHECK(historySetCurrent(&h, incr) == 0);
+    }
+    historyClose(&h);
+
+    /* it all comes back, with times that only go up */
+    CHECK(historyOpen(&h, dirfd, "file", LOCK_EX, HISTORY_OPEN) == 0);
+    CHECK(h.packed == packed);
+    CHECK(h.cur == INCRS);
+    for (incr = 1; incr <= INCRS; incr++) {
+        incrMetadata(&meta, incr);
+        CHECK(historyGet(&h, incr, &back, &t) == 0);
+        CHECK(!cmpMetadata(&meta, &back));
+        CHECK(back.linkId == meta.linkId);
+        CHECK(t >= last);
+        last = t;
+    }
+    CHECK(historyGet(&h, INCRS + 1, &back, NULL) == -1);
+    CHECK(back.type == MD_TYPE_NONEXIST);
+
+    /* searches by time */
+    for (incr = 1; incr <= INCRS; incr++)
+        setTime(&h, incr, incr * 100);
+    CHECK(historyFind(&h, 99) == 0);
+    CHECK(historyFind(&h, 100) == 1);
+    CHECK(historyFind(&h, 250) == 2);
+    CHECK(historyFind(&h, INCRS * 100) == INCRS);
+    CHECK(historyFind(&h, 1LL << 40) == INCRS);
+
+    /* purged increments are gone, and so is anything current while they were */
+    CHECK(historyDrop(&h, 1) == 0);
+    CHECK(historyDrop(&h, 2) == 0);
+    CHECK(historyGet(&h, 2, &back, &t) == -1 && errno == ENOENT);
+    CHECK(back.type == MD_TYPE_NONEXIST);
+    CHECK(historyFind(&h, 250) == 0);
+    CHECK(historyFind(&h, 300) == 3);
+
+    memset(&seen, 0, sizeof(seen));
+    CHECK(historyEach(&h, 4, see, &seen) == 0);
+    CHECK(seen.count == 2 && seen.incrs[0] == 3 && seen.incrs[1] == 4);
+
+    /* only packed records have room for content */
+    testNoise(content, sizeof(content), 4);
+    incrMetadata(&meta, INCRS + 1);
+    CHECK(historyPut(&h, INCRS + 1, &meta, content, HISTORY_INLINE_MAX) == 0);
+    CHECK(historyInline(&h, INCRS + 1, inlined) == (packed ? HISTORY_INLINE_MAX : -1));
+    if (packed) {
+        CHECK(!memcmp(content, inlined, HISTORY_INLINE_MAX));
+        CHECK(historyPut(&h, INCRS + 2, &meta, content, HISTORY_INLINE_MAX + 1) == -1 &&
+            errno == EINVAL);
+    }
+    CHECK(historyInline(&h, 3, inlined) == -1);
+    CHECK(historySetCurrent(&h, INCRS + 1) == 0);
+
+    /* a history is only removed once everything's dropped */
+    if (packed) CHECK(historyRemove(&h) == -1);
+    for (incr = 3; incr <= INCRS + 1; incr++)
+        CHECK(historyDrop(&h, incr) == 0);
+    memset(&seen, 0, sizeof(seen));
+    CHECK(historyEach(&h, INCRS + 1, see, &seen) == 0);
+    CHECK(seen.count == 0);
+    CHECK(historyRemove(&h) == 0);
+    historyClose(&h);
+    CHECK(historyOpen(&h, dirfd, "file", LOCK_EX, HISTORY_OPEN) == -1 &&
+        errno == ENOENT);
+    CHECK(faccessat(dirfd, "niifile", F_OK, 0) == -1);
+    CHECK(faccessat(dirfd, "nihfile", F_OK, 0) == -1);
+    CHECK(faccessat(dirfd, "nimfile", F_OK, 0) == -1);
+}
+
+/* an increment file from before the index is indexed by its metadata's
+ * mtimes when next written */
+static void unindexed(int dirfd)
+{
+    History h;
+    BackupMetadata meta;
+    struct timespec times[2];
+    char name[32];
+    unsigned long long incr;
+    long long t;
+    int fd;
+
+    CHECK(mkdirat(dirfd, "nimold", 0700) == 0);
+    for (incr = 1; incr <= 2; incr++) {
+        incrMetadata(&meta, incr);
+        sprintf(name, "nimold/%llu.met", incr);
+        CHECK(writeMetadata(&meta, dirfd, name) == 0);
+        times[0].tv_sec = times[1].tv_sec = incr * 100;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        CHECK(utimensat(dirfd, name, times, 0) == 0);
+    }
+    fd = openat(dirfd, "niiold", O_WRONLY | O_CREAT, 0600);
+    CHECK(fd >= 0 && write(fd, "2", 1) == 1);
+    close(fd);
+
+    CHECK(historyOpen(&h, dirfd, "old", LOCK_EX, HISTORY_CREATE) == 0);
+    CHECK(!h.packed && h.cur == 2);
+    CHECK(historyGet(&h, 1, NULL, &t) == 0 && t == 100);
+    CHECK(historyFind(&h, 150) == 1);
+
+    incrMetadata(&meta, 3);
+    CHECK(historyPut(&h, 3, &meta, NULL, 0) == 0);
+    CHECK(historySetCurrent(&h, 3) == 0);
+    CHECK(historyFind(&h, 150) == 1);
+    CHECK(historyFind(&h, 200) == 2);
+    CHECK(historyGet(&h, 3, NULL, &t) == 0 && t > 200);
+    historyClose(&h);
+}
+
+int main()
+{
+    int dirfd;
+
+    dirfd = testDir();
+    CHECK(historyPackedStore(dirfd, 0) == 0);
+    CHECK(historyPackedStore(dirfd, 1) == 1);
+    CHECK(historyPackedStore(dirfd, 0) == 1);
+
+    roundTrip(dirfd, HISTORY_CREATE);
+    roundTrip(dirfd, HISTORY_CREATE_PACKED);
+    unindexed(dirfd);
+
+    close(dirfd);
+    return testResult("history");
+}
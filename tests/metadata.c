@@ -0,0 +1,132 @@
+/*
+ * metadata.c: Round-trip tests of serialized metadata
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../helpers.h"
+#include "../metadata.h"
+#include "test.h"
+
+/* every field, linkId included */
+static int same(BackupMetadata *l, BackupMetadata *r)
+{
+    return !cmpMetadata(l, r) && l->linkId == r->linkId;
+}
+
+/* write a file's content */
+static void makeFile(int dirfd, const char *name, const char *content)
+{
+    int fd;
+
+    SF(fd, openat, -1, (dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0600));
+    CHECK(write(fd, content, strlen(content)) == strlen(content));
+    close(fd);
+}
+
+int main()
+{
+    BackupMetadata meta, back, other;
+    unsigned char buf[MD_RECORD_SIZE];
+    int dirfd, fd;
+
+    dirfd = testDir();
+
+    /* fields at their extremes come back from a record */
+    memset(&meta, 0, sizeof(meta));
+    meta.type = MD_TYPE_FILE;
+    meta.mode = S_IFREG | 04755;
+    meta.uid = -2;
+    meta.gid = 65534;
+    meta.size = 5LL << 32;
+    meta.mtime = -86400;
+    meta.ctime = 1LL << 40;
+    meta.linkId = 0xDEADBEEF;
+    encodeMetadata(&meta, buf);
+    CHECK(!memcmp(buf, MD_MAGIC, 3) && buf[3] == MD_VERSION);
+    CHECK(decodeMetadata(&back, buf) == 0);
+    CHECK(same(&meta, &back));
+
+    /* a version 1 record has no linkId */
+    buf[3] = 1;
+    CHECK(decodeMetadata(&back, buf) == 0);
+    CHECK(!cmpMetadata(&meta, &back));
+    CHECK(back.linkId == MD_LINK_UNKNOWN);
+
+    /* but anything else isn't a record */
+    buf[3] = 0;
+    CHECK(decodeMetadata(&back, buf) == -1);
+    buf[3] = MD_VERSION + 1;
+    CHECK(decodeMetadata(&back, buf) == -1);
+    buf[3] = MD_VERSION;
+    buf[0] = 'X';
+    CHECK(decodeMetadata(&back, buf) == -1);
+
+    /* and through a file */
+    CHECK(writeMetadata(&meta, dirfd, "meta") == 0);
+    CHECK(readMetadata(&back, dirfd, "meta", 1) == 0);
+    CHECK(same(&meta, &back));
+
+    /* a missing file is nonexistent, or an error if asked */
+    CHECK(readMetadata(&back, dirfd, "missing", 0) == 0);
+    CHECK(back.type == MD_TYPE_NONEXIST);
+    CHECK(readMetadata(&back, dirfd, "missing", 1) == -1 && errno == ENOENT);
+
+    /* the text format is still read */
+    makeFile(dirfd, "legacy", "f\n33261\n1000\n100\n12\n-5\n7\n");
+    CHECK(readMetadata(&back, dirfd, "legacy", 1) == 0);
+    CHECK(back.type == MD_TYPE_FILE && back.mode == 33261 && back.uid == 1000 &&
+        back.gid == 100 && back.size == 12 && back.mtime == -5 && back.ctime == 7);
+    CHECK(back.linkId == MD_LINK_UNKNOWN);
+    makeFile(dirfd, "legacy", "f\n33261\n1000\n");
+    CHECK(readMetadata(&back, dirfd, "legacy", 1) == -1 && errno == EIO);
+
+    /* files share a linkId only with their links */
+    makeFile(dirfd, "single", "x");
+    CHECK(openMetadata(&meta, &fd, dirfd, "single") == 0);
+    CHECK(meta.type == MD_TYPE_FILE && meta.size == 1 && meta.linkId == 0);
+    close(fd);
+    CHECK(linkat(dirfd, "single", dirfd, "double", 0) == 0);
+    CHECK(openMetadata(&meta, &fd, dirfd, "single") == 0);
+    close(fd);
+    CHECK(openMetadata(&other, &fd, dirfd, "double") == 0);
+    close(fd);
+    CHECK(meta.linkId != 0 && meta.linkId != MD_LINK_UNKNOWN);
+    CHECK(meta.linkId == other.linkId);
+    makeFile(dirfd, "third", "x");
+    CHECK(linkat(dirfd, "third", dirfd, "fourth", 0) == 0);
+    CHECK(openMetadata(&other, &fd, dirfd, "third") == 0);
+    close(fd);
+    CHECK(meta.linkId != other.linkId);
+
+    CHECK(openMetadata(&meta, &fd, dirfd, ".") == 0);
+    CHECK(meta.type == MD_TYPE_DIRECTORY && meta.linkId == 0);
+    close(fd);
+    CHECK(openMetadata(&meta, &fd, dirfd, "missing") == 0);
+    CHECK(meta.type == MD_TYPE_NONEXIST && fd == -1);
+
+    close(dirfd);
+    return testResult("metadata");
+}
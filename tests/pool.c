@@ -0,0 +1,183 @@
+/*
+ * pool.c: Tests of the work-stealing thread pool
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../helpers.h"
+#include "../pool.h"
+#include "test.h"
+
+#define THREADS 4
+#define TASKS 10000
+#define MAX_QUEUED 8
+
+/* a tree this wide and deep, submitted from the workers */
+#define FANOUT 4
+#define DEPTH 6
+
+/* CHECK isn't thread-safe, so tasks only count, and main checks the counts */
+static int runs[TASKS];
+static int ran;
+
+/* sleep for this many microseconds */
+static void nap(long us)
+{
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = us * 1000;
+    nanosleep(&ts, NULL);
+}
+
+/* count a run */
+static void countTask(Pool *pool, int worker, void *arg)
+{
+    int *run = arg;
+
+    (void) pool;
+    (void) worker;
+    if ((run - runs) % 100 == 0) nap(100);
+    __sync_fetch_and_add(run, 1);
+    __sync_fetch_and_add(&ran, 1);
+}
+
+/* every task runs exactly once, even when submission has to wait */
+static void bounded(void)
+{
+    Pool *pool;
+    int i, over = 0;
+
+    memset(runs, 0, sizeof(runs));
+    ran = 0;
+    SF(pool, poolCreate, NULL, (THREADS));
+    for (i = 0; i < TASKS; i++) {
+        CHECK(poolSubmitBounded(pool, countTask, &runs[i], MAX_QUEUED) == 0);
+        if (poolQueued(pool) > MAX_QUEUED) over++;
+    }
+    poolWait(pool);
+    CHECK(over == 0);
+    CHECK(poolQueued(pool) == 0);
+    CHECK(ran == TASKS);
+    for (i = 0; i < TASKS; i++)
+        if (runs[i] != 1) break;
+    CHECK(i == TASKS);
+    poolDestroy(pool);
+}
+
+/* a node of a tree of tasks, each submitting its children to its own deque */
+static void treeTask(Pool *pool, int worker, void *arg)
+{
+    long depth = (long) arg;
+    int i;
+
+    (void) worker;
+    __sync_fetch_and_add(&ran, 1);
+    if (depth == DEPTH) return;
+
+    /* a worker submitting to its own pool mustn't wait for room */
+    for (i = 0; i < FANOUT; i++)
+        if (poolSubmitBounded(pool, treeTask, (void *) (depth + 1), 1) != 0)
+            treeTask(pool, -1, (void *) (depth + 1));
+}
+
+/* the children of a task that's busy until they're done */
+static int rootWorker, stolen, stolenElsewhere, waited;
+
+static void childTask(Pool *pool, int worker, void *arg)
+{
+    (void) pool;
+    (void) arg;
+    if (worker != rootWorker) __sync_fetch_and_add(&stolenElsewhere, 1);
+    __sync_fetch_and_add(&stolen, 1);
+}
+
+static void rootTask(Pool *pool, int worker, void *arg)
+{
+    int i, tries;
+
+    (void) arg;
+    rootWorker = worker;
+    for (i = 0; i < THREADS * 4; i++)
+        if (poolSubmit(pool, childTask, NULL) != 0) return;
+
+    /* they're only on our deque, so others have to steal them */
+    for (tries = 0; tries < 5000 && __sync_fetch_and_add(&stolen, 0) < THREADS * 4; tries++)
+        nap(1000);
+    waited = __sync_fetch_and_add(&stolen, 0);
+}
+
+static void stealing(void)
+{
+    Pool *pool;
+    long nodes = 0, level = 1;
+    int i;
+
+    SF(pool, poolCreate, NULL, (THREADS));
+
+    CHECK(poolSubmit(pool, rootTask, NULL) == 0);
+    poolWait(pool);
+    CHECK(waited == THREADS * 4);
+    CHECK(stolenElsewhere == THREADS * 4);
+
+    ran = 0;
+    for (i = 0; i <= DEPTH; i++) {
+        nodes += level;
+        level *= FANOUT;
+    }
+    CHECK(poolSubmit(pool, treeTask, (void *) 0L) == 0);
+    poolWait(pool);
+    CHECK(ran == nodes);
+
+    poolDestroy(pool);
+}
+
+/* destroying a pool runs what's queued first */
+static void stopping(void)
+{
+    Pool *pool;
+    int i;
+
+    memset(runs, 0, sizeof(runs));
+    ran = 0;
+    SF(pool, poolCreate, NULL, (THREADS));
+    for (i = 0; i < 1000; i++)
+        CHECK(poolSubmit(pool, countTask, &runs[i * 10]) == 0);
+    poolDestroy(pool);
+    CHECK(ran == 1000);
+
+    /* an idle pool, and one with no threads asked for, still stop */
+    SF(pool, poolCreate, NULL, (THREADS));
+    poolDestroy(pool);
+    SF(pool, poolCreate, NULL, (0));
+    CHECK(poolSubmit(pool, countTask, &runs[0]) == 0);
+    poolWait(pool);
+    CHECK(ran == 1001);
+    poolDestroy(pool);
+}
+
+int main()
+{
+    bounded();
+    stealing();
+    stopping();
+    return testResult("pool");
+}
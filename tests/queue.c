@@ -0,0 +1,230 @@
+/*
+ * queue.c: Tests of the notification queue
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../helpers.h"
+#include "../queue.h"
+#include "test.h"
+
+/* the queue takes seconds, but these are in milliseconds, to keep it quick */
+#define QUIET 200
+#define MAX_DELAY 600
+
+/* sleep for this many milliseconds */
+static void nap(long ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+static int push(NotifyQueue *queue, const char *file)
+{
+    char *copy;
+    SF(copy, strdup, NULL, (file));
+    return queuePush(queue, copy);
+}
+
+static void rescan(NotifyQueue *queue, const char *dir, int delay)
+{
+    char *copy;
+    SF(copy, strdup, NULL, (dir));
+    queueRescan(queue, copy, delay);
+}
+
+/* the queued entry for a path, if any */
+static QueueEntry *entry(NotifyQueue *queue, const char *file, int rescan)
+{
+    size_t i;
+
+    for (i = 0; i < queue->count; i++) {
+        if (queue->heap[i]->rescan == rescan && !strcmp(queue->heap[i]->file, file))
+            return queue->heap[i];
+    }
+    return NULL;
+}
+
+/* whether anything under dir is queued */
+static int under(NotifyQueue *queue, const char *dir)
+{
+    size_t i, len = strlen(dir);
+
+    for (i = 0; i < queue->count; i++) {
+        if (!strncmp(queue->heap[i]->file, dir, len) && queue->heap[i]->file[len] == '/')
+            return 1;
+    }
+    return 0;
+}
+
+/* drain the queue, checking that what came out is these paths, in order */
+static void drainIs(NotifyQueue *queue, const char *const *files, int count)
+{
+    QueueEntry *list, *e;
+    int fullSync, i = 0;
+
+    list = queueDrain(queue, &fullSync);
+    CHECK(!fullSync);
+    while ((e = list)) {
+        CHECK(i < count && !strcmp(e->file, files[i]));
+        i++;
+        list = e->next;
+        free(e->file);
+        free(e);
+    }
+    CHECK(i == count);
+}
+
+/* each path is queued only once, and not at all under a rescan */
+static void dedup(void)
+{
+    NotifyQueue queue;
+    char *batch[] = {"/r/a", "/r/c", "/r/c"};
+
+    CHECK(queueInit(&queue, 60, 60, 0, "/r") == 0);
+    CHECK(push(&queue, "/r/a") == 1);
+    CHECK(push(&queue, "/r/a") == 0);
+    CHECK(push(&queue, "/r/b") == 1);
+    CHECK(queuePushBatch(&queue, batch, 3) == 1);
+    CHECK(queue.count == 3);
+
+    rescan(&queue, "/r/d", 60000);
+    CHECK(push(&queue, "/r/d/x") == 0);
+    CHECK(push(&queue, "/r/dx") == 1);
+    CHECK(queue.count == 5);
+
+    /* and a rescan takes over what's under it */
+    rescan(&queue, "/r", 60000);
+    CHECK(queue.count == 1 && entry(&queue, "/r", 1));
+    CHECK(push(&queue, "/r/a") == 0);
+    CHECK(queue.count == 1);
+}
+
+/* paths come due once they're quiet, but no later than the max delay */
+static void debounce(void)
+{
+    NotifyQueue queue;
+    QueueEntry *a, *b;
+    static const char *const ab[] = {"/r/a", "/r/b"}, *const ba[] = {"/r/b", "/r/a"};
+    int i;
+
+    CHECK(queueInit(&queue, 60, 60, 0, "/r") == 0);
+    queue.quiet = QUIET;
+    queue.maxDelay = MAX_DELAY;
+
+    /* in the order they came due */
+    push(&queue, "/r/a");
+    nap(10);
+    push(&queue, "/r/b");
+    drainIs(&queue, NULL, 0);
+    queueWait(&queue);
+    nap(QUIET);
+    drainIs(&queue, ab, 2);
+
+    /* events put a path off, but only so far */
+    push(&queue, "/r/a");
+    push(&queue, "/r/b");
+    a = entry(&queue, "/r/a", 0);
+    b = entry(&queue, "/r/b", 0);
+    CHECK(a && a->deadline == a->first + QUIET);
+    for (i = 0; i < MAX_DELAY / (QUIET / 4); i++) {
+        nap(QUIET / 4);
+        push(&queue, "/r/a");
+    }
+    CHECK(a && a->deadline == a->first + MAX_DELAY);
+    CHECK(b && b->deadline < a->deadline);
+    drainIs(&queue, ba, 2);
+}
+
+/* past the budget, paths collapse into rescans of their directories */
+static void budget(void)
+{
+    NotifyQueue queue;
+    char path[64];
+    size_t i;
+
+    CHECK(queueInit(&queue, 60, 60, 40 * sizeof(QueueEntry), "/r") == 0);
+    push(&queue, "/r/e/g");
+    for (i = 0; i < 40; i++) {
+        sprintf(path, "/r/d/f%d", (int) i);
+        push(&queue, path);
+    }
+    CHECK(queue.bytes <= queue.budget);
+    CHECK(queue.rescans == 1 && entry(&queue, "/r/d", 1));
+    CHECK(!under(&queue, "/r/d"));
+    CHECK(entry(&queue, "/r/e/g", 0));
+    CHECK(push(&queue, "/r/d/f100") == 0);
+
+    /* and then into their parents, but never above the root */
+    for (i = 0; i < 40; i++) {
+        sprintf(path, "/r/x%d/f", (int) i);
+        push(&queue, path);
+    }
+    CHECK(queue.bytes <= queue.budget);
+    CHECK(queue.count == 1 && entry(&queue, "/r", 1));
+}
+
+/* full syncs, delayed or not, one at a time */
+static void fullSyncs(void)
+{
+    NotifyQueue queue;
+    long long at;
+    int fullSync;
+
+    CHECK(queueInit(&queue, 60, 60, 0, "/r") == 0);
+    queueFullSyncAfter(&queue, QUIET);
+    at = queue.fullSyncAt;
+    CHECK(at != 0);
+    queueFullSyncAfter(&queue, QUIET * 100);
+    CHECK(queue.fullSyncAt == at);
+    CHECK(queueDrain(&queue, &fullSync) == NULL && !fullSync);
+
+    queueWait(&queue);
+    CHECK(queueDrain(&queue, &fullSync) == NULL && fullSync);
+    CHECK(queue.fullSyncAt == 0);
+
+    /* another waits for the running one */
+    queueFullSync(&queue);
+    queueDrain(&queue, &fullSync);
+    CHECK(!fullSync);
+    queueFullSyncDone(&queue);
+    queueWait(&queue);
+    queueDrain(&queue, &fullSync);
+    CHECK(fullSync);
+    queueFullSyncDone(&queue);
+
+    /* and a delayed one isn't wanted if one's already coming */
+    queueFullSync(&queue);
+    queueFullSyncAfter(&queue, QUIET);
+    CHECK(queue.fullSyncAt == 0);
+}
+
+int main()
+{
+    dedup();
+    debounce();
+    budget();
+    fullSyncs();
+    return testResult("queue");
+}
@@ -0,0 +1,85 @@
+/*
+ * test.c: Shared helpers for the round-trip tests
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../helpers.h"
+#include "test.h"
+
+static int failures = 0;
+static char scratch[] = "/tmp/nibackup-test.XXXXXX";
+
+void testFail(const char *file, int line, const char *cond)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+    failures++;
+}
+
+static int removeEntry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+static void removeScratch(void)
+{
+    nftw(scratch, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int testDir(void)
+{
+    int fd;
+
+    if (scratch[strlen(scratch) - 1] == 'X') {
+        if (mkdtemp(scratch) == NULL) {
+            perror(scratch);
+            exit(1);
+        }
+        atexit(removeScratch);
+    }
+
+    SF(fd, open, -1, (scratch, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    return fd;
+}
+
+void testNoise(unsigned char *buf, size_t len, unsigned long seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+int testResult(const char *name)
+{
+    if (failures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", name, failures);
+        return 1;
+    }
+    fprintf(stderr, "%s: ok\n", name);
+    return 0;
+}
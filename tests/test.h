@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stddef.h>
+
+/* note a failure, but keep going */
+#define CHECK(cond) do { \
+    if (!(cond)) testFail(__FILE__, __LINE__, #cond); \
+} while (0)
+
+void testFail(const char *file, int line, const char *cond);
+
+/* a scratch directory, removed at exit. Returns its fd, or exits. */
+int testDir(void);
+
+/* fill a buffer with reproducible noise */
+void testNoise(unsigned char *buf, size_t len, unsigned long seed);
+
+/* the exit status: 0 if nothing failed */
+int testResult(const char *name);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * uring.c: Batched I/O through io_uring
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE /* for syscall and statx */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* a ring, mapped in */
+struct Uring_ {
+    int fd;
+    int broken; /* something went wrong mid-submission, so don't use it */
+
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    unsigned queued; /* queued but not yet submitted */
+
+    /* scratch for stats */
+    struct statx *stx;
+    char *paths;
+};
+
+/* each stat batch path has this much room */
+#define URING_PATH_SIZE (NAME_MAX + 8)
+
+static int enabled = 0;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+
+/* a thread's ring is already tried and failed */
+static char ringFailed;
+
+/* create the thread key */
+static void makeKey(void);
+
+/* set up a ring */
+static Uring *uringCreate(void);
+
+/* tear down a ring (the thread key destructor) */
+static void uringDestroy(void *ringvp);
+
+/* get a zeroed submission queue entry */
+static struct io_uring_sqe *getSqe(Uring *ring);
+
+/* Submit everything queued, and wait for count completions, putting each
+ * result in res by its user_data. Returns -1, and marks the ring broken, if
+ * they can't all be submitted or waited for. */
+static int submitWait(Uring *ring, unsigned count, int *res);
+
+/* allow io_uring to be used */
+void uringEnable(void)
+{
+    enabled = 1;
+}
+
+/* this thread's ring */
+Uring *uringGet(void)
+{
+    void *ringvp;
+    Uring *ring;
+
+    if (!enabled) return NULL;
+    pthread_once(&keyOnce, makeKey);
+
+    ringvp = pthread_getspecific(ringKey);
+    if (ringvp == &ringFailed) return NULL;
+    if (ringvp) {
+        ring = (Uring *) ringvp;
+        return ring->broken ? NULL : ring;
+    }
+
+    /* first time on this thread */
+    ring = uringCreate();
+    pthread_setspecific(ringKey, ring ? (void *) ring : (void *) &ringFailed);
+    return ring;
+}
+
+/* create the thread key */
+static void makeKey(void)
+{
+    pthread_key_create(&ringKey, uringDestroy);
+}
+
+/* set up a ring */
+static Uring *uringCreate(void)
+{
+    struct io_uring_params p;
+    Uring *ring;
+
+    ring = calloc(1, sizeof(Uring));
+    if (ring == NULL) return NULL;
+    ring->fd = -1;
+    ring->sqMap = ring->cqMap = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->stx = malloc(URING_ENTRIES * sizeof(struct statx));
+    ring->paths = malloc(URING_ENTRIES * URING_PATH_SIZE);
+    if (ring->stx == NULL || ring->paths == NULL) goto fail;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->fd < 0) goto fail;
+
+    /* map in the rings, which may share a mapping */
+    ring->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = 0;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) goto fail;
+    if (ring->cqMapSize) {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) goto fail;
+    }
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+#define SQ(field) ((unsigned *) ((char *) ring->sqMap + p.sq_off.field))
+#define CQ(field) ((unsigned *) ((char *) (ring->cqMapSize ? ring->cqMap : ring->sqMap) + p.cq_off.field))
+    ring->sqHead = SQ(head);
+    ring->sqTail = SQ(tail);
+    ring->sqMask = SQ(ring_mask);
+    ring->sqArray = SQ(array);
+    ring->sqEntries = p.sq_entries;
+    ring->cqHead = CQ(head);
+    ring->cqTail = CQ(tail);
+    ring->cqMask = CQ(ring_mask);
+    ring->cqes = (struct io_uring_cqe *) CQ(cqes);
+#undef SQ
+#undef CQ
+
+    return ring;
+
+fail:
+    uringDestroy(ring);
+    return NULL;
+}
+
+/* tear down a ring */
+static void uringDestroy(void *ringvp)
+{
+    Uring *ring = (Uring *) ringvp;
+
+    if (ring == NULL || ringvp == (void *) &ringFailed) return;
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap != MAP_FAILED) munmap(ring->cqMap, ring->cqMapSize);
+    if (ring->sqMap != MAP_FAILED) munmap(ring->sqMap, ring->sqMapSize);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring->stx);
+    free(ring->paths);
+    free(ring);
+}
+
+/* get a zeroed submission queue entry */
+static struct io_uring_sqe *getSqe(Uring *ring)
+{
+    unsigned tail, idx;
+    struct io_uring_sqe *sqe;
+
+    /* everything is waited for before more is queued, so there's always room
+     * for a ring's worth */
+    if (ring->queued >= ring->sqEntries) return NULL;
+
+    tail = *ring->sqTail + ring->queued;
+    idx = tail & *ring->sqMask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[idx] = idx;
+    ring->queued++;
+    return sqe;
+}
+
+/* submit and wait */
+static int submitWait(Uring *ring, unsigned count, int *res)
+{
+    unsigned toSubmit = ring->queued, reaped = 0, head, tail;
+    struct io_uring_cqe *cqe;
+    long ret;
+
+    /* publish the queued entries */
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    while (toSubmit) {
+        ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            ring->broken = 1;
+            return -1;
+        }
+        toSubmit -= ret;
+    }
+
+    while (reaped < count) {
+        head = *ring->cqHead;
+        tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &ring->cqes[head & *ring->cqMask];
+            if (res) res[cqe->user_data] = cqe->res;
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+        if (reaped < count) {
+            ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR) {
+                ring->broken = 1;
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* stat a batch of names */
+void uringStatBatch(Uring *ring, int dirfd, const char *prefix, char **names, size_t count)
+{
+    struct io_uring_sqe *sqe;
+    size_t plen = prefix ? strlen(prefix) : 0;
+    size_t n;
+    char *path;
+
+    while (count) {
+        for (n = 0; n < count && n < URING_ENTRIES; n++) {
+            path = names[n];
+            if (prefix) {
+                path = ring->paths + n * URING_PATH_SIZE;
+                if (plen + strlen(names[n]) >= URING_PATH_SIZE) continue;
+                memcpy(path, prefix, plen);
+                strcpy(path + plen, names[n]);
+            }
+
+            sqe = getSqe(ring);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (uintptr_t) path;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t) &ring->stx[n];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+
+        /* a name too long to stat isn't queued, so count what is */
+        if (ring->queued && submitWait(ring, ring->queued, NULL) != 0) return;
+
+        names += n;
+        count -= n;
+    }
+}
+
+/* copy with reads and writes in flight */
+off_t uringCopy(Uring *ring, int ifd, int ofd, off_t off, off_t len, char *buf, size_t bufsz)
+{
+    struct io_uring_sqe *sqe;
+    size_t slot = bufsz / URING_COPY_DEPTH;
+    int want[URING_COPY_DEPTH];
+    int res[URING_COPY_DEPTH * 2];
+    off_t done = 0, at;
+    unsigned n, i;
+
+    while (done < len) {
+        /* each slot of the buffer is read then, linked, written */
+        at = done;
+        for (n = 0; n < URING_COPY_DEPTH && at < len; n++) {
+            want[n] = (len - at > (off_t) slot) ? (int) slot : (int) (len - at);
+
+            sqe = getSqe(ring);
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = ifd;
+            sqe->addr = (uintptr_t) (buf + n * slot);
+            sqe->len = want[n];
+            sqe->off = off + at;
+            sqe->user_data = n * 2;
+
+            sqe = getSqe(ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = ofd;
+            sqe->addr = (uintptr_t) (buf + n * slot);
+            sqe->len = want[n];
+            sqe->off = off + at;
+            sqe->user_data = n * 2 + 1;
+
+            at += want[n];
+        }
+
+        if (submitWait(ring, n * 2, res) != 0)
+            return done ? done : -1;
+
+        /* only count what came through whole and in order */
+        for (i = 0; i < n; i++) {
+            if (res[i * 2] != want[i] || res[i * 2 + 1] != want[i])
+                return done;
+            done += want[i];
+        }
+    }
+
+    return done;
+}
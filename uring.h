@@ -0,0 +1,36 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+/* submission queue size of each thread's ring */
+#define URING_ENTRIES 128
+
+/* most paths to stat in one batch */
+#define URING_STAT_BATCH (URING_ENTRIES / 2)
+
+/* copies keep this many reads and writes in flight */
+#define URING_COPY_DEPTH 4
+
+struct Uring_;
+typedef struct Uring_ Uring;
+
+/* allow io_uring to be used (it isn't unless this is called) */
+void uringEnable(void);
+
+/* this thread's ring, or NULL if io_uring isn't enabled or available */
+Uring *uringGet(void);
+
+/* Stat each of count names in dirfd, each prefixed by prefix (which may be
+ * NULL), all at once. The results aren't kept: this just brings their inodes
+ * into the cache in parallel, so that looking them up one by one later
+ * doesn't wait on the disk for each. */
+void uringStatBatch(Uring *ring, int dirfd, const char *prefix, char **names, size_t count);
+
+/* Copy len bytes at off from ifd to ofd, through buf (of bufsz bytes), with
+ * several reads and writes in flight at once. Returns how much was copied,
+ * which is short if anything went wrong, or -1 if nothing could be
+ * submitted. */
+off_t uringCopy(Uring *ring, int ifd, int ofd, off_t off, off_t len, char *buf, size_t bufsz);
+
+#endif
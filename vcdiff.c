@@ -0,0 +1,581 @@
+/*
+ * vcdiff.c: In-process VCDIFF (RFC 3284) codec, compatible with xdelta3
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "catalog.h"
+#include "codec.h"
+
+/* header and indicator bits */
+#define VCD_MAGIC_SIZE  4
+#define VCD_DECOMPRESS  0x01
+#define VCD_CODETABLE   0x02
+#define VCD_APPHEADER   0x04 /* xdelta3 extension */
+#define VCD_SOURCE      0x01
+#define VCD_TARGET      0x02
+#define VCD_ADLER32     0x04 /* xdelta3 extension */
+
+/* instructions */
+#define VCD_NOOP        0
+#define VCD_ADD         1
+#define VCD_RUN         2
+#define VCD_COPY        3
+
+/* address cache */
+#define VCD_NEAR        4
+#define VCD_SAME        3
+#define VCD_SELF        0
+#define VCD_HERE        1
+
+/* we write target windows this big, comfortably under xdelta3's limit */
+#define VCD_WINDOW      (1<<23)
+
+/* matches are found on blocks this big */
+#define VCD_BLOCK       16
+
+/* and runs this long are worth a RUN */
+#define VCD_MIN_RUN     32
+
+/* the source index never has more entries than this */
+#define VCD_MAX_INDEX   (1<<24)
+
+/* one half of an instruction code */
+struct VcdInst_ {
+    unsigned char type, size, mode;
+};
+typedef struct VcdInst_ VcdInst;
+
+/* the address cache */
+struct VcdCache_ {
+    size_t near[VCD_NEAR];
+    int nextSlot;
+    size_t same[VCD_SAME * 256];
+};
+typedef struct VcdCache_ VcdCache;
+
+static const unsigned char vcdMagic[VCD_MAGIC_SIZE] = {0xD6, 0xC3, 0xC4, 0};
+
+static int vcdiffEncode(const unsigned char *from, size_t fromSz,
+    const unsigned char *to, size_t toSz, struct Buffer_char *patch);
+
+static int vcdiffDecode(const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to);
+
+/* xdelta3 -d, for patches using its secondary compressors */
+static int xdelta3d(const char *from, const char *patch, const char *to);
+
+const Codec codecVcdiff = {
+    "vcdiff",
+    "x3p",
+    CATALOG_CODEC_XDELTA3,
+    vcdiffEncode,
+    vcdiffDecode,
+    xdelta3d
+};
+
+/* build the default code table (RFC 3284 section 5.6) */
+static void vcdCodeTable(VcdInst table[256][2])
+{
+    int i = 0, s, m, a, c;
+
+    memset(table, 0, 256 * 2 * sizeof(VcdInst));
+
+    table[i++][0].type = VCD_RUN;
+    for (s = 0; s <= 17; s++, i++) {
+        table[i][0].type = VCD_ADD;
+        table[i][0].size = s;
+    }
+    for (m = 0; m < 9; m++) {
+        table[i][0].type = VCD_COPY;
+        table[i++][0].mode = m;
+        for (s = 4; s <= 18; s++, i++) {
+            table[i][0].type = VCD_COPY;
+            table[i][0].size = s;
+            table[i][0].mode = m;
+        }
+    }
+    for (m = 0; m < 9; m++) {
+        for (a = 1; a <= 4; a++) {
+            for (c = 4; c <= (m < 6 ? 6 : 4); c++, i++) {
+                table[i][0].type = VCD_ADD;
+                table[i][0].size = a;
+                table[i][1].type = VCD_COPY;
+                table[i][1].size = c;
+                table[i][1].mode = m;
+            }
+        }
+    }
+    for (m = 0; m < 9; m++, i++) {
+        table[i][0].type = VCD_COPY;
+        table[i][0].size = 4;
+        table[i][0].mode = m;
+        table[i][1].type = VCD_ADD;
+        table[i][1].size = 1;
+    }
+}
+
+/* adler32, as xdelta3 checks target windows with */
+static unsigned long adler32(const unsigned char *buf, size_t len)
+{
+    unsigned long a = 1, b = 0;
+    size_t n;
+    while (len) {
+        n = (len > 5552) ? 5552 : len;
+        len -= n;
+        while (n--) {
+            a += *buf++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/* read a VCDIFF integer */
+static int vcdReadInt(const unsigned char **p, const unsigned char *end, size_t *out)
+{
+    size_t v = 0;
+    int i;
+    for (i = 0; i < 10 && *p < end; i++) {
+        unsigned char c = *(*p)++;
+        if (v > ((size_t) -1) >> 7) return -1;
+        v = (v << 7) | (c & 0x7F);
+        if (!(c & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* write a VCDIFF integer */
+static void vcdWriteInt(struct Buffer_char *buf, size_t v)
+{
+    unsigned char tmp[10];
+    int i = 10;
+    tmp[--i] = v & 0x7F;
+    while (v >>= 7)
+        tmp[--i] = (v & 0x7F) | 0x80;
+    WRITE_BUFFER(*buf, tmp + i, 10 - i);
+}
+
+static size_t vcdIntLen(size_t v)
+{
+    size_t len = 1;
+    while (v >>= 7) len++;
+    return len;
+}
+
+/* the state of a target window being encoded */
+struct VcdWindow_ {
+    struct Buffer_char data, inst, addr;
+    size_t srcLen; /* source segment length */
+    size_t here; /* current offset in the target window */
+};
+typedef struct VcdWindow_ VcdWindow;
+
+/* encode an ADD */
+static void vcdAdd(VcdWindow *w, const unsigned char *buf, size_t len)
+{
+    if (len == 0) return;
+    if (len <= 17) {
+        WRITE_ONE_BUFFER(w->inst, 1 + len);
+    } else {
+        WRITE_ONE_BUFFER(w->inst, 1);
+        vcdWriteInt(&w->inst, len);
+    }
+    WRITE_BUFFER(w->data, buf, len);
+    w->here += len;
+}
+
+/* encode a RUN */
+static void vcdRun(VcdWindow *w, unsigned char byte, size_t len)
+{
+    WRITE_ONE_BUFFER(w->inst, 0);
+    vcdWriteInt(&w->inst, len);
+    WRITE_ONE_BUFFER(w->data, byte);
+    w->here += len;
+}
+
+/* encode a COPY from the source segment, as SELF or HERE, whichever's shorter */
+static void vcdCopy(VcdWindow *w, size_t addr, size_t len)
+{
+    size_t here = w->srcLen + w->here;
+    int mode = VCD_SELF;
+    if (vcdIntLen(here - addr) < vcdIntLen(addr))
+        mode = VCD_HERE;
+
+    if (len >= 4 && len <= 18) {
+        WRITE_ONE_BUFFER(w->inst, 19 + mode * 16 + (len - 3));
+    } else {
+        WRITE_ONE_BUFFER(w->inst, 19 + mode * 16);
+        vcdWriteInt(&w->inst, len);
+    }
+    vcdWriteInt(&w->addr, (mode == VCD_SELF) ? addr : here - addr);
+    w->here += len;
+}
+
+/* polynomial hash of a block */
+#define VCD_HASH_MUL 0x01000193U
+static unsigned int vcdHash(const unsigned char *buf)
+{
+    unsigned int h = 0;
+    int i;
+    for (i = 0; i < VCD_BLOCK; i++)
+        h = h * VCD_HASH_MUL + buf[i];
+    return h;
+}
+
+/* make a VCDIFF patch turning from into to */
+static int vcdiffEncode(const unsigned char *from, size_t fromSz,
+    const unsigned char *to, size_t toSz, struct Buffer_char *patch)
+{
+    size_t *index = NULL, indexSz, stride, i, ws, we, pos, addStart;
+    unsigned int h = 0, hashOut, shift;
+    VcdWindow w;
+    int ret = -1;
+
+    w.data.buf = w.inst.buf = w.addr.buf = NULL;
+
+    /* index the source every stride bytes */
+    stride = VCD_BLOCK;
+    while (fromSz / stride > VCD_MAX_INDEX)
+        stride *= 2;
+    indexSz = 256;
+    shift = 24;
+    while (indexSz < fromSz / stride) {
+        indexSz *= 2;
+        shift--;
+    }
+    index = calloc(indexSz, sizeof(size_t));
+    if (index == NULL) {
+        perror("calloc");
+        goto done;
+    }
+    for (i = 0; i + VCD_BLOCK <= fromSz; i += stride)
+        index[(vcdHash(from + i) * 0x9E3779B1U) >> shift & (indexSz - 1)] = i + 1;
+
+    /* the multiplier for the byte leaving the hash */
+    hashOut = 1;
+    for (i = 1; i < VCD_BLOCK; i++)
+        hashOut *= VCD_HASH_MUL;
+
+    INIT_BUFFER(w.data);
+    INIT_BUFFER(w.inst);
+    INIT_BUFFER(w.addr);
+
+    WRITE_BUFFER(*patch, vcdMagic, VCD_MAGIC_SIZE);
+    WRITE_ONE_BUFFER(*patch, 0);
+
+    for (ws = 0; ws < toSz; ws = we) {
+        we = ws + VCD_WINDOW;
+        if (we > toSz) we = toSz;
+
+        w.data.bufused = w.inst.bufused = w.addr.bufused = 0;
+        w.srcLen = fromSz;
+        w.here = 0;
+
+        pos = addStart = ws;
+        if (pos + VCD_BLOCK <= we)
+            h = vcdHash(to + pos);
+        while (pos + VCD_BLOCK <= we) {
+            size_t cand = index[(h * 0x9E3779B1U) >> shift & (indexSz - 1)];
+            size_t len = 0;
+
+            if (cand && !memcmp(from + cand - 1, to + pos, VCD_BLOCK)) {
+                size_t s = cand - 1, b = 0, f = VCD_BLOCK;
+
+                /* extend it both ways */
+                while (pos - b > addStart && s - b > 0 &&
+                       from[s - b - 1] == to[pos - b - 1])
+                    b++;
+                while (pos + f < we && s + f < fromSz && from[s + f] == to[pos + f])
+                    f++;
+
+                vcdAdd(&w, to + addStart, pos - b - addStart);
+                vcdCopy(&w, s - b, b + f);
+                len = f;
+
+            } else if (to[pos] == to[pos + 1] && to[pos] == to[pos + VCD_BLOCK - 1]) {
+                /* maybe a run */
+                while (pos + len < we && to[pos + len] == to[pos])
+                    len++;
+                if (len >= VCD_MIN_RUN) {
+                    vcdAdd(&w, to + addStart, pos - addStart);
+                    vcdRun(&w, to[pos], len);
+                } else {
+                    len = 0;
+                }
+
+            }
+
+            if (len) {
+                pos += len;
+                addStart = pos;
+                if (pos + VCD_BLOCK <= we)
+                    h = vcdHash(to + pos);
+                continue;
+            }
+
+            /* roll on */
+            if (pos + VCD_BLOCK < we)
+                h = (h - to[pos] * hashOut) * VCD_HASH_MUL + to[pos + VCD_BLOCK];
+            pos++;
+        }
+        vcdAdd(&w, to + addStart, we - addStart);
+
+        /* now write out the window */
+        if (fromSz) {
+            WRITE_ONE_BUFFER(*patch, VCD_SOURCE);
+            vcdWriteInt(patch, fromSz);
+            vcdWriteInt(patch, 0);
+        } else {
+            WRITE_ONE_BUFFER(*patch, 0);
+        }
+        vcdWriteInt(patch,
+            vcdIntLen(we - ws) + 1 +
+            vcdIntLen(w.data.bufused) + vcdIntLen(w.inst.bufused) + vcdIntLen(w.addr.bufused) +
+            w.data.bufused + w.inst.bufused + w.addr.bufused);
+        vcdWriteInt(patch, we - ws);
+        WRITE_ONE_BUFFER(*patch, 0);
+        vcdWriteInt(patch, w.data.bufused);
+        vcdWriteInt(patch, w.inst.bufused);
+        vcdWriteInt(patch, w.addr.bufused);
+        WRITE_BUFFER(*patch, w.data.buf, w.data.bufused);
+        WRITE_BUFFER(*patch, w.inst.buf, w.inst.bufused);
+        WRITE_BUFFER(*patch, w.addr.buf, w.addr.bufused);
+    }
+
+    ret = 0;
+
+done:
+    free(index);
+    if (w.data.buf) FREE_BUFFER(w.data);
+    if (w.inst.buf) FREE_BUFFER(w.inst);
+    if (w.addr.buf) FREE_BUFFER(w.addr);
+    return ret;
+}
+
+/* decode a COPY address, updating the cache */
+static int vcdReadAddr(VcdCache *cache, int mode, size_t here,
+    const unsigned char **addr, const unsigned char *addrEnd, size_t *out)
+{
+    size_t a, v;
+
+    if (mode == VCD_SELF) {
+        if (vcdReadInt(addr, addrEnd, &a) != 0) return -1;
+    } else if (mode == VCD_HERE) {
+        if (vcdReadInt(addr, addrEnd, &v) != 0 || v > here) return -1;
+        a = here - v;
+    } else if (mode < 2 + VCD_NEAR) {
+        if (vcdReadInt(addr, addrEnd, &v) != 0) return -1;
+        a = cache->near[mode - 2] + v;
+    } else {
+        if (*addr >= addrEnd) return -1;
+        a = cache->same[(mode - 2 - VCD_NEAR) * 256 + *(*addr)++];
+    }
+    if (a >= here) return -1;
+
+    cache->near[cache->nextSlot] = a;
+    cache->nextSlot = (cache->nextSlot + 1) % VCD_NEAR;
+    cache->same[a % (VCD_SAME * 256)] = a;
+
+    *out = a;
+    return 0;
+}
+
+/* apply a VCDIFF patch to from */
+static int vcdiffDecode(const unsigned char *from, size_t fromSz,
+    const unsigned char *patch, size_t patchSz, struct Buffer_char *to)
+{
+    VcdInst table[256][2];
+    VcdCache cache;
+    const unsigned char *p = patch, *end = patch + patchSz;
+    size_t start = to->bufused, v;
+    int hdr;
+
+    vcdCodeTable(table);
+
+    if (patchSz < VCD_MAGIC_SIZE + 1 || memcmp(p, vcdMagic, 3))
+        goto corrupt;
+    p += VCD_MAGIC_SIZE;
+    hdr = *p++;
+
+    /* we can read a file that declares a secondary compressor, so long as no
+     * window actually uses it */
+    if (hdr & VCD_DECOMPRESS) {
+        if (p >= end) goto corrupt;
+        p++;
+    }
+    if (hdr & VCD_CODETABLE)
+        return CODEC_EXTERNAL;
+    if (hdr & VCD_APPHEADER) {
+        if (vcdReadInt(&p, end, &v) != 0 || v > (size_t) (end - p)) goto corrupt;
+        p += v;
+    }
+
+    while (p < end) {
+        int win, delta;
+        size_t segLen = 0, segPos = 0, deltaLen, tgtLen, dataLen, instLen, addrLen;
+        const unsigned char *seg = NULL, *deltaEnd, *data, *dataEnd, *inst, *instEnd, *addr, *addrEnd;
+        unsigned char *out;
+        unsigned long cksum = 0;
+        size_t o;
+
+        win = *p++;
+        if ((win & VCD_SOURCE) && (win & VCD_TARGET)) goto corrupt;
+        if (win & (VCD_SOURCE | VCD_TARGET)) {
+            if (vcdReadInt(&p, end, &segLen) != 0 ||
+                vcdReadInt(&p, end, &segPos) != 0)
+                goto corrupt;
+        }
+
+        if (vcdReadInt(&p, end, &deltaLen) != 0 || deltaLen > (size_t) (end - p))
+            goto corrupt;
+        deltaEnd = p + deltaLen;
+        if (vcdReadInt(&p, deltaEnd, &tgtLen) != 0 || p >= deltaEnd)
+            goto corrupt;
+        delta = *p++;
+        if (delta)
+            return CODEC_EXTERNAL;
+        if (vcdReadInt(&p, deltaEnd, &dataLen) != 0 ||
+            vcdReadInt(&p, deltaEnd, &instLen) != 0 ||
+            vcdReadInt(&p, deltaEnd, &addrLen) != 0)
+            goto corrupt;
+        if (win & VCD_ADLER32) {
+            if (deltaEnd - p < 4) goto corrupt;
+            cksum = ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) |
+                    ((unsigned long) p[2] << 8) | p[3];
+            p += 4;
+        }
+        if (dataLen > (size_t) (deltaEnd - p) ||
+            instLen > (size_t) (deltaEnd - p) - dataLen ||
+            addrLen != (size_t) (deltaEnd - p) - dataLen - instLen)
+            goto corrupt;
+        data = p;
+        dataEnd = inst = data + dataLen;
+        instEnd = addr = inst + instLen;
+        addrEnd = deltaEnd;
+        p = deltaEnd;
+
+        /* make room for the window, then find the segment */
+        while (BUFFER_SPACE(*to) < tgtLen)
+            EXPAND_BUFFER(*to);
+        out = (unsigned char *) BUFFER_END(*to);
+        if (win & VCD_SOURCE) {
+            if (segPos > fromSz || segLen > fromSz - segPos) goto corrupt;
+            seg = from + segPos;
+        } else if (win & VCD_TARGET) {
+            if (segPos > to->bufused - start || segLen > to->bufused - start - segPos)
+                goto corrupt;
+            seg = (unsigned char *) to->buf + start + segPos;
+        }
+
+        memset(&cache, 0, sizeof(cache));
+        o = 0;
+        while (inst < instEnd) {
+            int code = *inst++, half;
+
+            for (half = 0; half < 2; half++) {
+                VcdInst *in = &table[code][half];
+                size_t size = in->size, a, i;
+
+                if (in->type == VCD_NOOP) continue;
+                if (size == 0 && vcdReadInt(&inst, instEnd, &size) != 0)
+                    goto corrupt;
+                if (size > tgtLen - o)
+                    goto corrupt;
+
+                switch (in->type) {
+                    case VCD_ADD:
+                        if (size > (size_t) (dataEnd - data)) goto corrupt;
+                        memcpy(out + o, data, size);
+                        data += size;
+                        break;
+
+                    case VCD_RUN:
+                        if (data >= dataEnd) goto corrupt;
+                        memset(out + o, *data++, size);
+                        break;
+
+                    case VCD_COPY:
+                        if (vcdReadAddr(&cache, in->mode, segLen + o, &addr, addrEnd, &a) != 0)
+                            goto corrupt;
+                        if (a + size <= segLen) {
+                            memcpy(out + o, seg + a, size);
+                        } else if (a >= segLen && a - segLen + size <= o) {
+                            memcpy(out + o, out + a - segLen, size);
+                        } else {
+                            /* straddles the segment or overlaps itself */
+                            for (i = 0; i < size; i++, a++)
+                                out[o + i] = (a < segLen) ? seg[a] : out[a - segLen];
+                        }
+                        break;
+                }
+                o += size;
+            }
+        }
+        if (o != tgtLen)
+            goto corrupt;
+
+        if ((win & VCD_ADLER32) && adler32(out, tgtLen) != cksum) {
+            fprintf(stderr, "VCDIFF checksum mismatch\n");
+            return -1;
+        }
+
+        STEP_BUFFER(*to, tgtLen);
+    }
+
+    return 0;
+
+corrupt:
+    fprintf(stderr, "Corrupt VCDIFF patch\n");
+    return -1;
+}
+
+/* utility function to call xdelta3 -d, returning 0 if it succeeds */
+static int xdelta3d(const char *from, const char *patch, const char *to)
+{
+    int status;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+
+    if (pid == 0) {
+        /* child, call xdelta3 */
+        execlp("xdelta3", "xdelta3", "-d", "-f", "-s", from, patch, to, NULL);
+        perror("xdelta3");
+        exit(1);
+        abort();
+    }
+
+    /* wait for xdelta3 */
+    if (waitpid(pid, &status, 0) != pid)
+        return -1;
+    if (WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * watch.c: Tables of inotify watches
+ *
+ * Copyright (c) 2014, Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+
+/* Both tables are open addressing with linear probing, kept at most half
+ * full, so lookups stay short however many watches there are. They're never
+ * smaller than this. */
+#define WATCH_TABLE_MIN 256
+
+/* nodes by parent and name */
+static WatchNode **nodes = NULL;
+static size_t nodesSize = 0, nodesCount = 0;
+
+/* watches by descriptor */
+static Watch **ids = NULL;
+static size_t idsSize = 0, idsCount = 0;
+
+static WatchNode *root = NULL;
+static Watch lru = {.lruPrev = &lru, .lruNext = &lru};
+
+/* hash a node's key: its parent and (Bernstein hashed) name */
+static size_t hashNode(WatchNode *parent, const char *name, size_t len)
+{
+    size_t hash = 5381 ^ ((uintptr_t) parent >> 4);
+
+    while (len--)
+        hash = ((hash << 5) + hash) ^ (unsigned char) *name++; /* hash * 33 ^ c */
+
+    return hash;
+}
+
+/* hash a descriptor (Fibonacci hashing, since they're sequential) */
+static size_t hashId(int id)
+{
+    return (size_t) id * 2654435761U;
+}
+
+/* is k cyclically in (i, j]? If so, an entry at j that hashed to k can't move
+ * back to i. */
+static int inRange(size_t i, size_t j, size_t k)
+{
+    return (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+}
+
+/* the slot a node is in, or the empty slot it would go in */
+static size_t nodeSlot(WatchNode *parent, const char *name, size_t len, size_t hash)
+{
+    size_t i = hash & (nodesSize - 1);
+    WatchNode *n;
+
+    while ((n = nodes[i])) {
+        if (n->hash == hash && n->parent == parent && n->nameLen == len &&
+            !memcmp(n->name, name, len))
+            break;
+        i = (i + 1) & (nodesSize - 1);
+    }
+    return i;
+}
+
+/* put a node in the table (which must have room) */
+static void nodeInsert(WatchNode *n)
+{
+    size_t i = n->hash & (nodesSize - 1);
+    while (nodes[i]) i = (i + 1) & (nodesSize - 1);
+    nodes[i] = n;
+    nodesCount++;
+}
+
+/* take a node out of the table, shifting back what followed it */
+static void nodeRemove(WatchNode *n)
+{
+    size_t i = nodeSlot(n->parent, n->name, n->nameLen, n->hash), j = i;
+
+    if (nodes[i] != n) return;
+    nodes[i] = NULL;
+    nodesCount--;
+    while (nodes[j = (j + 1) & (nodesSize - 1)]) {
+        if (inRange(i, j, nodes[j]->hash & (nodesSize - 1))) continue;
+        nodes[i] = nodes[j];
+        nodes[j] = NULL;
+        i = j;
+    }
+}
+
+/* make sure there's room for another node. Returns 0 on success. */
+static int nodeGrow(void)
+{
+    WatchNode **old = nodes;
+    size_t oldSize = nodesSize, i;
+
+    if ((nodesCount + 1) * 2 <= nodesSize) return 0;
+    nodesSize = nodesSize ? nodesSize * 2 : WATCH_TABLE_MIN;
+    nodes = calloc(nodesSize, sizeof(WatchNode *));
+    if (nodes == NULL) {
+        nodes = old;
+        nodesSize = oldSize;
+        return (nodesCount + 1 < nodesSize) ? 0 : -1;
+    }
+    nodesCount = 0;
+    for (i = 0; i < oldSize; i++)
+        if (old[i]) nodeInsert(old[i]);
+    free(old);
+    return 0;
+}
+
+/* free nodes that nothing is under or watching any more, from n up */
+static void nodePrune(WatchNode *n)
+{
+    WatchNode *parent;
+
+    while (n && n != root && !n->children && !n->watch) {
+        parent = n->parent;
+        if (!n->detached) nodeRemove(n);
+        free(n->name);
+        free(n);
+        parent->children--;
+        n = parent;
+    }
+}
+
+/* Find the node for an absolute path, creating it (and any above it) if
+ * create is set. Returns NULL if it isn't under the root, or on error. */
+static WatchNode *nodeLookup(const char *path, int create)
+{
+    WatchNode *n, *child;
+    const char *end;
+    size_t len, hash, i;
+
+    if (root == NULL || strncmp(path, root->name, root->nameLen) ||
+        (path[root->nameLen] && path[root->nameLen] != '/'))
+        return NULL;
+
+    n = root;
+    path += root->nameLen;
+    while (*path) {
+        path++;
+        end = strchr(path, '/');
+        if (end == NULL) end = path + strlen(path);
+        len = end - path;
+
+        if (len) {
+            hash = hashNode(n, path, len);
+            child = nodesSize ? nodes[i = nodeSlot(n, path, len, hash)] : NULL;
+
+            if (child == NULL) {
+                if (!create ||
+                    nodeGrow() != 0 ||
+                    (child = calloc(1, sizeof(WatchNode))) == NULL) {
+                    nodePrune(n);
+                    return NULL;
+                }
+                child->name = malloc(len + 1);
+                if (child->name == NULL) {
+                    free(child);
+                    nodePrune(n);
+                    return NULL;
+                }
+                memcpy(child->name, path, len);
+                child->name[len] = 0;
+                child->nameLen = len;
+                child->hash = hash;
+                child->parent = n;
+                n->children++;
+                nodeInsert(child);
+            }
+
+            n = child;
+        }
+
+        path = end;
+    }
+
+    return n;
+}
+
+/* the slot a descriptor is in, or the empty slot it would go in */
+static size_t idSlot(int id)
+{
+    size_t i = hashId(id) & (idsSize - 1);
+    while (ids[i] && ids[i]->id != id) i = (i + 1) & (idsSize - 1);
+    return i;
+}
+
+/* take the watch at slot i out of the descriptor table */
+static void idRemove(size_t i)
+{
+    size_t j = i;
+
+    ids[i] = NULL;
+    idsCount--;
+    while (ids[j = (j + 1) & (idsSize - 1)]) {
+        if (inRange(i, j, hashId(ids[j]->id) & (idsSize - 1))) continue;
+        ids[i] = ids[j];
+        ids[j] = NULL;
+        i = j;
+    }
+}
+
+/* make sure there's room for another descriptor. Returns 0 on success. */
+static int idGrow(void)
+{
+    Watch **old = ids;
+    size_t oldSize = idsSize, i;
+
+    if ((idsCount + 1) * 2 <= idsSize) return 0;
+    idsSize = idsSize ? idsSize * 2 : WATCH_TABLE_MIN;
+    ids = calloc(idsSize, sizeof(Watch *));
+    if (ids == NULL) {
+        ids = old;
+        idsSize = oldSize;
+        return (idsCount + 1 < idsSize) ? 0 : -1;
+    }
+    for (i = 0; i < oldSize; i++)
+        if (old[i]) ids[idSlot(old[i]->id)] = old[i];
+    free(old);
+    return 0;
+}
+
+/* set the root */
+int watchInit(const char *path)
+{
+    root = calloc(1, sizeof(WatchNode));
+    if (root == NULL) return -1;
+    root->name = strdup(path);
+    if (root->name == NULL) {
+        free(root);
+        root = NULL;
+        return -1;
+    }
+    root->nameLen = strlen(path);
+    return 0;
+}
+
+/* find a watch by path */
+Watch *watchFind(const char *path)
+{
+    WatchNode *n = nodeLookup(path, 0);
+    return n ? n->watch : NULL;
+}
+
+/* find a watch by descriptor */
+Watch *watchById(int id)
+{
+    if (!idsSize) return NULL;
+    return ids[idSlot(id)];
+}
+
+/* record a watch */
+Watch *watchAdd(const char *path, int id)
+{
+    WatchNode *n;
+    Watch *w;
+    size_t i;
+
+    if (idGrow() != 0) return NULL;
+    n = nodeLookup(path, 1);
+    if (n == NULL) return NULL;
+    if (n->watch) return n->watch;
+
+    i = idSlot(id);
+    if ((w = ids[i])) {
+        /* the same directory, by a path we missed it being renamed to */
+        w->node->watch = NULL;
+        nodePrune(w->node);
+        w->node = n;
+        n->watch = w;
+        watchTouch(w);
+        return w;
+    }
+
+    w = calloc(1, sizeof(Watch));
+    if (w == NULL) {
+        nodePrune(n);
+        return NULL;
+    }
+    w->node = n;
+    w->id = id;
+    n->watch = w;
+    ids[i] = w;
+    idsCount++;
+
+    w->lruPrev = lru.lruPrev;
+    w->lruNext = &lru;
+    lru.lruPrev->lruNext = w;
+    lru.lruPrev = w;
+
+    return w;
+}
+
+/* forget a watch */
+void watchDel(Watch *w)
+{
+    size_t i = idSlot(w->id);
+
+    if (ids[i] == w) idRemove(i);
+    w->lruPrev->lruNext = w->lruNext;
+    w->lruNext->lruPrev = w->lruPrev;
+    w->node->watch = NULL;
+    nodePrune(w->node);
+    free(w);
+}
+
+/* most recently used */
+void watchTouch(Watch *w)
+{
+    w->lruPrev->lruNext = w->lruNext;
+    w->lruNext->lruPrev = w->lruPrev;
+    w->lruPrev = lru.lruPrev;
+    w->lruNext = &lru;
+    lru.lruPrev->lruNext = w;
+    lru.lruPrev = w;
+}
+
+/* LRU order */
+Watch *watchOldest(void)
+{
+    return (lru.lruNext == &lru) ? NULL : lru.lruNext;
+}
+
+Watch *watchNewer(Watch *w)
+{
+    return (w->lruNext == &lru) ? NULL : w->lruNext;
+}
+
+/* a directory was renamed */
+void watchMove(const char *from, const char *to)
+{
+    WatchNode *n, *parent, *oldParent, *there;
+    const char *slash, *name;
+    char *parentPath, *newName;
+    size_t len;
+
+    n = nodeLookup(from, 0);
+    if (n == NULL || n == root) return;
+
+    /* find (or make) where it's going */
+    slash = strrchr(to, '/');
+    if (slash == NULL) return;
+    parentPath = malloc(slash - to + 1);
+    if (parentPath == NULL) return;
+    memcpy(parentPath, to, slash - to);
+    parentPath[slash - to] = 0;
+    parent = nodeLookup(parentPath, 1);
+    free(parentPath);
+    if (parent == NULL) return;
+
+    name = slash + 1;
+    len = strlen(name);
+    newName = malloc(len + 1);
+    if (newName == NULL) {
+        nodePrune(parent);
+        return;
+    }
+    memcpy(newName, name, len + 1);
+
+    /* whatever it replaced can no longer be found there */
+    there = nodes[nodeSlot(parent, name, len, hashNode(parent, name, len))];
+    if (there && there != n) {
+        nodeRemove(there);
+        there->detached = 1;
+    }
+
+    /* and move it, with everything under it */
+    nodeRemove(n);
+    oldParent = n->parent;
+    parent->children++;
+    n->parent = parent;
+    free(n->name);
+    n->name = newName;
+    n->nameLen = len;
+    n->hash = hashNode(parent, name, len);
+    nodeInsert(n);
+
+    oldParent->children--;
+    nodePrune(oldParent);
+}
+
+/* a watch's path */
+char *watchPath(Watch *w, const char *name)
+{
+    WatchNode *n;
+    size_t len = 0, nameLen = name ? strlen(name) + 1 : 0;
+    char *ret, *pos;
+
+    for (n = w->node; n; n = n->parent)
+        len += n->nameLen + (n->parent ? 1 : 0);
+
+    ret = malloc(len + nameLen + 1);
+    if (ret == NULL) return NULL;
+
+    /* fill it in from the end */
+    if (name) {
+        ret[len] = '/';
+        memcpy(ret + len + 1, name, nameLen);
+    } else {
+        ret[len] = 0;
+    }
+    pos = ret + len;
+    for (n = w->node; n; n = n->parent) {
+        pos -= n->nameLen;
+        memcpy(pos, n->name, n->nameLen);
+        if (n->parent) *--pos = '/';
+    }
+
+    return ret;
+}
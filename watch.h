@@ -0,0 +1,59 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+/* A watched directory's path is a chain of nodes, one per component up to the
+ * root, each shared by everything under it, so renaming a directory only
+ * renames its node. Nodes are found by their parent and name. */
+struct WatchNode_ {
+    struct WatchNode_ *parent;
+    struct Watch_ *watch; /* if this directory is watched */
+    size_t hash, children;
+    int detached; /* replaced by a rename, so no longer findable */
+    size_t nameLen;
+    char *name;
+};
+typedef struct WatchNode_ WatchNode;
+
+/* an inotify watch, found by its descriptor or path, in LRU order */
+struct Watch_ {
+    struct Watch_ *lruPrev, *lruNext;
+    WatchNode *node;
+    int id;
+    unsigned long heat, heatEpoch;
+};
+typedef struct Watch_ Watch;
+
+/* set the directory (an absolute path) everything watched is under */
+int watchInit(const char *root);
+
+/* the watch on a directory (by absolute path), or NULL */
+Watch *watchFind(const char *path);
+
+/* the watch with this descriptor, or NULL */
+Watch *watchById(int id);
+
+/* Record a watch of a directory (by absolute path, under the root), as the
+ * most recently used. If the descriptor is already known, by another path, it
+ * moves to this one. Returns NULL on error. */
+Watch *watchAdd(const char *path, int id);
+
+/* forget a watch */
+void watchDel(Watch *w);
+
+/* make a watch the most recently used */
+void watchTouch(Watch *w);
+
+/* the least recently used watch, then each more recently used, then NULL */
+Watch *watchOldest(void);
+Watch *watchNewer(Watch *w);
+
+/* a directory was renamed (both absolute paths), so move whatever is watched
+ * in it */
+void watchMove(const char *from, const char *to);
+
+/* a watch's path, with /name appended if name isn't NULL, malloc'd */
+char *watchPath(Watch *w, const char *name);
+
+#endif